@@ -0,0 +1,261 @@
+#include "audio.hpp"
+
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+
+
+static void audio_null_write(void* /*context*/, const int16_t* /*samples*/, int /*count*/)
+{
+}
+
+
+AudioSink audio_null_sink()
+{
+    AudioSink sink;
+    sink.write = audio_null_write;
+    return sink;
+}
+
+
+static void audio_write_u32(std::ofstream* file, uint32_t value)
+{
+    file->write((const char*)&value, 4);
+}
+
+
+static void audio_write_u16(std::ofstream* file, uint16_t value)
+{
+    file->write((const char*)&value, 2);
+}
+
+
+//Canonical 44 byte header. Written with zero sizes on Open and again with the real ones on Close
+static void audio_write_wav_header(std::ofstream* file, int sample_rate, uint32_t sample_count)
+{
+    uint32_t data_size = sample_count * (uint32_t)sizeof(int16_t);
+
+    file->write("RIFF", 4);
+    audio_write_u32(file, 36 + data_size);
+    file->write("WAVE", 4);
+
+    file->write("fmt ", 4);
+    audio_write_u32(file, 16);
+    audio_write_u16(file, 1); //PCM
+    audio_write_u16(file, 1); //mono
+    audio_write_u32(file, (uint32_t)sample_rate);
+    audio_write_u32(file, (uint32_t)sample_rate * (uint32_t)sizeof(int16_t)); //bytes per second
+    audio_write_u16(file, (uint16_t)sizeof(int16_t)); //block align
+    audio_write_u16(file, 16); //bits per sample
+
+    file->write("data", 4);
+    audio_write_u32(file, data_size);
+}
+
+
+bool AudioWavSink::Open(const char* filename, int new_sample_rate)
+{
+    Close();
+
+    file.open(std::filesystem::path(filename), std::ios::binary);
+    if (file.good() == false)
+    {
+        printf("WARNING: Opening '%s' for audio failed.\n", filename);
+        return false;
+    }
+
+    sample_rate = new_sample_rate;
+    sample_count = 0;
+    audio_write_wav_header(&file, sample_rate, 0);
+
+    return true;
+}
+
+
+void AudioWavSink::Close()
+{
+    if (file.is_open() == false) return;
+
+    file.seekp(0);
+    audio_write_wav_header(&file, sample_rate, sample_count);
+    file.close();
+}
+
+
+AudioSink AudioWavSink::Sink()
+{
+    AudioSink sink;
+    sink.context = this;
+    sink.write = Write;
+    return sink;
+}
+
+
+//Assumes a little endian host, like the rest of the file formats
+void AudioWavSink::Write(void* context, const int16_t* samples, int count)
+{
+    AudioWavSink* wav = (AudioWavSink*)context;
+    if (wav->file.is_open() == false) return;
+
+    wav->file.write((const char*)samples, count * sizeof(int16_t));
+    wav->sample_count += (uint32_t)count;
+}
+
+
+AudioEngine::~AudioEngine()
+{
+    Stop();
+}
+
+
+void AudioEngine::Init(int new_sample_rate, int tone_hz, int16_t volume, bool new_realtime, AudioSink new_sink)
+{
+    Stop();
+
+    sample_rate = new_sample_rate;
+    realtime = new_realtime;
+    sink = new_sink;
+
+    //A square wave. Any other shape is just a different table
+    wavetable.resize(AUDIO_WAVETABLE_SIZE);
+    for (int i = 0; i < AUDIO_WAVETABLE_SIZE; i++)
+    {
+        wavetable[i] = (i < (AUDIO_WAVETABLE_SIZE / 2)) ? (int16_t)-volume : volume;
+    }
+
+    //The phase wraps at 2^32, one full period
+    phase = 0;
+    phase_step = (uint32_t)(((uint64_t)tone_hz << 32) / (uint64_t)sample_rate);
+
+    tone_on = false;
+    sample_position = 0;
+    sample_offset = 0;
+    anchored = false;
+
+    block.resize(AUDIO_BLOCK_SIZE);
+}
+
+
+void AudioEngine::Start()
+{
+    if (running) return;
+
+    running = true;
+    thread = std::thread(&AudioEngine::ThreadLoop, this);
+}
+
+
+void AudioEngine::Stop()
+{
+    if (running == false) return;
+
+    running = false;
+    thread.join();
+}
+
+
+void AudioEngine::ThreadLoop()
+{
+    while (running)
+    {
+        Render(block.data(), AUDIO_BLOCK_SIZE);
+        sink.write(sink.context, block.data(), AUDIO_BLOCK_SIZE);
+    }
+}
+
+
+int64_t AudioEngine::TimeToSample(uint64_t time) const
+{
+    //Whole frames and the fraction separately so long runs can't overflow
+    uint64_t frames = time >> 16;
+    uint64_t fraction = time & 0xFFFF;
+
+    return (int64_t)(((frames * sample_rate) / EMULATOR_FRAMES_PER_SECOND) +
+    ((fraction * sample_rate) / ((uint64_t)EMULATOR_FRAMES_PER_SECOND << 16)));
+}
+
+
+int64_t AudioEngine::EventSample(const SoundEvent& event)
+{
+    int64_t sample = TimeToSample(event.time);
+
+    if (realtime)
+    {
+        //The emulation isn't running in step with the output (first event, paused, rewound, turbo, clock drift).
+        //Line the two up again with this event a little ahead of what's being played
+        int64_t position = (int64_t)sample_position;
+        int64_t late_limit = position - (sample_rate / EMULATOR_FRAMES_PER_SECOND);
+        int64_t early_limit = position + latency_samples + ((sample_rate / EMULATOR_FRAMES_PER_SECOND) * 4);
+
+        int64_t placed = sample + sample_offset;
+        if ((anchored == false) || (placed < late_limit) || (placed > early_limit))
+        {
+            sample_offset = (position + latency_samples) - sample;
+            anchored = true;
+        }
+    }
+
+    return sample + sample_offset;
+}
+
+
+void AudioEngine::Render(int16_t* out, int count)
+{
+    int64_t block_start = (int64_t)sample_position;
+    int i = 0;
+
+    while (i < count)
+    {
+        //Render up to the next event in this block, or the end of it
+        int end = count;
+
+        const SoundEvent* event = events.Peek();
+        if (event)
+        {
+            int64_t at = EventSample(*event) - block_start;
+            if (at <= i)
+            {
+                tone_on = (event->on != 0);
+                events.Pop();
+                continue;
+            }
+
+            if (at < count)
+            {
+                end = (int)at;
+            }
+        }
+
+        if (tone_on)
+        {
+            for (int s = i; s < end; s++)
+            {
+                out[s] = wavetable[phase >> 24];
+                phase += phase_step;
+            }
+        }
+        else
+        {
+            memset(out + i, 0, (end - i) * sizeof(int16_t));
+        }
+
+        i = end;
+    }
+
+    sample_position += count;
+}
+
+
+void AudioEngine::RenderUntil(uint64_t time)
+{
+    int64_t target = TimeToSample(time) + sample_offset;
+
+    while ((int64_t)sample_position < target)
+    {
+        int64_t remaining = target - (int64_t)sample_position;
+        int count = (remaining < AUDIO_BLOCK_SIZE) ? (int)remaining : AUDIO_BLOCK_SIZE;
+
+        Render(block.data(), count);
+        sink.write(sink.context, block.data(), count);
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "emulator.hpp"
+
+#include <atomic>
+#include <stdint.h>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+const int AUDIO_DEFAULT_SAMPLE_RATE = 44100;
+const int AUDIO_DEFAULT_TONE_HZ = 600;
+const int16_t AUDIO_DEFAULT_VOLUME = 200;
+const int AUDIO_BLOCK_SIZE = 512; //samples the audio thread renders at a time. ~11.6ms at 44100Hz
+const int AUDIO_WAVETABLE_SIZE = 256; //one period of the tone. The phase's top 8 bits index it
+
+
+//Where rendered samples go. Mono, 16 bit. write is called from the audio thread in realtime mode and
+//is what paces it, so a device sink should block until the device has room
+struct AudioSink
+{
+    void* context = nullptr;
+    void (*write)(void* context, const int16_t* samples, int count) = nullptr;
+};
+
+AudioSink audio_null_sink(); //throws the samples away. For headless runs that only want the timing
+
+
+//Writes everything to a 16 bit mono WAV file. The header's sizes are filled in by Close
+struct AudioWavSink
+{
+    std::ofstream file;
+    uint32_t sample_count = 0;
+    int sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+
+    bool Open(const char* filename, int new_sample_rate);
+    void Close();
+
+    AudioSink Sink();
+    static void Write(void* context, const int16_t* samples, int count);
+};
+
+
+//Turns the emulator's beeper events into a tone. Events are placed on the exact sample their emulated time maps to.
+//Realtime mode runs on its own thread and lines emulated time up with the output stream, starting over whenever
+//the two drift too far apart (pauses, rewinding, turbo). Offline mode maps frame 0 to sample 0 and is driven by
+//RenderUntil, so the output is the same every run
+struct AudioEngine
+{
+    int sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+    bool realtime = true;
+
+    std::vector<int16_t> wavetable;
+    uint32_t phase = 0; //32 bit fixed point position in the wavetable
+    uint32_t phase_step = 0;
+    bool tone_on = false;
+
+    //Written by the emulation thread through Emulator::sound_events, read by whoever renders
+    SoundEventQueue events;
+
+    uint64_t sample_position = 0; //samples rendered so far
+    int64_t sample_offset = 0; //added to an event's emulated time in samples to get its stream position
+    bool anchored = false;
+    int latency_samples = AUDIO_BLOCK_SIZE * 2; //realtime mode. how far ahead of the stream new events land
+
+    AudioSink sink;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::vector<int16_t> block;
+
+    AudioEngine() = default;
+    ~AudioEngine();
+
+    AudioEngine(const AudioEngine&) = delete;
+    AudioEngine& operator=(const AudioEngine&) = delete;
+
+    void Init(int new_sample_rate, int tone_hz, int16_t volume, bool new_realtime, AudioSink new_sink);
+
+    //Realtime mode. Renders blocks into the sink on the audio thread until Stop
+    void Start();
+    void Stop();
+
+    //Fills out with the next count samples, applying every event that lands inside them
+    void Render(int16_t* out, int count);
+
+    //Offline mode. Renders into the sink up to where the emulated time maps to
+    void RenderUntil(uint64_t time);
+
+    int64_t TimeToSample(uint64_t time) const; //without the offset
+    int64_t EventSample(const SoundEvent& event);
+
+    void ThreadLoop();
+};
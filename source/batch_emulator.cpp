@@ -0,0 +1,927 @@
+#include "batch_emulator.hpp"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define BATCH_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define BATCH_SIMD 0
+#endif
+
+//GCC and clang only emit AVX2 instructions in functions marked for it. MSVC doesn't need this
+#if defined(__GNUC__) || defined(__clang__)
+#define BATCH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BATCH_TARGET_AVX2
+#endif
+
+
+//decode_instruction only depends on the instruction, so every lane shares the one table of all 65536 of them.
+//Nothing has to be invalidated when a lane writes to its memory
+static const DecodedOp* const batch_decoded = decode_table();
+
+
+#if BATCH_SIMD
+static bool batch_cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) return false;
+
+    //The OS has to save the YMM registers
+    if ((_xgetbv(0) & 0x6) != 0x6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+
+//Instructions that only touch registers, timers, I and the program counter. These run as masked AVX2 kernels
+static bool batch_op_is_vectorized(int handler)
+{
+    switch (handler)
+    {
+        case OP_NOP:
+        case OP_JUMP:
+        case OP_SKIP_EQ_NN:
+        case OP_SKIP_NE_NN:
+        case OP_SKIP_EQ_VY:
+        case OP_SKIP_NE_VY:
+        case OP_SET_NN:
+        case OP_ADD_NN:
+        case OP_SET_VY:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        case OP_ADD_VY:
+        case OP_SUB:
+        case OP_SUBN:
+        case OP_SHIFT_RIGHT:
+        case OP_SHIFT_LEFT:
+        case OP_SET_I:
+        case OP_ADD_I:
+        case OP_GET_DELAY:
+        case OP_SET_DELAY:
+        case OP_SET_SOUND:
+            return true;
+    }
+
+    return false;
+}
+
+
+void BatchEmulator::Init(int new_lane_count)
+{
+    lane_count = (new_lane_count > 0) ? new_lane_count : 1;
+    lane_stride = ((lane_count + BATCH_LANE_ALIGNMENT - 1) / BATCH_LANE_ALIGNMENT) * BATCH_LANE_ALIGNMENT;
+
+    tic = 0;
+    instructions_executed = 0;
+
+    v.assign(EMULATOR_REGISTER_COUNT * lane_stride, 0);
+    stack.assign(EMULATOR_STACK_SIZE * lane_stride, 0);
+    keys.assign(EMULATOR_KEY_COUNT * lane_stride, 0);
+
+    I.assign(lane_stride, 0);
+    program_counter.assign(lane_stride, 0x200);
+    stack_pointer.assign(lane_stride, 0);
+    delay_timer.assign(lane_stride, 0);
+    sound_timer.assign(lane_stride, 0);
+    key_just_pressed.assign(lane_stride, 0);
+    last_key_pressed.assign(lane_stride, 0);
+    get_key_key_pressed.assign(lane_stride, 0);
+    random_state.assign(lane_stride, random_state_for_seed(0));
+
+    memory.assign((size_t)EMULATOR_RAM_SIZE * lane_stride, 0);
+    for (int i = 0; i < (int)sizeof(font_data); i++)
+    {
+        memset(Memory(FONT_ADDRESS + i), font_data[i], lane_stride);
+    }
+
+    display.assign((size_t)lane_count * DISPLAY_HEIGHT, 0);
+
+    instructions.assign(lane_stride, 0);
+    group_ids.assign(lane_stride, BATCH_GROUP_NONE);
+    groups_uniform = false;
+
+#if BATCH_SIMD
+    use_avx2 = batch_cpu_has_avx2();
+#else
+    use_avx2 = false;
+#endif
+}
+
+
+bool BatchEmulator::LoadProgram(int lane, const uint8_t* data, int size)
+{
+    if ((size < 0) || (size > (EMULATOR_RAM_SIZE - 0x200))) return false;
+
+    for (int i = 0; i < EMULATOR_REGISTER_COUNT; i++)
+    {
+        V(i)[lane] = 0;
+    }
+    for (int i = 0; i < EMULATOR_STACK_SIZE; i++)
+    {
+        stack[(i * lane_stride) + lane] = 0;
+    }
+    for (int i = 0; i < EMULATOR_KEY_COUNT; i++)
+    {
+        keys[(i * lane_stride) + lane] = 0;
+    }
+
+    I[lane] = 0;
+    program_counter[lane] = 0x200;
+    stack_pointer[lane] = 0;
+    delay_timer[lane] = 0;
+    sound_timer[lane] = 0;
+    key_just_pressed[lane] = 0;
+    last_key_pressed[lane] = 0;
+    get_key_key_pressed[lane] = 0;
+
+    for (int address = 0; address < EMULATOR_RAM_SIZE; address++)
+    {
+        uint8_t value = 0;
+        if ((address >= FONT_ADDRESS) && (address < (FONT_ADDRESS + (int)sizeof(font_data))))
+        {
+            value = font_data[address - FONT_ADDRESS];
+        }
+        else if ((address >= 0x200) && (address < (0x200 + size)))
+        {
+            value = data[address - 0x200];
+        }
+
+        Memory(address)[lane] = value;
+    }
+
+    memset(LaneDisplay(lane), 0, DISPLAY_HEIGHT * sizeof(DisplayRow));
+
+    return true;
+}
+
+
+void BatchEmulator::LoadLane(int lane, const Emulator& emu)
+{
+    for (int i = 0; i < EMULATOR_REGISTER_COUNT; i++)
+    {
+        V(i)[lane] = emu.v[i];
+    }
+    for (int i = 0; i < EMULATOR_STACK_SIZE; i++)
+    {
+        stack[(i * lane_stride) + lane] = emu.stack[i];
+    }
+    for (int i = 0; i < EMULATOR_KEY_COUNT; i++)
+    {
+        keys[(i * lane_stride) + lane] = emu.keypad.keys[i];
+    }
+
+    I[lane] = emu.I;
+    program_counter[lane] = emu.program_counter;
+    stack_pointer[lane] = emu.stack_pointer;
+    delay_timer[lane] = emu.delay_timer;
+    sound_timer[lane] = emu.sound_timer;
+    key_just_pressed[lane] = emu.keypad.key_just_pressed ? 1 : 0;
+    last_key_pressed[lane] = (uint8_t)emu.keypad.last_key_pressed;
+    get_key_key_pressed[lane] = emu.get_key_key_pressed ? 1 : 0;
+    random_state[lane] = emu.random_state;
+
+    for (int address = 0; address < EMULATOR_RAM_SIZE; address++)
+    {
+        Memory(address)[lane] = emu.ReadMemory((uint16_t)address);
+    }
+    memcpy(LaneDisplay(lane), emu.display.data(), DISPLAY_HEIGHT * sizeof(DisplayRow));
+}
+
+
+void BatchEmulator::StoreLane(int lane, Emulator* emu) const
+{
+    for (int i = 0; i < EMULATOR_REGISTER_COUNT; i++)
+    {
+        emu->v[i] = V(i)[lane];
+    }
+    for (int i = 0; i < EMULATOR_STACK_SIZE; i++)
+    {
+        emu->stack[i] = stack[(i * lane_stride) + lane];
+    }
+    for (int i = 0; i < EMULATOR_KEY_COUNT; i++)
+    {
+        emu->keypad.keys[i] = keys[(i * lane_stride) + lane];
+    }
+
+    emu->I = I[lane];
+    emu->program_counter = program_counter[lane];
+    emu->stack_pointer = stack_pointer[lane];
+    emu->delay_timer = delay_timer[lane];
+    emu->sound_timer = sound_timer[lane];
+    emu->keypad.key_just_pressed = (key_just_pressed[lane] != 0);
+    emu->keypad.last_key_pressed = (int8_t)last_key_pressed[lane];
+    emu->get_key_key_pressed = (get_key_key_pressed[lane] != 0);
+    emu->random_state = random_state[lane];
+
+    //Only the pages this lane changed stop being shared with the emulator's ROM image
+    for (int address = 0; address < EMULATOR_RAM_SIZE; address++)
+    {
+        emu->WriteMemory((uint16_t)address, Memory(address)[lane]);
+    }
+
+    memcpy(emu->display.data(), LaneDisplay(lane), DISPLAY_HEIGHT * sizeof(DisplayRow));
+    emu->InvalidateDisplay();
+
+    emu->SetCompatibilityMode(compatibility_mode);
+    emu->SetInstructionsPerFrame(instructions_per_frame);
+    emu->tic = tic;
+}
+
+
+void BatchEmulator::SetKeypadKey(int lane, int index, uint8_t new_state)
+{
+    keys[(index * lane_stride) + lane] = new_state;
+    if (new_state == 1)
+    {
+        key_just_pressed[lane] = 1;
+        last_key_pressed[lane] = (uint8_t)index;
+    }
+}
+
+
+void BatchEmulator::SetInstructionsPerFrame(int count)
+{
+    if (count < 1)
+    {
+        count = 1;
+    }
+    if (count > EMULATOR_MAX_INSTRUCTIONS_PER_FRAME)
+    {
+        count = EMULATOR_MAX_INSTRUCTIONS_PER_FRAME;
+    }
+
+    instructions_per_frame = count;
+}
+
+
+void BatchEmulator::Update()
+{
+    tic++;
+
+    //Plain loops over bytes. The compiler vectorizes these on its own
+    for (int lane = 0; lane < lane_stride; lane++)
+    {
+        delay_timer[lane] -= (delay_timer[lane] > 0) ? 1 : 0;
+        sound_timer[lane] -= (sound_timer[lane] > 0) ? 1 : 0;
+    }
+
+    ExecuteInstructions(instructions_per_frame);
+
+    memset(key_just_pressed.data(), 0, lane_stride);
+}
+
+
+void BatchEmulator::ExecuteInstructions(int count)
+{
+    switch (quirk_profile_for_mode(compatibility_mode))
+    {
+        case QUIRK_PROFILE_COSMAC: ExecuteInstructionsWith<QuirksCosmac>(count); break;
+        case QUIRK_PROFILE_AMIGA: ExecuteInstructionsWith<QuirksAmiga>(count); break;
+        default: ExecuteInstructionsWith<QuirksModern>(count); break;
+    }
+
+    instructions_executed += (uint64_t)count * lane_count;
+
+    //Lanes that ran off the end of memory are parked on the last address, like Emulator
+    for (int lane = 0; lane < lane_count; lane++)
+    {
+        if (program_counter[lane] >= EMULATOR_RAM_SIZE)
+        {
+            program_counter[lane] = EMULATOR_RAM_SIZE - 2;
+        }
+    }
+}
+
+
+int BatchEmulator::GroupLanes(uint16_t* group_instructions)
+{
+    int group_count = 0;
+
+    for (int lane = 0; lane < lane_count; lane++)
+    {
+        uint16_t pc = program_counter[lane];
+        if (pc >= (EMULATOR_RAM_SIZE - 2))
+        {
+            group_ids[lane] = BATCH_GROUP_NONE;
+            continue;
+        }
+
+        uint16_t instruction = (uint16_t)((Memory(pc)[lane] << 8) | Memory(pc + 1)[lane]);
+        instructions[lane] = instruction;
+
+        //Almost always the first group, lanes running the same program tend to stay together
+        int group = 0;
+        while ((group < group_count) && (group_instructions[group] != instruction))
+        {
+            group++;
+        }
+
+        if (group == group_count)
+        {
+            if (group_count == BATCH_MAX_GROUPS)
+            {
+                group_ids[lane] = BATCH_GROUP_SCALAR;
+                continue;
+            }
+
+            group_instructions[group_count] = instruction;
+            group_count++;
+        }
+
+        group_ids[lane] = (uint8_t)group;
+    }
+
+    return group_count;
+}
+
+
+int BatchEmulator::UniformInstruction() const
+{
+    uint16_t pc = program_counter[0];
+    if (pc >= (EMULATOR_RAM_SIZE - 2)) return -1;
+
+    const uint8_t* high = Memory(pc);
+    const uint8_t* low = Memory(pc + 1);
+
+    //Or-ing the differences together instead of returning early lets the compiler vectorize both loops
+    uint16_t pc_difference = 0;
+    for (int lane = 0; lane < lane_count; lane++)
+    {
+        pc_difference |= program_counter[lane] ^ pc;
+    }
+    if (pc_difference) return -1;
+
+    uint8_t instruction_difference = 0;
+    for (int lane = 0; lane < lane_count; lane++)
+    {
+        instruction_difference |= (high[lane] ^ high[0]) | (low[lane] ^ low[0]);
+    }
+    if (instruction_difference) return -1;
+
+    return (high[0] << 8) | low[0];
+}
+
+
+#if BATCH_SIMD
+//A 32 lane byte mask widened to two 16 lane word masks, for the 16 bit registers
+BATCH_TARGET_AVX2 static inline __m256i batch_mask_to_words(__m256i mask, int half)
+{
+    __m128i bytes = (half == 0) ? _mm256_castsi256_si128(mask) : _mm256_extracti128_si256(mask, 1);
+    return _mm256_cvtepi8_epi16(bytes);
+}
+
+//Unsigned a >= b for bytes
+BATCH_TARGET_AVX2 static inline __m256i batch_greater_equal_u8(__m256i a, __m256i b)
+{
+    return _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a);
+}
+
+
+//Runs one group's instruction on every lane of the group, 32 lanes at a time. Lanes outside the group are left as
+//they are by blending with the mask. Writes happen in the same order as the interpreter so vx and vf aliasing
+//comes out the same
+template <typename Quirks>
+BATCH_TARGET_AVX2 static void batch_execute_group_avx2(BatchEmulator* batch, const DecodedOp& op, uint8_t group)
+{
+    const int stride = batch->lane_stride;
+    uint8_t* vx_row = batch->V(op.x);
+    uint8_t* vy_row = batch->V(op.y);
+    uint8_t* vf_row = batch->V(0xF);
+
+    const __m256i group_vector = _mm256_set1_epi8((char)group);
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i twos = _mm256_set1_epi8(2);
+
+    for (int base = 0; base < stride; base += BATCH_LANE_ALIGNMENT)
+    {
+        __m256i mask = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(batch->group_ids.data() + base)),
+        group_vector);
+        if (_mm256_movemask_epi8(mask) == 0) continue;
+
+        __m256i vx = _mm256_loadu_si256((const __m256i*)(vx_row + base));
+        __m256i vy = _mm256_loadu_si256((const __m256i*)(vy_row + base));
+
+        //How far each lane's program counter moves. 0 outside the group
+        __m256i advance = _mm256_and_si256(mask, twos);
+
+        //Results for vx and vf, blended in after the switch when set
+        __m256i result = vx;
+        bool writes_vx = false;
+        __m256i flag = _mm256_setzero_si256();
+        bool writes_vf = false;
+
+        switch (op.handler)
+        {
+            case OP_SKIP_EQ_NN:
+            case OP_SKIP_NE_NN:
+            case OP_SKIP_EQ_VY:
+            case OP_SKIP_NE_VY:
+            {
+                __m256i other = ((op.handler == OP_SKIP_EQ_NN) || (op.handler == OP_SKIP_NE_NN)) ?
+                _mm256_set1_epi8((char)op.nn) : vy;
+
+                __m256i equal = _mm256_cmpeq_epi8(vx, other);
+                __m256i skip = ((op.handler == OP_SKIP_EQ_NN) || (op.handler == OP_SKIP_EQ_VY)) ?
+                equal : _mm256_andnot_si256(equal, _mm256_set1_epi8(-1));
+
+                advance = _mm256_add_epi8(advance, _mm256_and_si256(_mm256_and_si256(skip, mask), twos));
+            } break;
+
+            case OP_SET_NN: result = _mm256_set1_epi8((char)op.nn); writes_vx = true; break;
+            case OP_ADD_NN: result = _mm256_add_epi8(vx, _mm256_set1_epi8((char)op.nn)); writes_vx = true; break;
+            case OP_SET_VY: result = vy; writes_vx = true; break;
+
+            case OP_OR:
+            case OP_AND:
+            case OP_XOR:
+            {
+                if (op.handler == OP_OR) result = _mm256_or_si256(vx, vy);
+                else if (op.handler == OP_AND) result = _mm256_and_si256(vx, vy);
+                else result = _mm256_xor_si256(vx, vy);
+
+                writes_vx = true;
+                writes_vf = Quirks::LOGIC_RESETS_VF;
+            } break;
+
+            case OP_ADD_VY:
+            {
+                result = _mm256_add_epi8(vx, vy);
+
+                //Carried if the sum wrapped below vx
+                __m256i no_carry = batch_greater_equal_u8(result, vx);
+                flag = _mm256_andnot_si256(no_carry, ones);
+
+                writes_vx = true;
+                writes_vf = true;
+            } break;
+
+            case OP_SUB:
+            {
+                result = _mm256_sub_epi8(vx, vy);
+                flag = _mm256_and_si256(batch_greater_equal_u8(vx, vy), ones);
+                writes_vx = true;
+                writes_vf = true;
+            } break;
+
+            case OP_SUBN:
+            {
+                result = _mm256_sub_epi8(vy, vx);
+                flag = _mm256_and_si256(batch_greater_equal_u8(vy, vx), ones);
+                writes_vx = true;
+                writes_vf = true;
+            } break;
+
+            case OP_SHIFT_RIGHT:
+            {
+                __m256i source = Quirks::SHIFT_USES_VY ? vy : vx;
+                flag = _mm256_and_si256(source, ones);
+                result = _mm256_and_si256(_mm256_srli_epi16(source, 1), _mm256_set1_epi8(0x7F));
+                writes_vx = true;
+                writes_vf = true;
+            } break;
+
+            case OP_SHIFT_LEFT:
+            {
+                __m256i source = Quirks::SHIFT_USES_VY ? vy : vx;
+                flag = _mm256_and_si256(_mm256_srli_epi16(source, 7), ones);
+                result = _mm256_add_epi8(source, source);
+                writes_vx = true;
+                writes_vf = true;
+            } break;
+
+            case OP_GET_DELAY:
+            {
+                result = _mm256_loadu_si256((const __m256i*)(batch->delay_timer.data() + base));
+                writes_vx = true;
+            } break;
+
+            case OP_SET_DELAY:
+            case OP_SET_SOUND:
+            {
+                uint8_t* timer = (op.handler == OP_SET_DELAY) ? batch->delay_timer.data() : batch->sound_timer.data();
+                __m256i old_timer = _mm256_loadu_si256((const __m256i*)(timer + base));
+                _mm256_storeu_si256((__m256i*)(timer + base), _mm256_blendv_epi8(old_timer, vx, mask));
+            } break;
+
+            case OP_ADD_I:
+            {
+                //I is 16 bit. vf is only set if some lane went past the end of memory
+                __m256i overflow_bytes[2];
+                for (int half = 0; half < 2; half++)
+                {
+                    uint16_t* I = batch->I.data() + base + (half * 16);
+                    __m256i word_mask = batch_mask_to_words(mask, half);
+                    __m256i vx_words = _mm256_cvtepu8_epi16((half == 0) ?
+                    _mm256_castsi256_si128(vx) : _mm256_extracti128_si256(vx, 1));
+
+                    __m256i new_I = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)I),
+                    _mm256_and_si256(vx_words, word_mask));
+                    _mm256_storeu_si256((__m256i*)I, new_I);
+
+                    //I > 0x1000 unsigned
+                    __m256i in_range = _mm256_cmpeq_epi16(_mm256_min_epu16(new_I, _mm256_set1_epi16(0x1000)), new_I);
+                    overflow_bytes[half] = _mm256_andnot_si256(in_range, word_mask);
+                }
+
+                if (Quirks::ADD_I_SETS_VF_ON_OVERFLOW)
+                {
+                    //Back down to one byte per lane. packs works per 128 bit half, the permute puts them in order
+                    __m256i overflow = _mm256_permute4x64_epi64(_mm256_packs_epi16(overflow_bytes[0], overflow_bytes[1]),
+                    0xD8);
+                    __m256i vf = _mm256_loadu_si256((const __m256i*)(vf_row + base));
+                    _mm256_storeu_si256((__m256i*)(vf_row + base), _mm256_blendv_epi8(vf, ones, overflow));
+                }
+            } break;
+
+            case OP_JUMP:
+            {
+                advance = _mm256_setzero_si256();
+                for (int half = 0; half < 2; half++)
+                {
+                    uint16_t* pc = batch->program_counter.data() + base + (half * 16);
+                    __m256i old_pc = _mm256_loadu_si256((const __m256i*)pc);
+                    _mm256_storeu_si256((__m256i*)pc, _mm256_blendv_epi8(old_pc, _mm256_set1_epi16((short)op.nnn),
+                    batch_mask_to_words(mask, half)));
+                }
+            } break;
+
+            case OP_SET_I:
+            {
+                for (int half = 0; half < 2; half++)
+                {
+                    uint16_t* I = batch->I.data() + base + (half * 16);
+                    __m256i old_I = _mm256_loadu_si256((const __m256i*)I);
+                    _mm256_storeu_si256((__m256i*)I, _mm256_blendv_epi8(old_I, _mm256_set1_epi16((short)op.nnn),
+                    batch_mask_to_words(mask, half)));
+                }
+            } break;
+        }
+
+        if (writes_vx)
+        {
+            _mm256_storeu_si256((__m256i*)(vx_row + base), _mm256_blendv_epi8(vx, result, mask));
+        }
+
+        //After vx, so vf wins when x is f
+        if (writes_vf)
+        {
+            __m256i vf = _mm256_loadu_si256((const __m256i*)(vf_row + base));
+            _mm256_storeu_si256((__m256i*)(vf_row + base), _mm256_blendv_epi8(vf, flag, mask));
+        }
+
+        for (int half = 0; half < 2; half++)
+        {
+            uint16_t* pc = batch->program_counter.data() + base + (half * 16);
+            __m256i advance_words = _mm256_cvtepu8_epi16((half == 0) ?
+            _mm256_castsi256_si128(advance) : _mm256_extracti128_si256(advance, 1));
+
+            _mm256_storeu_si256((__m256i*)pc, _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)pc), advance_words));
+        }
+    }
+}
+#endif
+
+
+template <typename Quirks>
+void BatchEmulator::ExecuteInstructionsWith(int count)
+{
+#if BATCH_SIMD
+    if (use_avx2)
+    {
+        uint16_t group_instructions[BATCH_MAX_GROUPS];
+        bool run_scalar[256];
+
+        for (int step = 0; step < count; step++)
+        {
+            //Lanes running the same program usually stay together. Then there's one group with every lane
+            int uniform = UniformInstruction();
+            if (uniform >= 0)
+            {
+                if (groups_uniform == false)
+                {
+                    memset(group_ids.data(), 0, lane_count);
+                    groups_uniform = true;
+                }
+
+                const DecodedOp& op = batch_decoded[uniform];
+                if (batch_op_is_vectorized(op.handler))
+                {
+                    batch_execute_group_avx2<Quirks>(this, op, 0);
+                }
+                else
+                {
+                    for (int lane = 0; lane < lane_count; lane++)
+                    {
+                        ExecuteLane<Quirks>(lane, op);
+                    }
+                }
+
+                continue;
+            }
+
+            groups_uniform = false;
+            int group_count = GroupLanes(group_instructions);
+
+            memset(run_scalar, 0, sizeof(run_scalar));
+            run_scalar[BATCH_GROUP_SCALAR] = true;
+
+            for (int group = 0; group < group_count; group++)
+            {
+                const DecodedOp& op = batch_decoded[group_instructions[group]];
+                if (batch_op_is_vectorized(op.handler))
+                {
+                    batch_execute_group_avx2<Quirks>(this, op, (uint8_t)group);
+                }
+                else
+                {
+                    run_scalar[group] = true;
+                }
+            }
+
+            for (int lane = 0; lane < lane_count; lane++)
+            {
+                if (run_scalar[group_ids[lane]])
+                {
+                    ExecuteLane<Quirks>(lane, batch_decoded[instructions[lane]]);
+                }
+            }
+        }
+
+        return;
+    }
+#endif
+
+    //Lanes don't affect each other, so without AVX2 each one runs all of its instructions before the next
+    for (int lane = 0; lane < lane_count; lane++)
+    {
+        for (int step = 0; step < count; step++)
+        {
+            uint16_t pc = program_counter[lane];
+            if (pc >= (EMULATOR_RAM_SIZE - 2)) continue;
+
+            uint16_t instruction = (uint16_t)((Memory(pc)[lane] << 8) | Memory(pc + 1)[lane]);
+            ExecuteLane<Quirks>(lane, batch_decoded[instruction]);
+        }
+    }
+}
+
+
+//One instruction on one lane. The same as the interpreter's switch, on the lane's slice of the arrays
+template <typename Quirks>
+void BatchEmulator::ExecuteLane(int lane, const DecodedOp& op)
+{
+    const int stride = lane_stride;
+    uint8_t* lane_v = v.data() + lane; //register r is lane_v[r * stride]
+    uint16_t* lane_stack = stack.data() + lane;
+    uint8_t* lane_memory = memory.data() + lane; //address a is lane_memory[a * stride]
+
+    uint16_t pc = program_counter[lane];
+
+    uint8_t x = op.x;
+    uint8_t y = op.y;
+    uint8_t nn = op.nn;
+    uint16_t nnn = op.nnn;
+
+    uint8_t vx = lane_v[x * stride];
+    uint8_t vy = lane_v[y * stride];
+    uint8_t& vf = lane_v[0xF * stride];
+
+    bool increment_pc = true;
+
+    switch (op.handler)
+    {
+        case OP_CLEAR:
+        {
+            memset(LaneDisplay(lane), 0, DISPLAY_HEIGHT * sizeof(DisplayRow));
+        } break;
+
+        case OP_RETURN:
+        {
+            uint8_t sp = (stack_pointer[lane] - 1) & (EMULATOR_STACK_SIZE - 1);
+            stack_pointer[lane] = sp;
+            pc = lane_stack[sp * stride];
+            lane_stack[sp * stride] = 0;
+        } break;
+
+        case OP_JUMP:
+        {
+            pc = nnn;
+            increment_pc = false;
+        } break;
+
+        case OP_CALL:
+        {
+            uint8_t sp = stack_pointer[lane] & (EMULATOR_STACK_SIZE - 1);
+            lane_stack[sp * stride] = pc;
+            stack_pointer[lane] = (sp + 1) & (EMULATOR_STACK_SIZE - 1);
+
+            pc = nnn;
+            increment_pc = false;
+        } break;
+
+        case OP_SKIP_EQ_NN: if (vx == nn) pc += 2; break;
+        case OP_SKIP_NE_NN: if (vx != nn) pc += 2; break;
+        case OP_SKIP_EQ_VY: if (vx == vy) pc += 2; break;
+        case OP_SKIP_NE_VY: if (vx != vy) pc += 2; break;
+
+        case OP_SET_NN: lane_v[x * stride] = nn; break;
+        case OP_ADD_NN: lane_v[x * stride] += nn; break;
+        case OP_SET_I: I[lane] = nnn; break;
+
+        case OP_JUMP_OFFSET:
+        {
+            pc = nnn + (Quirks::JUMP_OFFSET_USES_V0 ? lane_v[0] : vx);
+            increment_pc = false;
+        } break;
+
+        case OP_RANDOM:
+        {
+            lane_v[x * stride] = random_next(&random_state[lane]) & nn;
+        } break;
+
+        case OP_SKIP_KEY:
+        {
+            if (keys[((vx % EMULATOR_KEY_COUNT) * stride) + lane] == 1) pc += 2;
+        } break;
+
+        case OP_SKIP_NOT_KEY:
+        {
+            if (keys[((vx % EMULATOR_KEY_COUNT) * stride) + lane] == 0) pc += 2;
+        } break;
+
+        case OP_GET_DELAY: lane_v[x * stride] = delay_timer[lane]; break;
+        case OP_SET_DELAY: delay_timer[lane] = vx; break;
+        case OP_SET_SOUND: sound_timer[lane] = vx; break;
+
+        case OP_ADD_I:
+        {
+            I[lane] += vx;
+
+            if (Quirks::ADD_I_SETS_VF_ON_OVERFLOW && (I[lane] > 0x1000))
+            {
+                vf = 1;
+            }
+        } break;
+
+        case OP_GET_KEY:
+        {
+            if (get_key_key_pressed[lane])
+            {
+                if (keys[(last_key_pressed[lane] * stride) + lane] != 0) //not yet released
+                {
+                    increment_pc = false;
+                }
+                else
+                {
+                    lane_v[x * stride] = last_key_pressed[lane];
+                    get_key_key_pressed[lane] = 0;
+                }
+            }
+            else
+            {
+                increment_pc = false;
+                if (key_just_pressed[lane])
+                {
+                    get_key_key_pressed[lane] = 1;
+                }
+            }
+        } break;
+
+        case OP_FONT_CHAR:
+        {
+            I[lane] = FONT_ADDRESS + ((vx % EMULATOR_KEY_COUNT) * FONT_CHAR_HEIGHT);
+        } break;
+
+        case OP_BCD:
+        {
+            lane_memory[((I[lane] + 0) % EMULATOR_RAM_SIZE) * stride] = vx / 100;
+            lane_memory[((I[lane] + 1) % EMULATOR_RAM_SIZE) * stride] = (vx / 10) % 10;
+            lane_memory[((I[lane] + 2) % EMULATOR_RAM_SIZE) * stride] = vx % 10;
+        } break;
+
+        case OP_STORE:
+        {
+            for (int i = 0; i <= x; i++)
+            {
+                lane_memory[((I[lane] + i) % EMULATOR_RAM_SIZE) * stride] = lane_v[i * stride];
+            }
+
+            if (Quirks::LOAD_STORE_INCREMENTS_I)
+            {
+                I[lane] += x + 1;
+            }
+        } break;
+
+        case OP_LOAD:
+        {
+            for (int i = 0; i <= x; i++)
+            {
+                lane_v[i * stride] = lane_memory[((I[lane] + i) % EMULATOR_RAM_SIZE) * stride];
+            }
+
+            if (Quirks::LOAD_STORE_INCREMENTS_I)
+            {
+                I[lane] += x + 1;
+            }
+        } break;
+
+        case OP_SET_VY: lane_v[x * stride] = vy; break;
+
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        {
+            if (op.handler == OP_OR) lane_v[x * stride] = vx | vy;
+            else if (op.handler == OP_AND) lane_v[x * stride] = vx & vy;
+            else lane_v[x * stride] = vx ^ vy;
+
+            if (Quirks::LOGIC_RESETS_VF)
+            {
+                vf = 0;
+            }
+        } break;
+
+        case OP_ADD_VY:
+        {
+            lane_v[x * stride] = vx + vy;
+            vf = ((vx + vy) > 255) ? 1 : 0;
+        } break;
+
+        case OP_SUB:
+        {
+            lane_v[x * stride] = vx - vy;
+            vf = (vx >= vy) ? 1 : 0;
+        } break;
+
+        case OP_SUBN:
+        {
+            lane_v[x * stride] = vy - vx;
+            vf = (vy >= vx) ? 1 : 0;
+        } break;
+
+        case OP_SHIFT_RIGHT:
+        {
+            uint8_t source = Quirks::SHIFT_USES_VY ? vy : vx;
+            lane_v[x * stride] = source >> 1;
+            vf = source & 1;
+        } break;
+
+        case OP_SHIFT_LEFT:
+        {
+            uint8_t source = Quirks::SHIFT_USES_VY ? vy : vx;
+            lane_v[x * stride] = (uint8_t)(source << 1);
+            vf = (source & 0x80) >> 7;
+        } break;
+
+        case OP_DRAW:
+        {
+            int draw_x = vx % DISPLAY_WIDTH;
+            int draw_y = vy % DISPLAY_HEIGHT;
+
+            DisplayRow* lane_display = LaneDisplay(lane);
+            DisplayRow collision = 0;
+
+            for (int i = 0; i < op.n; i++)
+            {
+                if ((draw_y + i) >= DISPLAY_HEIGHT)
+                {
+                    break;
+                }
+
+                DisplayRow sprite_row = lane_memory[((I[lane] + i) % EMULATOR_RAM_SIZE) * stride];
+                DisplayRow mask = (sprite_row << (DISPLAY_WIDTH - 8)) >> draw_x;
+
+                collision |= lane_display[draw_y + i] & mask;
+                lane_display[draw_y + i] ^= mask;
+            }
+
+            vf = (collision != 0) ? 1 : 0;
+        } break;
+    }
+
+    if (increment_pc)
+    {
+        pc += 2;
+    }
+
+    program_counter[lane] = pc;
+}
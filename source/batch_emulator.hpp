@@ -0,0 +1,113 @@
+#pragma once
+
+#include "emulator.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+//Lanes are padded to a whole AVX2 register of bytes so the kernels never need a scalar tail
+const int BATCH_LANE_ALIGNMENT = 32;
+
+//Distinct instructions a step handles as groups. Lanes running anything else that step go through the scalar path
+const int BATCH_MAX_GROUPS = 8;
+
+//Lane group ids. Real groups are 0 to BATCH_MAX_GROUPS - 1
+const uint8_t BATCH_GROUP_SCALAR = 0xFF; //didn't fit in a group this step
+const uint8_t BATCH_GROUP_NONE = 0xFE; //padding lanes and lanes whose program counter ran off the end of memory
+
+
+//Many independent machines stepped in lockstep, one instruction across every lane at a time.
+//Everything per lane lives in structure of arrays form, register r of lane l is v[r * lane_stride + l],
+//so one instruction over a run of lanes is a handful of AVX2 operations. Lanes usually run the same instruction.
+//When they don't they're grouped by instruction and each group runs masked.
+//Instructions that can't be vectorized (drawing, the stack, memory, keys) run lane by lane.
+//
+//Same semantics as Emulator::ExecuteInstructionsWith with these differences:
+//  No idle loop skipping. It never changes the state, only how fast it's reached
+//  No drawing, dirty tracking or sound events. The display and timers are there to read
+//  One compatibility mode and clock for the whole batch
+struct BatchEmulator
+{
+    int lane_count = 0;
+    int lane_stride = 0; //lane_count rounded up to BATCH_LANE_ALIGNMENT
+
+    int compatibility_mode = COMP_MODE_COSMAC;
+    int instructions_per_frame = EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME;
+    int tic = 0;
+    uint64_t instructions_executed = 0; //across all lanes
+
+    //[register * lane_stride + lane]
+    std::vector<uint8_t> v;
+    std::vector<uint16_t> stack; //[level * lane_stride + lane]
+    std::vector<uint8_t> keys; //[key * lane_stride + lane]
+
+    //[address * lane_stride + lane]. Every lane's byte at an address is next to the others, so when the lanes are
+    //at the same program counter the instruction is fetched and compared for all of them in one pass
+    std::vector<uint8_t> memory;
+
+    //[lane]
+    std::vector<uint16_t> I;
+    std::vector<uint16_t> program_counter;
+    std::vector<uint8_t> stack_pointer;
+    std::vector<uint8_t> delay_timer;
+    std::vector<uint8_t> sound_timer;
+    std::vector<uint8_t> key_just_pressed;
+    std::vector<uint8_t> last_key_pressed;
+    std::vector<uint8_t> get_key_key_pressed;
+    std::vector<uint64_t> random_state;
+
+    //Drawing is done lane by lane, so each lane's display stays whole. [lane * DISPLAY_HEIGHT + row]
+    std::vector<DisplayRow> display;
+
+    //Per step scratch. Each lane's instruction and which group runs it
+    std::vector<uint16_t> instructions;
+    std::vector<uint8_t> group_ids;
+    bool groups_uniform = false; //group_ids is already 0 for every lane, from the last uniform step
+
+    bool use_avx2 = false; //picked by Init. Everything also runs without it
+
+    BatchEmulator() = default;
+
+    BatchEmulator(const BatchEmulator&) = delete;
+    BatchEmulator& operator=(const BatchEmulator&) = delete;
+
+    //Every lane starts like a fresh Emulator: the font loaded, the program counter at 0x200, seeded with 0
+    void Init(int new_lane_count);
+
+    //Puts the program at 0x200 and resets the lane. Returns false if it doesn't fit
+    bool LoadProgram(int lane, const uint8_t* data, int size);
+
+    //Copy a whole machine in or out. The emulator's platform side (bitmap, JIT, keymap) isn't touched
+    void LoadLane(int lane, const Emulator& emu);
+    void StoreLane(int lane, Emulator* emu) const;
+
+    void SetSeed(int lane, uint64_t seed) { random_state[lane] = random_state_for_seed(seed); }
+    void SetKeypadKey(int lane, int index, uint8_t new_state);
+
+    void SetInstructionsPerFrame(int count);
+
+    //One frame for every lane. Timers tick, then instructions_per_frame instructions
+    void Update();
+
+    void ExecuteInstructions(int count);
+
+    template <typename Quirks>
+    void ExecuteInstructionsWith(int count);
+
+    //Fetches every lane's instruction and sorts the lanes into groups. Returns the group count
+    int GroupLanes(uint16_t* group_instructions);
+
+    //The instruction if every lane is about to run the same one at the same address, otherwise -1
+    int UniformInstruction() const;
+
+    template <typename Quirks>
+    void ExecuteLane(int lane, const DecodedOp& op);
+
+    uint8_t* V(int index) { return v.data() + (index * lane_stride); }
+    const uint8_t* V(int index) const { return v.data() + (index * lane_stride); }
+
+    uint8_t* Memory(int address) { return memory.data() + ((size_t)address * lane_stride); }
+    const uint8_t* Memory(int address) const { return memory.data() + ((size_t)address * lane_stride); }
+    DisplayRow* LaneDisplay(int lane) { return display.data() + ((size_t)lane * DISPLAY_HEIGHT); }
+    const DisplayRow* LaneDisplay(int lane) const { return display.data() + ((size_t)lane * DISPLAY_HEIGHT); }
+};
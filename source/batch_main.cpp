@@ -0,0 +1,245 @@
+//Headless batch runner. Runs every ROM in a directory for a fixed number of frames across all cores
+//and prints a hash of the display for each one, for regression testing a ROM corpus.
+//Only needs the emulator core. No windows, no pacing
+#include "emulator.hpp"
+#include "emulator_pool.hpp"
+#include "thread_pool.hpp"
+#include "audio.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+static const int DEFAULT_FRAME_COUNT = 600; //10 seconds at 60 fps
+
+static const uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325ull;
+static const uint64_t FNV_PRIME = 0x100000001B3ull;
+
+
+struct BatchJob
+{
+    std::filesystem::path path;
+
+    bool loaded = false;
+    int load_error = ROM_OK;
+    uint64_t frame_hash = FNV_OFFSET_BASIS; //every frame's display hashed in order
+    uint64_t final_hash = FNV_OFFSET_BASIS; //only the last frame
+    uint64_t instructions_executed = 0;
+    uint64_t instructions_elided = 0; //idle loop iterations that were skipped
+    double milliseconds = 0;
+};
+
+struct BatchSettings
+{
+    std::vector<BatchJob> jobs;
+    int frame_count = DEFAULT_FRAME_COUNT;
+    bool use_jit = false;
+    int clock_hz = EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME * EMULATOR_FRAMES_PER_SECOND;
+    uint64_t seed = 0; //every ROM gets the same seed so CXNN results are the same every run
+    std::filesystem::path wav_directory; //empty doesn't render audio. otherwise each ROM's beeps go to <rom>.wav
+
+    EmulatorPool emulators; //one per thread. Jobs reuse them instead of making their own
+};
+
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+
+//Every job has an emulator to itself while it runs, so nothing is shared between threads except the job list slots
+//and the pool
+static void batch_run_job(void* context, int index)
+{
+    BatchSettings* settings = (BatchSettings*)context;
+    BatchJob* job = &(settings->jobs[index]);
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::shared_ptr<const RomImage> image = rom_image_from_file(job->path.c_str(), &(job->load_error));
+    job->loaded = (image != nullptr);
+    if (job->loaded == false) return;
+
+    Emulator* emu = settings->emulators.Acquire(image);
+    emu->SetSeed(settings->seed);
+    emu->SetClockHz(settings->clock_hz);
+    if (settings->use_jit)
+    {
+        emu->SetJitEnabled(true); //only allocates the first time a pooled emulator runs a job
+    }
+
+    //Offline, so the WAV is sample for sample the same every run
+    AudioEngine* audio = nullptr;
+    AudioWavSink wav;
+    if (settings->wav_directory.empty() == false)
+    {
+        std::filesystem::path wav_path = settings->wav_directory / job->path.filename();
+        wav_path += ".wav";
+
+        if (wav.Open(wav_path.string().c_str(), AUDIO_DEFAULT_SAMPLE_RATE))
+        {
+            audio = new AudioEngine();
+            audio->Init(AUDIO_DEFAULT_SAMPLE_RATE, AUDIO_DEFAULT_TONE_HZ, AUDIO_DEFAULT_VOLUME, false, wav.Sink());
+            emu->sound_events = &(audio->events);
+        }
+    }
+
+    const size_t display_size = sizeof(DisplayRow) * DISPLAY_HEIGHT;
+
+    for (int frame = 0; frame < settings->frame_count; frame++)
+    {
+        emu->Update();
+        emu->LateUpdate();
+
+        if (audio)
+        {
+            audio->RenderUntil((uint64_t)emu->tic << 16);
+        }
+
+        job->frame_hash = fnv1a(job->frame_hash, emu->display.data(), display_size);
+    }
+
+    job->final_hash = fnv1a(FNV_OFFSET_BASIS, emu->display.data(), display_size);
+    job->instructions_executed = emu->instructions_executed;
+    job->instructions_elided = emu->instructions_elided;
+
+    settings->emulators.Release(emu);
+    delete audio;
+    wav.Close();
+
+    auto end = std::chrono::steady_clock::now();
+    job->milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+
+static void print_usage()
+{
+    printf("Usage: chip8-batch <rom directory> [frames] [threads] [--jit] [--seed=N] [--hz=N] [--wav=DIR]\n");
+    printf("  frames   frames to run each ROM for. default %d\n", DEFAULT_FRAME_COUNT);
+    printf("  threads  worker threads. default 0, one per hardware thread\n");
+    printf("  seed     CXNN random seed used for every ROM. default 0\n");
+    printf("  hz       instructions per second, rounded to whole instructions per frame. default %d\n",
+    EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME * EMULATOR_FRAMES_PER_SECOND);
+    printf("  wav      directory to write each ROM's sound to, as <rom>.wav\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    BatchSettings settings;
+    int thread_count = 0;
+
+    int number_index = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--jit") == 0)
+        {
+            settings.use_jit = true;
+        }
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+        {
+            settings.seed = strtoull(argv[i] + 7, NULL, 0);
+        }
+        else if (strncmp(argv[i], "--hz=", 5) == 0)
+        {
+            settings.clock_hz = atoi(argv[i] + 5);
+        }
+        else if (strncmp(argv[i], "--wav=", 6) == 0)
+        {
+            settings.wav_directory = argv[i] + 6;
+        }
+        else if (number_index == 0)
+        {
+            settings.frame_count = atoi(argv[i]);
+            number_index++;
+        }
+        else
+        {
+            thread_count = atoi(argv[i]);
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::directory_iterator directory(argv[1], error);
+    if (error)
+    {
+        printf("ERROR: Opening directory '%s' failed. %s\n", argv[1], error.message().c_str());
+        return EXIT_FAILURE;
+    }
+
+    for (const std::filesystem::directory_entry& entry : directory)
+    {
+        if (entry.is_regular_file(error) == false) continue;
+
+        BatchJob job;
+        job.path = entry.path();
+        settings.jobs.push_back(job);
+    }
+
+    //Directory order isn't stable across file systems. Sorted output can be diffed between runs
+    std::sort(settings.jobs.begin(), settings.jobs.end(),
+    [](const BatchJob& a, const BatchJob& b) { return a.path < b.path; });
+
+    ThreadPool pool;
+    pool.Init(thread_count);
+    thread_count = pool.ThreadCount();
+    settings.emulators.Init(thread_count);
+
+    auto start = std::chrono::steady_clock::now();
+    pool.Run(batch_run_job, &settings, (int)settings.jobs.size());
+    auto end = std::chrono::steady_clock::now();
+
+    pool.Destroy();
+
+    int failed_count = 0;
+    uint64_t total_instructions = 0;
+
+    for (const BatchJob& job : settings.jobs)
+    {
+        std::string name = job.path.filename().string();
+
+        if (job.loaded == false)
+        {
+            printf("%-32s FAILED TO LOAD. %s\n", name.c_str(), rom_error_string(job.load_error));
+            failed_count++;
+            continue;
+        }
+
+        printf("%-32s frames %016llx  final %016llx  instructions %12llu  elided %12llu  %9.2f ms\n",
+        name.c_str(),
+        (unsigned long long)job.frame_hash,
+        (unsigned long long)job.final_hash,
+        (unsigned long long)job.instructions_executed,
+        (unsigned long long)job.instructions_elided,
+        job.milliseconds);
+
+        total_instructions += job.instructions_executed;
+    }
+
+    double total_milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+    printf("\n%d ROMs (%d failed), %d frames each, %d threads. %.2f ms, %.1f million instructions/s\n",
+    (int)settings.jobs.size(), failed_count, settings.frame_count, thread_count,
+    total_milliseconds, (total_milliseconds > 0) ? (total_instructions / (total_milliseconds * 1000.0)) : 0.0);
+
+    return failed_count ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,591 @@
+//Benchmarks for the emulator core. Prints JSON with a fixed layout and key order so runs can be diffed
+//between commits. Every benchmark is sampled several times and the median is reported with the spread.
+//Usage: chip8-bench [output file]
+#include "emulator.hpp"
+#include "emulator_pool.hpp"
+#include "batch_emulator.hpp"
+#include "vector_env.hpp"
+#include "bitmap.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+static const int BENCH_SAMPLE_COUNT = 9;
+static const int BENCH_SCHEMA_VERSION = 1;
+
+static const int BENCH_INSTRUCTION_COUNT = 2000000; //per sample of the instruction benchmarks
+static const int BENCH_FRAME_COUNT = 2000; //per sample of the Update benchmarks
+static const int BENCH_BATCH_LANE_COUNT = 4096;
+static const int BENCH_BATCH_STEP_COUNT = 500; //per sample of the batch benchmarks. Every lane runs this many
+static const int BENCH_ENV_COUNT = 256;
+static const int BENCH_ENV_STEP_COUNT = 50; //per sample of the environment benchmark
+static const int BENCH_SESSION_COUNT = 1000; //per sample of the session benchmarks
+static const int BENCH_SESSION_FRAME_COUNT = 10; //each session runs this many frames
+
+
+struct BenchResult
+{
+    std::string name;
+    const char* unit;
+    double median;
+    double min;
+    double max;
+};
+
+static std::vector<BenchResult> results;
+
+
+typedef double (*BenchSampleFunc)(void* context); //returns one sample in the benchmark's unit
+
+
+static double bench_seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+static void bench_run(const std::string& name, const char* unit, BenchSampleFunc sample, void* context)
+{
+    //One untimed run so caches, the decode cache and JIT blocks are warm
+    sample(context);
+
+    std::vector<double> samples;
+    for (int i = 0; i < BENCH_SAMPLE_COUNT; i++)
+    {
+        samples.push_back(sample(context));
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    result.name = name;
+    result.unit = unit;
+    result.median = samples[samples.size() / 2];
+    result.min = samples.front();
+    result.max = samples.back();
+    results.push_back(result);
+
+    fprintf(stderr, "%-40s %12.3f %s\n", name.c_str(), result.median, unit);
+}
+
+
+static std::vector<uint8_t> bench_program_bytes(const std::vector<uint16_t>& program)
+{
+    std::vector<uint8_t> bytes;
+    for (uint16_t instruction : program)
+    {
+        bytes.push_back((uint8_t)(instruction >> 8));
+        bytes.push_back((uint8_t)(instruction & 0xFF));
+    }
+
+    return bytes;
+}
+
+
+//Loads a program at 0x200. The last instruction should jump back so it runs forever
+static void bench_load_program(Emulator* emu, const std::vector<uint16_t>& program)
+{
+    std::vector<uint8_t> bytes = bench_program_bytes(program);
+    emu->LoadRom(rom_image_from_buffer(bytes.data(), (int)bytes.size(), nullptr));
+}
+
+
+//8XYN arithmetic and logic
+static std::vector<uint16_t> bench_alu_program()
+{
+    return {
+        0x6001, 0x6103, 0x6207, 0x630F,
+        0x8014, 0x8121, 0x8232, 0x8303, 0x8015, 0x8126, 0x8237, 0x830E,
+        0x8010, 0x8124, 0x8231, 0x8302, 0x8413, 0x8545, 0x8656, 0x877E,
+        0x1208
+    };
+}
+
+//DXYN with moving coordinates so sprites land on different rows and wrap
+static std::vector<uint16_t> bench_draw_program()
+{
+    return {
+        0xA000, 0x6000, 0x6100,
+        0xD015, 0x7003, 0xD015, 0x7105, 0xD01F, 0x7007, 0xD015, 0x7102, 0xD01A,
+        0x1206
+    };
+}
+
+//FX55/FX65 block copies
+static std::vector<uint16_t> bench_memory_program()
+{
+    return {
+        0xA400,
+        0xFF55, 0xFF65, 0xF755, 0xF765, 0xF355, 0xF365,
+        0x1202
+    };
+}
+
+//3XNN/4XNN/5XY0/9XY0 skips, taken and not taken, and jumps
+static std::vector<uint16_t> bench_branch_program()
+{
+    return {
+        0x6005, 0x6105,
+        0x3005, 0x0000, 0x3006, 0x4005, 0x4006, 0x0000,
+        0x5010, 0x0000, 0x9010, 0x121A, 0x121A, //both land on the jump back
+        0x1204
+    };
+}
+
+//2NNN/00EE around a short subroutine
+static std::vector<uint16_t> bench_call_program()
+{
+    return {
+        0x2206, 0x8014, 0x1200,
+        0x7001, 0x00EE
+    };
+}
+
+//Something shaped like a game frame. Move a sprite, check keys, wait for the delay timer
+static std::vector<uint16_t> bench_game_program()
+{
+    return {
+        0x6000, 0x6110, 0xA000,
+        0xD015, 0x7001, 0x4040, 0x6000, 0xD015, //erase, move, redraw
+        0xE19E, 0x0000, 0x6203, 0xF215, //check a key, set the delay timer
+        0xF307, 0x3300, 0x1218, //wait for it
+        0x1206
+    };
+}
+
+//Sets the delay timer and spins on it, like most games between frames
+static std::vector<uint16_t> bench_wait_program()
+{
+    return {
+        0x6005, 0xF015,
+        0xF007, 0x3000, 0x1204, //wait for the delay timer
+        0x1200
+    };
+}
+
+
+struct InstructionBench
+{
+    Emulator* emu;
+};
+
+static double bench_instructions_sample(void* context)
+{
+    Emulator* emu = ((InstructionBench*)context)->emu;
+
+    auto start = std::chrono::steady_clock::now();
+    if (emu->jit)
+    {
+        emu->ExecuteJit(BENCH_INSTRUCTION_COUNT);
+    }
+    else
+    {
+        emu->ExecuteInstructions(BENCH_INSTRUCTION_COUNT);
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (BENCH_INSTRUCTION_COUNT / seconds) / 1000000.0;
+}
+
+
+static void bench_instructions(const char* family, const std::vector<uint16_t>& program, int mode)
+{
+    for (int jit = 0; jit < 2; jit++)
+    {
+        Emulator* emu = new Emulator();
+        emu->Init();
+        emu->SetSeed(0);
+        emu->compatibility_mode = mode;
+        emu->skip_idle_loops = false; //skipped instructions would count as executed
+        bench_load_program(emu, program);
+
+        if (jit && (emu->SetJitEnabled(true) == false))
+        {
+            delete emu;
+            continue;
+        }
+
+        InstructionBench bench = {emu};
+        std::string name = std::string(jit ? "jit/" : "interpreter/") + family;
+        bench_run(name, "million_instructions_per_second", bench_instructions_sample, &bench);
+
+        delete emu;
+    }
+}
+
+
+static double bench_batch_sample(void* context)
+{
+    BatchEmulator* batch = (BatchEmulator*)context;
+
+    auto start = std::chrono::steady_clock::now();
+    batch->ExecuteInstructions(BENCH_BATCH_STEP_COUNT);
+    double seconds = bench_seconds_since(start);
+
+    return (((double)BENCH_BATCH_STEP_COUNT * batch->lane_count) / seconds) / 1000000.0;
+}
+
+
+//Every lane runs the same program with its own seed, like a batch of environments
+static void bench_batch(const char* family, const std::vector<uint16_t>& program, int mode)
+{
+    std::vector<uint8_t> bytes = bench_program_bytes(program);
+
+    BatchEmulator* batch = new BatchEmulator();
+    batch->Init(BENCH_BATCH_LANE_COUNT);
+    batch->compatibility_mode = mode;
+    for (int lane = 0; lane < batch->lane_count; lane++)
+    {
+        batch->LoadProgram(lane, bytes.data(), (int)bytes.size());
+        batch->SetSeed(lane, lane);
+    }
+
+    std::string name = std::string("batch/") + family;
+    bench_run(name, "million_instructions_per_second", bench_batch_sample, batch);
+
+    delete batch;
+}
+
+
+struct EnvBench
+{
+    VectorEnv* env;
+    std::vector<int> actions;
+};
+
+static double bench_env_sample(void* context)
+{
+    EnvBench* bench = (EnvBench*)context;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ENV_STEP_COUNT; i++)
+    {
+        bench->env->Step(bench->actions.data());
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (((double)BENCH_ENV_STEP_COUNT * bench->env->env_count) / seconds) / 1000.0;
+}
+
+
+//Single threaded so it compares with the other benchmarks. Four frames per step
+static void bench_env(const char* family, const std::vector<uint16_t>& program)
+{
+    EnvConfig config;
+    config.rom = bench_program_bytes(program);
+    config.action_keys = {ENV_NO_KEY, 1};
+    config.observations = ENV_OBSERVE_DISPLAY;
+
+    EnvBench bench;
+    bench.env = new VectorEnv();
+    bench.env->Init(config, BENCH_ENV_COUNT, nullptr);
+    bench.env->Reset();
+
+    for (int i = 0; i < BENCH_ENV_COUNT; i++)
+    {
+        bench.actions.push_back(i % 2);
+    }
+
+    std::string name = std::string("env/") + family;
+    bench_run(name, "thousand_steps_per_second", bench_env_sample, &bench);
+
+    delete bench.env;
+}
+
+
+static double bench_update_sample(void* context)
+{
+    Emulator* emu = (Emulator*)context;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_FRAME_COUNT; i++)
+    {
+        emu->Update();
+        emu->LateUpdate();
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (seconds * 1000000000.0) / BENCH_FRAME_COUNT;
+}
+
+
+static void bench_update(const char* name, const std::vector<uint16_t>& program, int bitmap_w, int bitmap_h)
+{
+    Emulator* emu = new Emulator();
+    emu->Init();
+    emu->SetSeed(0);
+    bench_load_program(emu, program);
+
+    std::vector<uint32_t> pixels;
+    if (bitmap_w)
+    {
+        pixels.resize(bitmap_w * bitmap_h);
+        emu->bitmap.data = (char*)pixels.data();
+        emu->bitmap.w = bitmap_w;
+        emu->bitmap.h = bitmap_h;
+    }
+
+    bench_run(name, "nanoseconds_per_frame", bench_update_sample, emu);
+
+    delete emu;
+}
+
+
+static double bench_draw_sample(void* context)
+{
+    Emulator* emu = (Emulator*)context;
+    const int DRAW_COUNT = 20;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < DRAW_COUNT; i++)
+    {
+        emu->InvalidateDisplay();
+        emu->Draw();
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (seconds * 1000000.0) / DRAW_COUNT;
+}
+
+
+static double bench_draw_rect_sample(void* context)
+{
+    Bitmap* bitmap = (Bitmap*)context;
+    const int DRAW_COUNT = 20;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < DRAW_COUNT; i++)
+    {
+        bitmap->DrawRect(0, 0, bitmap->w, bitmap->h, (uint8_t)i, 0x20, 0x40);
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (seconds * 1000000.0) / DRAW_COUNT;
+}
+
+
+static void bench_draw(int w, int h, int scale_mode, const char* scale_name)
+{
+    std::vector<uint32_t> pixels(w * h);
+
+    Emulator* emu = new Emulator();
+    emu->Init();
+    emu->bitmap.data = (char*)pixels.data();
+    emu->bitmap.w = w;
+    emu->bitmap.h = h;
+    emu->bitmap.SetScaling(scale_mode, BITMAP_FILTER_NEAREST, 0);
+
+    //A fixed noisy display so runs of equal pixels are short
+    uint64_t pattern = 0x9E3779B97F4A7C15ull;
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        pattern ^= pattern << 13;
+        pattern ^= pattern >> 7;
+        pattern ^= pattern << 17;
+        emu->display[y] = pattern;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "draw/full_%dx%d_%s", w, h, scale_name);
+    bench_run(name, "microseconds_per_draw", bench_draw_sample, emu);
+
+    snprintf(name, sizeof(name), "draw_rect/full_%dx%d", w, h);
+    bench_run(name, "microseconds_per_draw", bench_draw_rect_sample, &emu->bitmap);
+
+    delete emu;
+}
+
+
+struct LoadBench
+{
+    Emulator* emu;
+    std::wstring filename;
+};
+
+static double bench_load_sample(void* context)
+{
+    LoadBench* bench = (LoadBench*)context;
+    const int LOAD_COUNT = 50;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < LOAD_COUNT; i++)
+    {
+        bench->emu->LoadFromFile(bench->filename.data());
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (seconds * 1000000.0) / LOAD_COUNT;
+}
+
+
+static void bench_load()
+{
+    //The largest ROM that fits
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "chip8_bench_rom.ch8";
+    {
+        std::vector<char> rom(EMULATOR_RAM_SIZE - 0x200 - 1);
+        for (size_t i = 0; i < rom.size(); i++)
+        {
+            rom[i] = (char)(i * 31);
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        file.write(rom.data(), rom.size());
+    }
+
+    LoadBench bench;
+    bench.emu = new Emulator();
+    bench.emu->Init();
+    bench.filename = path.wstring();
+
+    bench_run("load/rom_3583_bytes", "microseconds_per_load", bench_load_sample, &bench);
+
+    delete bench.emu;
+
+    std::error_code error;
+    std::filesystem::remove(path, error);
+}
+
+
+//Short sessions one after another, like a job scheduler running them
+struct SessionBench
+{
+    std::shared_ptr<const RomImage> image;
+    EmulatorPool* pool; //nullptr makes a new emulator for every session
+};
+
+static double bench_session_sample(void* context)
+{
+    SessionBench* bench = (SessionBench*)context;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_SESSION_COUNT; i++)
+    {
+        Emulator* emu;
+        if (bench->pool)
+        {
+            emu = bench->pool->Acquire(bench->image);
+        }
+        else
+        {
+            emu = new Emulator();
+            emu->Init();
+            emu->LoadRom(bench->image);
+        }
+        emu->SetSeed(i);
+
+        for (int frame = 0; frame < BENCH_SESSION_FRAME_COUNT; frame++)
+        {
+            emu->Update();
+            emu->LateUpdate();
+        }
+
+        if (bench->pool)
+        {
+            bench->pool->Release(emu);
+        }
+        else
+        {
+            delete emu;
+        }
+    }
+    double seconds = bench_seconds_since(start);
+
+    return (seconds * 1000000.0) / BENCH_SESSION_COUNT;
+}
+
+
+static void bench_session()
+{
+    std::vector<uint8_t> bytes = bench_program_bytes(bench_game_program());
+
+    SessionBench bench;
+    bench.image = rom_image_from_buffer(bytes.data(), (int)bytes.size(), nullptr);
+    bench.pool = nullptr;
+
+    bench_run("session/new_emulator", "microseconds_per_session", bench_session_sample, &bench);
+
+    EmulatorPool pool;
+    pool.Init(1);
+    bench.pool = &pool;
+
+    bench_run("session/pool", "microseconds_per_session", bench_session_sample, &bench);
+}
+
+
+static void write_json(FILE* out)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"schema\": %d,\n", BENCH_SCHEMA_VERSION);
+    fprintf(out, "  \"samples\": %d,\n", BENCH_SAMPLE_COUNT);
+    fprintf(out, "  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& result = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.3f, \"min\": %.3f, \"max\": %.3f}%s\n",
+        result.name.c_str(), result.unit, result.median, result.min, result.max,
+        ((i + 1) < results.size()) ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    bench_instructions("alu_8xyn", bench_alu_program(), COMP_MODE_COSMAC);
+    bench_instructions("draw_dxyn", bench_draw_program(), COMP_MODE_COSMAC);
+    bench_instructions("memory_fx55_fx65", bench_memory_program(), COMP_MODE_MODERN);
+    bench_instructions("branch_skip_jump", bench_branch_program(), COMP_MODE_COSMAC);
+    bench_instructions("timer_wait_fx07", bench_wait_program(), COMP_MODE_COSMAC);
+    bench_instructions("call_return", bench_call_program(), COMP_MODE_COSMAC);
+
+    bench_batch("alu_8xyn", bench_alu_program(), COMP_MODE_COSMAC);
+    bench_batch("draw_dxyn", bench_draw_program(), COMP_MODE_COSMAC);
+    bench_batch("branch_skip_jump", bench_branch_program(), COMP_MODE_COSMAC);
+    bench_batch("game", bench_game_program(), COMP_MODE_COSMAC);
+
+    bench_env("game", bench_game_program());
+
+    bench_update("update/game_headless", bench_game_program(), 0, 0);
+    bench_update("update/game_1280x640", bench_game_program(), 1280, 640);
+    bench_update("update/draw_heavy_1280x640", bench_draw_program(), 1280, 640);
+    bench_update("update/delay_wait_headless", bench_wait_program(), 0, 0);
+
+    bench_draw(640, 320, BITMAP_SCALE_INTEGER, "integer");
+    bench_draw(1280, 640, BITMAP_SCALE_INTEGER, "integer");
+    bench_draw(1920, 1080, BITMAP_SCALE_ASPECT, "aspect");
+    bench_draw(3840, 2160, BITMAP_SCALE_ASPECT, "aspect");
+
+    bench_load();
+    bench_session();
+
+    FILE* out = stdout;
+    if (argc > 1)
+    {
+        out = fopen(argv[1], "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "ERROR: Opening '%s' for writing failed.\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    write_json(out);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    return EXIT_SUCCESS;
+}
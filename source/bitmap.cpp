@@ -2,55 +2,472 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define BITMAP_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define BITMAP_SIMD 0
+#endif
+
+//GCC and clang only emit AVX2 instructions in functions marked for it. MSVC doesn't need this
+#if defined(__GNUC__) || defined(__clang__)
+#define BITMAP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BITMAP_TARGET_AVX2
+#endif
+
+
+//Span fill kernels. One is picked at startup depending on what the CPU supports
+typedef void (*BitmapFillFunc)(uint32_t* dst, int count, uint32_t value);
+
+static void bitmap_fill_scalar(uint32_t* dst, int count, uint32_t value)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = value;
+    }
+}
+
+#if BITMAP_SIMD
+static void bitmap_fill_sse2(uint32_t* dst, int count, uint32_t value)
+{
+    __m128i v = _mm_set1_epi32((int)value);
+
+    int i = 0;
+    for (; (i + 4) <= count; i += 4)
+    {
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+
+    bitmap_fill_scalar(dst + i, count - i, value);
+}
+
+BITMAP_TARGET_AVX2 static void bitmap_fill_avx2(uint32_t* dst, int count, uint32_t value)
+{
+    __m256i v = _mm256_set1_epi32((int)value);
+
+    int i = 0;
+    for (; (i + 8) <= count; i += 8)
+    {
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+
+    bitmap_fill_scalar(dst + i, count - i, value);
+}
+
+static bool bitmap_cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) return false;
+
+    //The OS has to save the YMM registers
+    if ((_xgetbv(0) & 0x6) != 0x6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init(); //this can run before the CPU model is initialized by the runtime
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+static BitmapFillFunc bitmap_choose_fill()
+{
+#if BITMAP_SIMD
+    if (bitmap_cpu_has_avx2())
+    {
+        return bitmap_fill_avx2;
+    }
+    return bitmap_fill_sse2;
+#else
+    return bitmap_fill_scalar;
+#endif
+}
+
+static const BitmapFillFunc bitmap_fill = bitmap_choose_fill();
+
+
+//Bit row expansion kernels. Turn the bits of a source row into on/off pixels, one per entry of the column tables
+typedef void (*BitmapExpandFunc)(uint32_t* dst, int count, uint64_t bits,
+    const uint32_t* select, const uint32_t* bit, uint32_t on_color, uint32_t off_color);
+
+static void bitmap_expand_scalar(uint32_t* dst, int count, uint64_t bits,
+    const uint32_t* select, const uint32_t* bit, uint32_t on_color, uint32_t off_color)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t byte = (uint32_t)(bits >> ((select[i] & 7) * 8));
+        dst[i] = (byte & bit[i]) ? on_color : off_color;
+    }
+}
+
+#if BITMAP_SIMD
+static void bitmap_expand_sse2(uint32_t* dst, int count, uint64_t bits,
+    const uint32_t* select, const uint32_t* bit, uint32_t on_color, uint32_t off_color)
+{
+    //No byte shuffle before SSSE3, so each pixel's byte is picked with a shift
+    __m128i off = _mm_set1_epi32((int)off_color);
+    __m128i flip = _mm_set1_epi32((int)(on_color ^ off_color));
+
+    int i = 0;
+    for (; (i + 4) <= count; i += 4)
+    {
+        __m128i bytes = _mm_setr_epi32((int)(bits >> ((select[i] & 7) * 8)), (int)(bits >> ((select[i+1] & 7) * 8)),
+            (int)(bits >> ((select[i+2] & 7) * 8)), (int)(bits >> ((select[i+3] & 7) * 8)));
+        __m128i mask = _mm_loadu_si128((const __m128i*)(bit + i));
+        __m128i on = _mm_cmpeq_epi32(_mm_and_si128(bytes, mask), mask);
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(off, _mm_and_si128(on, flip)));
+    }
+
+    bitmap_expand_scalar(dst + i, count - i, bits, select + i, bit + i, on_color, off_color);
+}
+
+BITMAP_TARGET_AVX2 static void bitmap_expand_avx2(uint32_t* dst, int count, uint64_t bits,
+    const uint32_t* select, const uint32_t* bit, uint32_t on_color, uint32_t off_color)
+{
+    //Every 128 bit lane has all 8 bytes of the row, so pshufb can pick each pixel's byte into its low byte
+    __m256i row = _mm256_set1_epi64x((long long)bits);
+    __m256i off = _mm256_set1_epi32((int)off_color);
+    __m256i flip = _mm256_set1_epi32((int)(on_color ^ off_color));
+
+    int i = 0;
+    for (; (i + 8) <= count; i += 8)
+    {
+        __m256i bytes = _mm256_shuffle_epi8(row, _mm256_loadu_si256((const __m256i*)(select + i)));
+        __m256i mask = _mm256_loadu_si256((const __m256i*)(bit + i));
+        __m256i on = _mm256_cmpeq_epi32(_mm256_and_si256(bytes, mask), mask);
+
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(off, _mm256_and_si256(on, flip)));
+    }
+
+    bitmap_expand_scalar(dst + i, count - i, bits, select + i, bit + i, on_color, off_color);
+}
+#endif
+
+static BitmapExpandFunc bitmap_choose_expand()
+{
+#if BITMAP_SIMD
+    if (bitmap_cpu_has_avx2())
+    {
+        return bitmap_expand_avx2;
+    }
+    return bitmap_expand_sse2;
+#else
+    return bitmap_expand_scalar;
+#endif
+}
+
+static const BitmapExpandFunc bitmap_expand = bitmap_choose_expand();
+
+
+//Blends two packed colors. weight_a is out of 256
+static uint32_t bitmap_blend(uint32_t a, uint32_t b, uint32_t weight_a)
+{
+    if (weight_a >= 256) return a;
+
+    uint32_t weight_b = 256 - weight_a;
+    uint32_t rb = ((((a & 0xFF00FF) * weight_a) + ((b & 0xFF00FF) * weight_b)) >> 8) & 0xFF00FF;
+    uint32_t g = ((((a & 0x00FF00) * weight_a) + ((b & 0x00FF00) * weight_b)) >> 8) & 0x00FF00;
+
+    return rb | g;
+}
+
+
+//Fills an already clipped rectangle
+static void bitmap_fill_rect(Bitmap* bitmap, int left, int top, int right, int bottom, uint32_t color)
+{
+    if ((left >= right) || (top >= bottom)) return;
+
+    for (int y = top; y < bottom; y++)
+    {
+        uint32_t* row = ((uint32_t*)bitmap->data) + (y * bitmap->w);
+        bitmap_fill(row + left, right - left, color);
+    }
+}
+
+
+//Edges of source_size source pixels stretched over size bitmap pixels starting at offset
+static void bitmap_build_edges(std::vector<int>* edges, std::vector<int>* spans,
+    int source_size, int offset, int size)
+{
+    edges->resize(source_size + 1);
+    spans->resize(source_size + 1);
+
+    for (int i = 0; i <= source_size; i++)
+    {
+        int64_t position = (((int64_t)i * size) << 16) / source_size;
+        int edge = (offset << 16) + (int)position;
+
+        (*edges)[i] = edge;
+        (*spans)[i] = (edge + 0x8000) >> 16;
+    }
+}
+
+
+static void bitmap_build_map(std::vector<BitmapSample>* map, const std::vector<int>& edges,
+    int source_size, int offset, int size)
+{
+    map->assign(size, BitmapSample());
+
+    for (int i = 0; i < source_size; i++)
+    {
+        int start = edges[i] - (offset << 16);
+        int end = edges[i + 1] - (offset << 16);
+
+        //Pixels fully inside the source pixel
+        int first_full = (start + 0xFFFF) >> 16;
+        int last = end >> 16;
+        for (int j = first_full; (j < last) && (j < size); j++)
+        {
+            (*map)[j].source = (uint16_t)i;
+            (*map)[j].weight = 256;
+        }
+
+        //The pixel the right/bottom edge falls into is shared with the next source pixel
+        int fraction = end & 0xFFFF;
+        if (fraction && (last < size))
+        {
+            (*map)[last].source = (uint16_t)i;
+            (*map)[last].weight = (uint16_t)(fraction >> 8);
+        }
+    }
+}
 
 
 void Bitmap::DrawRect(int x, int y, int rect_w, int rect_h, uint8_t r, uint8_t g, uint8_t b)
 {
     assert(bpp == 4);
 
-    int right = x + rect_w;
-    int bottom = y + rect_h;
+    //Clip once instead of per pixel
+    int left = (x < 0) ? 0 : x;
+    int top = (y < 0) ? 0 : y;
+    int right = ((x + rect_w) > w) ? w : (x + rect_w);
+    int bottom = ((y + rect_h) > h) ? h : (y + rect_h);
+
+    bitmap_fill_rect(this, left, top, right, bottom, PackColor(r, g, b));
+}
+
+void Bitmap::Clear(uint8_t r, uint8_t g, uint8_t b)
+{
+    assert(bpp == 4);
+
+    bitmap_fill((uint32_t*)data, w * h, PackColor(r, g, b));
+}
+
+
+void Bitmap::SetScaling(int new_scale_mode, int new_filter, uint32_t new_border_color)
+{
+    scale_mode = new_scale_mode;
+    filter = new_filter;
+    border_color = new_border_color;
+
+    spans_source_w = 0; //forces a rebuild
+}
+
+
+bool Bitmap::UpdateSpans(int source_w, int source_h)
+{
+    if ((spans_data == data) && (spans_w == w) && (spans_h == h) &&
+        (spans_source_w == source_w) && (spans_source_h == source_h))
+    {
+        return false;
+    }
+
+    viewport.w = w;
+    viewport.h = h;
+
+    if (scale_mode == BITMAP_SCALE_INTEGER)
+    {
+        int scale_w = w / source_w;
+        int scale_h = h / source_h;
+        int scale = (scale_w < scale_h) ? scale_w : scale_h;
+
+        if (scale > 0)
+        {
+            viewport.w = source_w * scale;
+            viewport.h = source_h * scale;
+        }
+    }
+
+    if ((scale_mode == BITMAP_SCALE_ASPECT) ||
+        ((scale_mode == BITMAP_SCALE_INTEGER) && (viewport.w == w) && (viewport.h == h)))
+    {
+        //16.16 scale factor of the tighter axis
+        int64_t scale_w = ((int64_t)w << 16) / source_w;
+        int64_t scale_h = ((int64_t)h << 16) / source_h;
+        int64_t scale = (scale_w < scale_h) ? scale_w : scale_h;
+
+        viewport.w = (int)((source_w * scale) >> 16);
+        viewport.h = (int)((source_h * scale) >> 16);
+    }
 
-    if (x > w) return;
-    if (y > h) return;
-    if (right < 0) return;
-    if (bottom < 0) return;
+    viewport.x = (w - viewport.w) / 2;
+    viewport.y = (h - viewport.h) / 2;
 
-    for (int y2 = y; (y2 < bottom) && (y2 < h); y2++)
+    bitmap_build_edges(&column_edges, &column_spans, source_w, viewport.x, viewport.w);
+    bitmap_build_edges(&row_edges, &row_spans, source_h, viewport.y, viewport.h);
+
+    if (filter == BITMAP_FILTER_SHARP_BILINEAR)
+    {
+        bitmap_build_map(&column_map, column_edges, source_w, viewport.x, viewport.w);
+        bitmap_build_map(&row_map, row_edges, source_h, viewport.y, viewport.h);
+        sharp_lines.resize(source_h * viewport.w);
+    }
+    else
     {
-        if (y2 < 0) continue;
-        for (int x2 = x; (x2 < right) && (x2 < w); x2++)
+        column_select.resize(viewport.w);
+        column_bit.resize(viewport.w);
+
+        for (int column = 0; column < source_w; column++)
         {
-            if (x2 < 0) continue;
-
-            int offset = (y2 * w) + x2;
-            uint32_t* pixel = ((uint32_t*)data) + offset;
-            
-            //R and B are flipped due to endianness
-            *pixel = (static_cast<uint32_t>(r) << 16) | 
-                     (static_cast<uint32_t>(g) << 8)  | 
-                     static_cast<uint32_t>(b);
+            int shift = source_w - 1 - column;
+            for (int x = column_spans[column]; x < column_spans[column + 1]; x++)
+            {
+                column_select[x - viewport.x] = 0x80808000 | (uint32_t)(shift >> 3);
+                column_bit[x - viewport.x] = 1u << (shift & 7);
+            }
         }
     }
+
+    //Letterbox
+    if (data)
+    {
+        int right = viewport.x + viewport.w;
+        int bottom = viewport.y + viewport.h;
+
+        bitmap_fill_rect(this, 0, 0, w, viewport.y, border_color);
+        bitmap_fill_rect(this, 0, bottom, w, h, border_color);
+        bitmap_fill_rect(this, 0, viewport.y, viewport.x, bottom, border_color);
+        bitmap_fill_rect(this, right, viewport.y, w, bottom, border_color);
+    }
+
+    spans_data = data;
+    spans_w = w;
+    spans_h = h;
+    spans_source_w = source_w;
+    spans_source_h = source_h;
+
+    return true;
 }
 
-void Bitmap::Clear(uint8_t r, uint8_t g, uint8_t b)
+
+void Bitmap::DrawBitRows(const uint64_t* rows, int source_w, int source_h,
+    int first_row, int row_count, int first_column, int last_column,
+    uint32_t on_color, uint32_t off_color)
 {
     assert(bpp == 4);
+    assert(source_w <= 64);
+
+    UpdateSpans(source_w, source_h);
 
-    for (int y2 = 0; y2 < h; y2++)
+    if (filter == BITMAP_FILTER_SHARP_BILINEAR)
     {
-        if (y2 < 0) continue;
-        for (int x2 = 0; x2 < w; x2++)
+        //Edge pixels depend on the neighbouring source pixels too, so the area is the covered one rounded outwards
+        BitmapRect area = SourceRectToBitmap(first_column, first_row,
+        last_column - first_column + 1, row_count);
+        if ((area.w <= 0) || (area.h <= 0)) return;
+
+        int line_offset = area.x - viewport.x;
+
+        //Filter each source row involved horizontally once
+        int first_source = row_map[area.y - viewport.y].source;
+        int last_source = row_map[area.y + area.h - 1 - viewport.y].source + 1;
+        if (last_source >= source_h) last_source = source_h - 1;
+
+        for (int row = first_source; row <= last_source; row++)
         {
-            if (x2 < 0) continue;
+            uint64_t bits = rows[row];
+            uint32_t* filtered = sharp_lines.data() + (row * viewport.w);
 
-            int offset = (y2 * w) + x2;
-            uint32_t* pixel = ((uint32_t*)data) + offset;
+            for (int x = line_offset; x < (line_offset + area.w); x++)
+            {
+                const BitmapSample& sample = column_map[x];
+                int shift = source_w - 1 - sample.source;
+                uint32_t color = ((bits >> shift) & 1) ? on_color : off_color;
 
-            *pixel = (static_cast<uint32_t>(r) << 16) | 
-                     (static_cast<uint32_t>(g) << 8)  | 
-                     static_cast<uint32_t>(b);
+                if ((sample.weight < 256) && (shift > 0))
+                {
+                    color = bitmap_blend(color, ((bits >> (shift - 1)) & 1) ? on_color : off_color, sample.weight);
+                }
+
+                filtered[x] = color;
+            }
+        }
+
+        //Then vertically. Rows inside a source row are plain copies
+        for (int y = area.y; y < (area.y + area.h); y++)
+        {
+            const BitmapSample& sample = row_map[y - viewport.y];
+            int next_row = ((sample.source + 1) < source_h) ? (sample.source + 1) : sample.source;
+
+            const uint32_t* top = sharp_lines.data() + (sample.source * viewport.w) + line_offset;
+            const uint32_t* bottom = sharp_lines.data() + (next_row * viewport.w) + line_offset;
+            uint32_t* line = ((uint32_t*)data) + (y * w) + area.x;
+
+            if (sample.weight >= 256)
+            {
+                memcpy(line, top, area.w * sizeof(uint32_t));
+                continue;
+            }
+
+            for (int x = 0; x < area.w; x++)
+            {
+                line[x] = bitmap_blend(top[x], bottom[x], sample.weight);
+            }
+        }
+
+        return;
+    }
+
+    int line_start = column_spans[first_column];
+    int line_size = (column_spans[last_column + 1] - line_start) * (int)sizeof(uint32_t);
+
+    for (int row = first_row; row < (first_row + row_count); row++)
+    {
+        int top = row_spans[row];
+        int bottom = row_spans[row + 1];
+        if (top >= bottom) continue;
+
+        uint64_t bits = rows[row];
+        uint32_t* line = ((uint32_t*)data) + (top * w);
+
+        //Expand the first bitmap row of this source row
+        bitmap_expand(line + line_start, line_size / (int)sizeof(uint32_t), bits,
+        column_select.data() + (line_start - viewport.x), column_bit.data() + (line_start - viewport.x),
+        on_color, off_color);
+
+        //The rest of the rows are copies of it
+        for (int y = top + 1; y < bottom; y++)
+        {
+            uint32_t* dst = ((uint32_t*)data) + (y * w);
+            memcpy(dst + line_start, line + line_start, line_size);
         }
     }
 }
+
+
+BitmapRect Bitmap::SourceRectToBitmap(int x, int y, int rect_w, int rect_h) const
+{
+    //Rounded outwards so it also covers blended edge pixels
+    BitmapRect rect;
+    rect.x = column_edges[x] >> 16;
+    rect.y = row_edges[y] >> 16;
+    rect.w = ((column_edges[x + rect_w] + 0xFFFF) >> 16) - rect.x;
+    rect.h = ((row_edges[y + rect_h] + 0xFFFF) >> 16) - rect.y;
+
+    return rect;
+}
@@ -1,6 +1,41 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+//A rectangle in bitmap pixels
+struct BitmapRect
+{
+    int x = 0;
+    int y = 0;
+    int w = 0;
+    int h = 0;
+};
+
+
+//How an upscaled source image is fit into the bitmap
+enum
+{
+    BITMAP_SCALE_ASPECT, //as large as fits, keeping the aspect ratio. the rest is letterboxed
+    BITMAP_SCALE_INTEGER, //largest whole multiple that fits, letterboxed. pixel perfect
+    BITMAP_SCALE_STRETCH //fill the whole bitmap
+};
+
+enum
+{
+    BITMAP_FILTER_NEAREST,
+    BITMAP_FILTER_SHARP_BILINEAR //nearest, but pixels on a source pixel edge are blended by coverage
+};
+
+
+//Which source pixel a bitmap column/row samples, and how much of it. The rest comes from source + 1
+struct BitmapSample
+{
+    uint16_t source = 0;
+    uint16_t weight = 256; //out of 256
+};
+
 
 struct Bitmap
 {
@@ -9,7 +44,65 @@ struct Bitmap
     int h = 0;
     int bpp = 4;
 
+    //Scaling settings. Change them through SetScaling so the spans get rebuilt
+    int scale_mode = BITMAP_SCALE_ASPECT;
+    int filter = BITMAP_FILTER_NEAREST;
+    uint32_t border_color = 0; //letterbox color. See PackColor
+
+    //Where each column/row edge of the upscaled source image lands in the bitmap, in 16.16 fixed point.
+    //The extra last entry is where the last column/row ends
+    std::vector<int> column_edges;
+    std::vector<int> row_edges;
+
+    //The edges rounded to whole pixels. Used by the nearest filter
+    std::vector<int> column_spans;
+    std::vector<int> row_spans;
+
+    //Per bitmap column of the viewport, which byte of a source row (as a pshufb index, the other bytes 0x80)
+    //and which bit in that byte the column samples. Only built for the nearest filter
+    std::vector<uint32_t> column_select;
+    std::vector<uint32_t> column_bit;
+
+    //Per bitmap column/row of the viewport. Only built for the sharp bilinear filter
+    std::vector<BitmapSample> column_map;
+    std::vector<BitmapSample> row_map;
+
+    //Every source row filtered horizontally, viewport.w pixels each. Only used by the sharp bilinear filter
+    std::vector<uint32_t> sharp_lines;
+
+    BitmapRect viewport; //the area the source image covers. everything else is border
+
+    //What the spans were built for. UpdateSpans only does work when one of these changes
+    char* spans_data = NULL;
+    int spans_w = 0;
+    int spans_h = 0;
+    int spans_source_w = 0;
+    int spans_source_h = 0;
+
 
     void DrawRect(int x, int y, int rect_w, int rect_h, uint8_t r, uint8_t g, uint8_t b);
     void Clear(uint8_t r, uint8_t g, uint8_t b);
-};
\ No newline at end of file
+
+    void SetScaling(int new_scale_mode, int new_filter, uint32_t new_border_color);
+
+    //Rebuilds the spans and paints the letterbox border if the bitmap or source size changed since the last call.
+    //Returns true if it did. The whole bitmap needs to be presented again then
+    bool UpdateSpans(int source_w, int source_h);
+
+    //Upscales rows of 1 bit pixels (the leftmost pixel is the most significant bit, source_w <= 64) into the bitmap.
+    //Only rows [first_row, first_row + row_count) and columns [first_column, last_column] of the source are written
+    void DrawBitRows(const uint64_t* rows, int source_w, int source_h,
+        int first_row, int row_count, int first_column, int last_column,
+        uint32_t on_color, uint32_t off_color);
+
+    //The bitmap area a rectangle of source pixels was upscaled to. Needs UpdateSpans first
+    BitmapRect SourceRectToBitmap(int x, int y, int rect_w, int rect_h) const;
+
+    static uint32_t PackColor(uint8_t r, uint8_t g, uint8_t b)
+    {
+        //R and B are flipped due to endianness
+        return (static_cast<uint32_t>(r) << 16) |
+               (static_cast<uint32_t>(g) << 8)  |
+               static_cast<uint32_t>(b);
+    }
+};
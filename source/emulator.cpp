@@ -1,102 +1,413 @@
 #include "emulator.hpp"
+#include "jit.hpp"
 
 #include <stdlib.h>
-#include <fstream>
-#include <filesystem>
 #include <time.h>
 #include <stdio.h>
-#include <string>
-#include <windows.h>
+#include <string.h>
+#include <assert.h>
+
+
+Emulator::~Emulator()
+{
+    SetJitEnabled(false);
+
+    for (uint8_t* page : private_pages)
+    {
+        delete[] page;
+    }
+
+    for (DecodedOp* page : private_decoded)
+    {
+        delete[] page;
+    }
+}
 
 
 void Emulator::Init()
 {
-    srand((unsigned)time(NULL));
+    SetSeed((uint64_t)time(NULL));
 
-    memcpy(memory.data() + FONT_ADDRESS, font_data, sizeof(font_data));
+    ShareRomImage(rom_image_blank());
 
-    program_counter = 0x200;
+    program_counter = EMULATOR_PROGRAM_ADDRESS;
 
     //init keymap
-    for (int i = 0; i < keymap.size(); i++)
+    static const char COSMAC_VIP_KEYS[EMULATOR_KEY_COUNT + 1] = "X123QWEASDZC4RFV"; //indexed by keypad key
+
+    for (int i = 0; i < EMULATOR_KEY_COUNT; i++)
     {
-        if (i < 10)
-        {
-            keymap[i] = i + '0';
-        }
-        else
-        {
-            keymap[i] = (i - 10) + 'A';
-        }
+        keymap_profiles[KEYMAP_PROFILE_HEX].bindings[i][0] = (uint8_t)((i < 10) ? (i + '0') : ((i - 10) + 'A'));
+        keymap_profiles[KEYMAP_PROFILE_COSMAC_VIP].bindings[i][0] = (uint8_t)COSMAC_VIP_KEYS[i];
     }
+
+    RebuildKeyLookup();
 }
 
 
 void Emulator::WriteInstToMemory(uint16_t inst)
 {
-    memory[program_counter] = (inst >> 8) & 0x00FF;
+    WriteMemory(program_counter, (inst >> 8) & 0x00FF);
     program_counter++;
-    memory[program_counter] = inst & 0x00FF;
+    WriteMemory(program_counter, inst & 0x00FF);
     program_counter++;
 }
 
 
-bool Emulator::LoadFromFile(wchar_t* filename)
+//Every page goes back to reading from the image. Private pages stay allocated for the next time they're needed
+void Emulator::ShareRomImage(const std::shared_ptr<const RomImage>& image)
+{
+    rom_image = image;
+    memory_pages = rom_image_pages(*rom_image);
+    decoded_pages = rom_image_decoded_pages(*rom_image);
+    owned_pages = 0;
+
+    InvalidateCode(0, EMULATOR_RAM_SIZE);
+}
+
+
+void Emulator::LoadRom(const std::shared_ptr<const RomImage>& image)
 {
-    std::filesystem::path path = filename;
-    std::ifstream file(path, std::ios::binary);
+    //Running the same ROM again only needs the pages it wrote to back, and the decoded code stays warm
+    if (image != rom_image)
+    {
+        ShareRomImage(image);
+    }
+    Reset();
+    running = true; //unpause
+}
 
-    file.seekg(0, std::ios::end);
-    long long filesize = file.tellg();
-    file.seekg(0, std::ios::beg);
 
-    if (file.good() && (filesize < EMULATOR_RAM_SIZE))
+//The image is the power on memory, so only the pages the program wrote to need to go back.
+//Pages that still hold what the image has keep their decoded and compiled code
+void Emulator::Reset()
+{
+    for (int page = 0; page < EMULATOR_PAGE_COUNT; page++)
     {
-        int address = 0x200;
-        unsigned char byte;
-        while (file.eof() == false)
+        if ((owned_pages & (1u << page)) == 0) continue;
+
+        const uint8_t* image_page = rom_image->memory.data() + (page * EMULATOR_PAGE_SIZE);
+        if (memcmp(private_pages[page], image_page, EMULATOR_PAGE_SIZE) != 0)
         {
-            file.read(reinterpret_cast<char*>(&byte), 1);
-            memory[address] = byte;
-            address++;
+            InvalidateCode(page * EMULATOR_PAGE_SIZE, (page + 1) * EMULATOR_PAGE_SIZE);
         }
+        SharePage(page);
+    }
 
-        program_counter = 0x200;
-        ClearDisplay();
-        running = true; //unpause
+    SetBeeper(false); //while the time is still the old session's, so an AudioEngine hears it in order
 
-        file.close();
-        return true;
+    v.fill(0);
+    stack.fill(0);
+    I = 0;
+    delay_timer = 0;
+    sound_timer = 0;
+    program_counter = EMULATOR_PROGRAM_ADDRESS;
+    stack_pointer = 0;
+
+    keypad = Keypad();
+    get_key_key_pressed = false;
+
+    ClearDisplay();
+    dirty_rect_count = 0;
+    should_draw_this_frame = false;
+    sound_state = SOUND_STATE_CONTINUE;
+
+    tic = 0;
+    instructions_executed = 0;
+    instructions_elided = 0;
+    frame_start_instructions = 0;
+    input_frame = -1;
+    input_slice = 0;
+    last_input_time = 0;
+
+    random_state = random_state_for_seed(random_seed);
+}
+
+
+bool Emulator::LoadFromFile(const wchar_t* filename)
+{
+    int error;
+    std::shared_ptr<const RomImage> image = rom_image_from_file(filename, &error);
+    if (image == nullptr)
+    {
+        printf("WARNING: Loading ROM from file '%ls' failed. %s\n", filename, rom_error_string(error));
+        return false;
     }
 
-    wprintf(L"Loading ROM from file '%ls' failed.\n", filename);
-    file.close();
+    LoadRom(image);
+    return true;
+}
+
+
+bool Emulator::LoadFromFile(const char* filename)
+{
+    int error;
+    std::shared_ptr<const RomImage> image = rom_image_from_file(filename, &error);
+    if (image == nullptr)
+    {
+        printf("WARNING: Loading ROM from file '%s' failed. %s\n", filename, rom_error_string(error));
+        return false;
+    }
 
-    return false;
+    LoadRom(image);
+    return true;
 }
 
 
-void Emulator::ClearDisplay()
+static uint8_t* save_bytes(uint8_t* cursor, const void* data, size_t size)
+{
+    memcpy(cursor, data, size);
+    return cursor + size;
+}
+
+
+static const uint8_t* load_bytes(const uint8_t* cursor, void* data, size_t size)
+{
+    memcpy(data, cursor, size);
+    return cursor + size;
+}
+
+
+//LoadState reads the fields back in exactly this order
+int Emulator::SaveState(uint8_t* buffer, int buffer_size) const
+{
+    if ((buffer == NULL) || (buffer_size < SAVE_STATE_SIZE)) return 0;
+
+    uint16_t reserved = 0;
+    uint8_t mode = (uint8_t)compatibility_mode;
+    uint8_t key_pressed = keypad.key_just_pressed;
+    uint8_t waiting_key_pressed = get_key_key_pressed;
+    int32_t frame = tic;
+
+    uint8_t* cursor = buffer;
+    cursor = save_bytes(cursor, &SAVE_STATE_MAGIC, 4);
+    cursor = save_bytes(cursor, &SAVE_STATE_VERSION, 2);
+    cursor = save_bytes(cursor, &reserved, 2);
+
+    for (int page = 0; page < EMULATOR_PAGE_COUNT; page++)
+    {
+        cursor = save_bytes(cursor, memory_pages[page], EMULATOR_PAGE_SIZE);
+    }
+    cursor = save_bytes(cursor, v.data(), EMULATOR_REGISTER_COUNT);
+    cursor = save_bytes(cursor, stack.data(), EMULATOR_STACK_SIZE * 2);
+    cursor = save_bytes(cursor, display.data(), DISPLAY_HEIGHT * sizeof(DisplayRow));
+    cursor = save_bytes(cursor, keypad.keys.data(), EMULATOR_KEY_COUNT);
+
+    cursor = save_bytes(cursor, &I, 2);
+    cursor = save_bytes(cursor, &program_counter, 2);
+    cursor = save_bytes(cursor, &stack_pointer, 1);
+    cursor = save_bytes(cursor, &delay_timer, 1);
+    cursor = save_bytes(cursor, &sound_timer, 1);
+
+    cursor = save_bytes(cursor, &key_pressed, 1);
+    cursor = save_bytes(cursor, &keypad.last_key_pressed, 1);
+    cursor = save_bytes(cursor, &waiting_key_pressed, 1);
+    cursor = save_bytes(cursor, &mode, 1);
+    cursor = save_bytes(cursor, &frame, 4);
+    cursor = save_bytes(cursor, &random_seed, 8);
+    cursor = save_bytes(cursor, &random_state, 8);
+
+    assert((cursor - buffer) == SAVE_STATE_SIZE);
+    return SAVE_STATE_SIZE;
+}
+
+
+void Emulator::SaveState(std::vector<uint8_t>* out) const
 {
-    for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++)
+    out->resize(SAVE_STATE_SIZE);
+    SaveState(out->data(), SAVE_STATE_SIZE);
+}
+
+
+bool Emulator::LoadState(const uint8_t* buffer, int buffer_size)
+{
+    if ((buffer == NULL) || (buffer_size < SAVE_STATE_SIZE)) return false;
+
+    uint32_t magic;
+    uint16_t version;
+    memcpy(&magic, buffer, 4);
+    memcpy(&version, buffer + 4, 2);
+
+    if ((magic != SAVE_STATE_MAGIC) || (version != SAVE_STATE_VERSION))
+    {
+        printf("WARNING: Not a version %d save state.\n", SAVE_STATE_VERSION);
+        return false;
+    }
+
+    //Values that index into the machine are checked before anything is changed, so a damaged blob can't
+    //point the stack, keypad or memory reads out of bounds
+    const uint8_t* registers = buffer + SAVE_STATE_REGISTERS_OFFSET;
+    uint16_t saved_program_counter;
+    uint8_t saved_stack_pointer = registers[4];
+    uint8_t saved_last_key_pressed = registers[8];
+    memcpy(&saved_program_counter, registers + 2, 2);
+
+    if ((saved_program_counter >= EMULATOR_RAM_SIZE) || (saved_stack_pointer >= EMULATOR_STACK_SIZE) ||
+        (saved_last_key_pressed >= EMULATOR_KEY_COUNT))
+    {
+        printf("WARNING: The save state is damaged. Its registers are out of range.\n");
+        return false;
+    }
+
+    const uint8_t* cursor = buffer + SAVE_STATE_HEADER_SIZE;
+
+    //Only drop decoded/compiled code for the part of memory that actually changed.
+    //Rolling back usually only touches data, so the code caches stay warm
+    for (int page = 0; page < EMULATOR_PAGE_COUNT; page++)
+    {
+        const uint8_t* saved = cursor + (page * EMULATOR_PAGE_SIZE);
+        const uint8_t* current = memory_pages[page];
+        if (memcmp(current, saved, EMULATOR_PAGE_SIZE) == 0) continue;
+
+        //Narrow it down 8 bytes at a time
+        const int WORD_COUNT = EMULATOR_PAGE_SIZE / 8;
+
+        int first_word = 0;
+        while (memcmp(current + (first_word * 8), saved + (first_word * 8), 8) == 0)
+        {
+            first_word++;
+        }
+
+        int last_word = WORD_COUNT - 1;
+        while (memcmp(current + (last_word * 8), saved + (last_word * 8), 8) == 0)
+        {
+            last_word--;
+        }
+
+        //Pages that went back to what the ROM had are shared again
+        const uint8_t* image_page = rom_image->memory.data() + (page * EMULATOR_PAGE_SIZE);
+        if (memcmp(image_page, saved, EMULATOR_PAGE_SIZE) == 0)
+        {
+            SharePage(page);
+        }
+        else
+        {
+            MakePagePrivate(page);
+            memcpy(private_pages[page], saved, EMULATOR_PAGE_SIZE);
+        }
+
+        int page_start = page * EMULATOR_PAGE_SIZE;
+        InvalidateCode(page_start + (first_word * 8), page_start + ((last_word + 1) * 8));
+    }
+    cursor += EMULATOR_RAM_SIZE;
+
+    uint8_t mode;
+    uint8_t key_pressed;
+    uint8_t waiting_key_pressed;
+    int32_t frame;
+
+    cursor = load_bytes(cursor, v.data(), EMULATOR_REGISTER_COUNT);
+    cursor = load_bytes(cursor, stack.data(), EMULATOR_STACK_SIZE * 2);
+    cursor = load_bytes(cursor, display.data(), DISPLAY_HEIGHT * sizeof(DisplayRow));
+    cursor = load_bytes(cursor, keypad.keys.data(), EMULATOR_KEY_COUNT);
+
+    cursor = load_bytes(cursor, &I, 2);
+    cursor = load_bytes(cursor, &program_counter, 2);
+    cursor = load_bytes(cursor, &stack_pointer, 1);
+    cursor = load_bytes(cursor, &delay_timer, 1);
+    cursor = load_bytes(cursor, &sound_timer, 1);
+
+    cursor = load_bytes(cursor, &key_pressed, 1);
+    cursor = load_bytes(cursor, &keypad.last_key_pressed, 1);
+    cursor = load_bytes(cursor, &waiting_key_pressed, 1);
+    cursor = load_bytes(cursor, &mode, 1);
+    cursor = load_bytes(cursor, &frame, 4);
+    cursor = load_bytes(cursor, &random_seed, 8);
+    cursor = load_bytes(cursor, &random_state, 8);
+
+    assert((cursor - buffer) == SAVE_STATE_SIZE);
+
+    keypad.key_just_pressed = (key_pressed != 0);
+    get_key_key_pressed = (waiting_key_pressed != 0);
+    SetCompatibilityMode(mode);
+    tic = frame;
+
+    InvalidateDisplay();
+
+    return true;
+}
+
+
+void Emulator::SetClockHz(int hz)
+{
+    SetInstructionsPerFrame((hz + EMULATOR_FRAMES_PER_SECOND / 2) / EMULATOR_FRAMES_PER_SECOND);
+}
+
+
+void Emulator::SetInstructionsPerFrame(int count)
+{
+    if (count < 1)
+    {
+        count = 1;
+    }
+    if (count > EMULATOR_MAX_INSTRUCTIONS_PER_FRAME)
     {
-        display[i] = 0;
+        count = EMULATOR_MAX_INSTRUCTIONS_PER_FRAME;
     }
+
+    instructions_per_frame = count;
+}
+
+
+void Emulator::SetSeed(uint64_t seed)
+{
+    random_seed = seed;
+    random_state = random_state_for_seed(seed);
+}
+
+
+uint64_t random_state_for_seed(uint64_t seed)
+{
+    //splitmix64 so close seeds still give unrelated sequences. xorshift can't start from 0
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+
+    return z ? z : 1;
+}
+
+
+void Emulator::ClearDisplay()
+{
+    display.fill(0);
+    InvalidateDisplay();
+}
+
+
+void Emulator::InvalidateDisplay()
+{
+    dirty_rows = 0xFFFFFFFF;
+    dirty_columns = ~((DisplayRow)0);
 }
 
 
 void Emulator::LateUpdate()
 {
     should_draw_this_frame = false;
+    dirty_rect_count = 0;
 }
 
 
 void Emulator::Update()
 {
+    int frame = tic;
     tic++;
+    frame_start_instructions = instructions_executed;
+
+    //A recorded resume has to land before the pause check, the frame it was recorded on ran
+    if (input_hooks.play)
+    {
+        input_hooks.play(input_hooks.context, this, frame, 0);
+    }
+
     if (running == false)
     {
-        if (should_draw_this_frame)
+        //Keep the keypad current while paused
+        DrainInput(frame, 0, INT64_MAX);
+        SetBeeper(false);
+
+        if (should_draw_this_frame && defer_draw == false)
         {
             Draw();
         }
@@ -120,16 +431,43 @@ void Emulator::Update()
             sound_state = SOUND_STATE_STOP;
         }
     }
+    SetBeeper(sound_timer > 0); //also picks the tone back up after a pause
 
-    for (int i = 0; i < 15; i++)
+    int slice_count = input_slices;
+    if (slice_count > instructions_per_frame)
     {
-        if (program_counter < (EMULATOR_RAM_SIZE-2))
+        slice_count = instructions_per_frame;
+    }
+    if (slice_count < 1)
+    {
+        slice_count = 1;
+    }
+
+    int64_t time_span = input_time_end - input_time_start;
+
+    for (int slice = 0; slice < slice_count; slice++)
+    {
+        int64_t until = INT64_MAX;
+        if (time_span > 0)
+        {
+            until = input_time_start + (time_span * (slice + 1)) / slice_count;
+        }
+        DrainInput(frame, slice, until);
+
+        int count = ((instructions_per_frame * (slice + 1)) / slice_count) -
+        ((instructions_per_frame * slice) / slice_count);
+
+        if (jit)
+        {
+            ExecuteJit(count);
+        }
+        else
         {
-            Execute();
+            ExecuteInstructions(count);
         }
     }
 
-    if (should_draw_this_frame)
+    if (should_draw_this_frame && defer_draw == false)
     {
         Draw();
     }
@@ -145,550 +483,1180 @@ void Emulator::Update()
 
 void Emulator::Draw()
 {
-    int scale_w = bitmap.w / DISPLAY_WIDTH;
-    int scale_h = bitmap.h / DISPLAY_HEIGHT;
+    dirty_rect_count = 0;
 
-    for (int y = 0; y < DISPLAY_HEIGHT; y++)
-    {
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
-        {
-            uint8_t color = display[x + (y * DISPLAY_WIDTH)];
+    if (bitmap.data == NULL) return;
 
-            if (color == 1)
-            {
-                bitmap.DrawRect(x * scale_w, y * scale_h,
-                scale_w, scale_h, 160, 160, 160);
-            }
-            else if (color == 0)
-            {
-                bitmap.DrawRect(x * scale_w, y * scale_h,
-                scale_w, scale_h, 30, 30, 30);
-            }
-        }
-    }
+    dirty_rect_count = draw_display(&bitmap, display.data(), dirty_rows, dirty_columns, dirty_rects.data());
+
+    dirty_rows = 0;
+    dirty_columns = 0;
 }
 
-#define NIBBLE(x, n_index) (x >> (n_index * 4)) & 0xF;
 
-void Emulator::Execute()
+int draw_display(Bitmap* bitmap, const DisplayRow* display, uint32_t dirty_rows, DisplayRow dirty_columns,
+    BitmapRect* dirty_rects)
 {
-    uint16_t instruction = memory[program_counter+1] | (((uint16_t)memory[program_counter]) << 8); 
-    uint8_t code = NIBBLE(instruction, 3);
-    uint8_t x = NIBBLE(instruction, 2);
-    uint8_t y = NIBBLE(instruction, 1);
-    uint8_t n = NIBBLE(instruction, 0);
-    uint8_t nn = instruction & 0x00FF;
-    uint16_t nnn = instruction & 0x0FFF;
+    //A new bitmap size rebuilds the scaling and repaints the border, so everything has to be drawn and presented
+    bool rescaled = bitmap->UpdateSpans(DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (rescaled)
+    {
+        dirty_rows = 0xFFFFFFFF;
+        dirty_columns = ~((DisplayRow)0);
+    }
 
-    //For instructions that can use v[f] as vx or vy
-    uint8_t vx = v[x];
-    uint8_t vy = v[y];
+    if (dirty_rows == 0) return 0;
 
-    bool increment_pc = true;
+    //Horizontal extent of everything that changed
+    int first_column = 0;
+    while ((dirty_columns & ((DisplayRow)1 << (DISPLAY_WIDTH - 1 - first_column))) == 0)
+    {
+        first_column++;
+    }
 
-    switch (code)
+    int last_column = DISPLAY_WIDTH - 1;
+    while ((dirty_columns & ((DisplayRow)1 << (DISPLAY_WIDTH - 1 - last_column))) == 0)
     {
-        case 0:
+        last_column--;
+    }
+
+    //Repaint each run of consecutive dirty rows as one rectangle
+    int rect_count = 0;
+    int y = 0;
+    while (y < DISPLAY_HEIGHT)
+    {
+        if ((dirty_rows & (1u << y)) == 0)
         {
-            switch (instruction)
-            {
-                case 0x00E0: //CLEAR SCREEN
-                {
-                    memset(display.data(), 0, sizeof(display));
-                    should_draw_this_frame = true;
-                } break;
+            y++;
+            continue;
+        }
 
-                case 0x00EE: //RETURN FROM SUBROUTINE
-                {
-                    if (stack_pointer >= 0)
-                    {
-                        stack_pointer--;
-                    }
-                    program_counter = stack[stack_pointer];
-                    stack[stack_pointer] = 0;
+        int run_start = y;
+        while ((y < DISPLAY_HEIGHT) && (dirty_rows & (1u << y)))
+        {
+            y++;
+        }
 
-//                    increment_pc = false;
-                } break;
-            }
-        } break;
+        int run_length = y - run_start;
+        int column_count = last_column - first_column + 1;
 
-        case 1: //JUMP
-        {
-            uint16_t address = instruction & 0x0FFF;
-            program_counter = address;
+        bitmap->DrawBitRows(display, DISPLAY_WIDTH, DISPLAY_HEIGHT,
+        run_start, run_length, first_column, last_column,
+        DISPLAY_ON_COLOR, DISPLAY_OFF_COLOR);
 
-            increment_pc = false;
-        } break;
+        dirty_rects[rect_count] = bitmap->SourceRectToBitmap(first_column, run_start,
+        column_count, run_length);
+        rect_count++;
+    }
 
-        case 2: //JUMP SUBROUTINE
-        {
-            stack[stack_pointer] = program_counter;
-            stack_pointer++;
-            if (stack_pointer >= EMULATOR_STACK_SIZE)
-            {
-                //TODO(omar): stack overflow
-            }
+    if (rescaled)
+    {
+        dirty_rects[0].x = 0;
+        dirty_rects[0].y = 0;
+        dirty_rects[0].w = bitmap->w;
+        dirty_rects[0].h = bitmap->h;
+        rect_count = 1;
+    }
 
-            program_counter = nnn;
+    return rect_count;
+}
 
-            increment_pc = false;
-        } break;
 
-        case 3: //SKIP IF EQUAL
+void Emulator::PublishFrame(TripleBuffer<DisplayFrame>* frames) const
+{
+    DisplayFrame& frame = frames->WriteSlot();
+    frame.display = display;
+    frame.frame_number = (uint64_t)tic;
+    frame.input_time = last_input_time;
+    frames->Publish();
+}
+
+#define NIBBLE(x, n_index) (x >> (n_index * 4)) & 0xF;
+
+DecodedOp decode_instruction(uint16_t instruction)
+{
+    DecodedOp op;
+    uint8_t code = NIBBLE(instruction, 3);
+    op.x = NIBBLE(instruction, 2);
+    op.y = NIBBLE(instruction, 1);
+    op.n = NIBBLE(instruction, 0);
+    op.nn = instruction & 0x00FF;
+    op.nnn = instruction & 0x0FFF;
+
+    op.handler = OP_NOP;
+
+    switch (code)
+    {
+        case 0:
         {
-            if (v[x] == nn)
-            {
-                program_counter += 2; 
-            }
+            if (instruction == 0x00E0) op.handler = OP_CLEAR;
+            else if (instruction == 0x00EE) op.handler = OP_RETURN;
         } break;
 
-        case 4: //SKIP IF NOT EQUAL
+        case 1: op.handler = OP_JUMP; break;
+        case 2: op.handler = OP_CALL; break;
+        case 3: op.handler = OP_SKIP_EQ_NN; break;
+        case 4: op.handler = OP_SKIP_NE_NN; break;
+        case 5: op.handler = OP_SKIP_EQ_VY; break;
+        case 6: op.handler = OP_SET_NN; break;
+        case 7: op.handler = OP_ADD_NN; break;
+        case 9: op.handler = OP_SKIP_NE_VY; break;
+        case 0xA: op.handler = OP_SET_I; break;
+        case 0xB: op.handler = OP_JUMP_OFFSET; break;
+        case 0xC: op.handler = OP_RANDOM; break;
+        case 0xD: op.handler = OP_DRAW; break;
+
+        case 0xE:
         {
-            if (v[x] != nn)
-            {
-                program_counter += 2; 
-            }
+            if (op.nn == 0x9E) op.handler = OP_SKIP_KEY;
+            else if (op.nn == 0xA1) op.handler = OP_SKIP_NOT_KEY;
         } break;
 
-        case 5: //SKIP IF EQUAL
+        case 0xF:
         {
-            if (v[x] == v[y])
+            switch (op.nn)
             {
-                program_counter += 2;
+                case 0x07: op.handler = OP_GET_DELAY; break;
+                case 0x0A: op.handler = OP_GET_KEY; break;
+                case 0x15: op.handler = OP_SET_DELAY; break;
+                case 0x18: op.handler = OP_SET_SOUND; break;
+                case 0x1E: op.handler = OP_ADD_I; break;
+                case 0x29: op.handler = OP_FONT_CHAR; break;
+                case 0x33: op.handler = OP_BCD; break;
+                case 0x55: op.handler = OP_STORE; break;
+                case 0x65: op.handler = OP_LOAD; break;
             }
         } break;
 
-        case 9: //SKIP IF NOT EQUAL
+        case 0x8:
         {
-            if (v[x] != v[y])
+            switch (op.n)
             {
-                program_counter += 2;
+                case 0: op.handler = OP_SET_VY; break;
+                case 1: op.handler = OP_OR; break;
+                case 2: op.handler = OP_AND; break;
+                case 3: op.handler = OP_XOR; break;
+                case 4: op.handler = OP_ADD_VY; break;
+                case 5: op.handler = OP_SUB; break;
+                case 6: op.handler = OP_SHIFT_RIGHT; break;
+                case 7: op.handler = OP_SUBN; break;
+                case 0xE: op.handler = OP_SHIFT_LEFT; break;
             }
         } break;
+    }
 
-        case 6: //SET V
-        {
-            v[x] = nn;
-        } break;
+    return op;
+}
 
-        case 7: //ADD TO V
-        {
-            v[x] += nn;
-        } break;
 
-        case 0xA: //SET I
-        {
-            I = instruction & 0x0FFF;
-        } break;
+static std::vector<DecodedOp> build_decode_table()
+{
+    std::vector<DecodedOp> table(0x10000);
+    for (int i = 0; i < 0x10000; i++)
+    {
+        table[i] = decode_instruction((uint16_t)i);
+    }
 
-        case 0xB: //JUMP WITH OFFSET
-        {
-            if (compatibility_mode & COMP_MODE_COSMAC)
-            {
-                program_counter = nnn + v[0];
-            }
-            else
-            {
-                program_counter = (instruction & 0x0FFF) + vx;
-            }
+    return table;
+}
 
-            increment_pc = false;
-        } break;
 
-        case 0xC: //RANDOM NUMBER GEN
-        {
-            v[x] = ((uint8_t)rand()) & (instruction & 0x00FF);
-        } break;
+//What decoded_pages points to for pages nothing has been decoded for
+static const std::array<DecodedOp, EMULATOR_PAGE_SIZE> undecoded_page = {};
 
-        case 0xE: //SKIP IF KEY
-        {
-            int index  = (v[x] % EMULATOR_KEY_COUNT);
-            if (index >= EMULATOR_KEY_COUNT) break;
 
-            if (nn == 0x9e)
-            {
-                if (keypad.keys[index] == 1)
-                {
-                    program_counter += 2;
-                }
-            }
-            else if (nn == 0xA1)
-            {
-                if (keypad.keys[index] == 0)
-                {
-                    program_counter += 2;
-                }
-            }
-        } break;
+const DecodedOp* decode_table()
+{
+    static const std::vector<DecodedOp> table = build_decode_table();
+    return table.data();
+}
 
-        case 0xF: //WEIRD INSTRUCTION FAMILY
-        {
-            switch (nn)
-            {
-                //TIMER STUFF
-                case 0x7:
-                {
-                    v[x] = delay_timer;
-                } break;
 
-                case 0x15:
-                {
-                    delay_timer = v[x];
-                } break;
+void Emulator::WriteMemory(uint16_t address, uint8_t value)
+{
+    int page = address / EMULATOR_PAGE_SIZE;
+    int offset = address % EMULATOR_PAGE_SIZE;
 
-                case 0x18:
-                {
-                    sound_timer = v[x];
-                    if (sound_timer)
-                    {
-                        sound_state = SOUND_STATE_PLAY;
-                    }
-                    else
-                    {
-                        sound_state = SOUND_STATE_STOP;
-                    }
-                } break;
+    if ((owned_pages & (1u << page)) == 0)
+    {
+        //Writing what's already there doesn't need a copy. FX55 often stores unchanged registers
+        if (memory_pages[page][offset] == value) return;
 
-                
-                case 0x1E: //ADD TO INDEX REGISTER
-                {
-                    I += v[x];
+        MakePagePrivate(page);
+    }
 
-                    if (compatibility_mode & COMP_MODE_AMIGA)
-                    {
-                        if (I > 0x1000) //overflow from addressing range
-                        {
-                            v[0xf] = 1;
-                        }
-                    }
-                } break;
+    private_pages[page][offset] = value;
 
-                case 0x0A: //Get key
-                {
-                    if (get_key_key_pressed)
-                    {
-                        uint8_t key = keypad.keys[keypad.last_key_pressed];
-                        if (key != 0) //not yet released
-                        {
-                            increment_pc = false;
-                        }
-                        else
-                        {
-                            //instruction done
-                            v[x] = keypad.last_key_pressed;
-                            get_key_key_pressed = false;
-                        }
-                    }
-                    else
-                    {
+    InvalidateCode(address, address + 1);
+}
 
-                        increment_pc = false; //loop 
-                        if (keypad.key_just_pressed == true)
-                        {
-                            get_key_key_pressed = true;
-                        }
-                    }
-                } break;
 
-                case 0x29: //GET FONT CHARACTER ADDRESS
-                {
-                    uint8_t character = (v[x] % EMULATOR_KEY_COUNT);
-                    I = FONT_ADDRESS + (character * FONT_CHAR_HEIGHT);
-                } break;
+void Emulator::MakePagePrivate(int page)
+{
+    if (owned_pages & (1u << page)) return;
+
+    if (private_pages[page] == nullptr)
+    {
+        private_pages[page] = new uint8_t[EMULATOR_PAGE_SIZE];
+    }
+
+    memcpy(private_pages[page], memory_pages[page], EMULATOR_PAGE_SIZE);
+    memory_pages[page] = private_pages[page];
+    owned_pages |= (1u << page);
+
+    //Most written pages only ever hold data. DecodeAt gives the page its own decoded instructions if code runs from it
+    decoded_pages[page] = undecoded_page.data();
+}
+
+
+void Emulator::SharePage(int page)
+{
+    memory_pages[page] = rom_image->memory.data() + (page * EMULATOR_PAGE_SIZE);
+    decoded_pages[page] = rom_image->decoded.data() + (page * EMULATOR_PAGE_SIZE);
+    owned_pages &= ~(1u << page);
+}
+
+
+//For addresses decoded_pages has no instruction for yet. Only owned pages keep what's decoded here,
+//the last address of a shared page is decoded every time it runs
+const DecodedOp* Emulator::DecodeAt(uint16_t address)
+{
+    uint16_t instruction = ReadMemory(address+1) | (((uint16_t)ReadMemory(address)) << 8);
+    const DecodedOp* op = decode_table() + instruction;
+
+    int page = address / EMULATOR_PAGE_SIZE;
+    if ((owned_pages & (1u << page)) == 0) return op;
+
+    if (decoded_pages[page] != private_decoded[page])
+    {
+        if (private_decoded[page] == nullptr)
+        {
+            private_decoded[page] = new DecodedOp[EMULATOR_PAGE_SIZE];
+        }
+
+        for (int i = 0; i < EMULATOR_PAGE_SIZE; i++)
+        {
+            private_decoded[page][i] = DecodedOp();
+        }
+        decoded_pages[page] = private_decoded[page];
+    }
+
+    DecodedOp* slot = private_decoded[page] + (address % EMULATOR_PAGE_SIZE);
+    *slot = *op;
+
+    return slot;
+}
+
+
+void Emulator::ReadMemoryBlock(int address, int size, uint8_t* out) const
+{
+    int offset = address % EMULATOR_PAGE_SIZE;
+
+    //FX65 almost never crosses a page, one copy does it then
+    if ((address + size <= EMULATOR_RAM_SIZE) && (offset + size <= EMULATOR_PAGE_SIZE))
+    {
+        const uint8_t* source = memory_pages[address / EMULATOR_PAGE_SIZE] + offset;
+        for (int i = 0; i < size; i++)
+        {
+            out[i] = source[i];
+        }
+        return;
+    }
+
+    for (int i = 0; i < size; i++)
+    {
+        out[i] = ReadMemory((uint16_t)((address + i) % EMULATOR_RAM_SIZE));
+    }
+}
+
+
+//Same as calling WriteMemory for every byte, but FX55 and FX33 only pay for
+//the page check and the invalidation once instead of once per register
+void Emulator::WriteMemoryBlock(int address, int size, const uint8_t* data)
+{
+    int page = address / EMULATOR_PAGE_SIZE;
+    int offset = address % EMULATOR_PAGE_SIZE;
+
+    if ((address + size > EMULATOR_RAM_SIZE) || (offset + size > EMULATOR_PAGE_SIZE))
+    {
+        for (int i = 0; i < size; i++)
+        {
+            WriteMemory((uint16_t)((address + i) % EMULATOR_RAM_SIZE), data[i]);
+        }
+        return;
+    }
+
+    //Nothing changes so there's nothing to copy or invalidate
+    const uint8_t* current = memory_pages[page] + offset;
+    int first_change = 0;
+    while ((first_change < size) && (current[first_change] == data[first_change])) first_change++;
+    if (first_change == size) return;
+
+    MakePagePrivate(page);
+
+    uint8_t* destination = private_pages[page] + offset;
+    for (int i = first_change; i < size; i++)
+    {
+        destination[i] = data[i];
+    }
+
+    InvalidateCode(address + first_change, address + size);
+}
+
+
+void Emulator::InvalidateCode(int start, int end)
+{
+    if (start > 0) start--;
+    if (end > EMULATOR_RAM_SIZE) end = EMULATOR_RAM_SIZE;
+
+    //Shared pages hold what the image does, so only the page's own decoded instructions can be stale
+    for (int i = start; i < end; i++)
+    {
+        int page = i / EMULATOR_PAGE_SIZE;
+        if (decoded_pages[page] == private_decoded[page])
+        {
+            private_decoded[page][i % EMULATOR_PAGE_SIZE].handler = OP_UNDECODED;
+        }
+    }
+
+    if (jit)
+    {
+        jit->Invalidate(start, end);
+    }
+}
+
+
+bool Emulator::SetJitEnabled(bool enabled)
+{
+    if (enabled)
+    {
+        if (jit) return true;
+
+        jit = new Jit();
+        if (jit->Init() == false)
+        {
+            delete jit;
+            jit = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    if (jit)
+    {
+        jit->Destroy();
+        delete jit;
+        jit = nullptr;
+    }
+
+    return true;
+}
+
+
+void Emulator::ExecuteJit(int count)
+{
+    int executed = 0;
+    while (executed < count)
+    {
+        if (skip_idle_loops)
+        {
+            int skipped = SkipIdleLoop(program_counter, count - executed);
+            instructions_executed += skipped;
+            executed += skipped;
+            if (executed >= count) break;
+        }
+
+        int block_count = jit->Run(this, count - executed);
+        if (block_count == 0)
+        {
+            //Unsupported instructions in a row run in one interpreter call
+            block_count = jit->InterpretCount(program_counter);
+            if (block_count > (count - executed)) block_count = count - executed;
+
+            ExecuteInstructions(block_count);
+        }
+        else
+        {
+            instructions_executed += block_count;
+        }
+
+        executed += block_count;
+    }
+
+    //Compiled blocks can also run off the end of memory. Parked like the interpreter does
+    if (program_counter >= EMULATOR_RAM_SIZE)
+    {
+        program_counter = EMULATOR_RAM_SIZE - 2;
+    }
+}
+
+
+//Idle loops only read things that can't change until the next frame (the delay timer and the keypad),
+//so once one is spinning every remaining iteration of the frame is the same. Recognized loops:
+//  1NNN jumping to itself
+//  FX07, 3XNN/4XNN, 1NNN back to the FX07. Only while the skip won't be taken this frame
+//  FX0A while there's no key event for it to act on
+//Returns the length of one iteration, 0 if the code at address isn't one of these
+int Emulator::IdleLoopLength(uint16_t address) const
+{
+    if (address > (EMULATOR_RAM_SIZE - 6)) return 0;
+
+    uint16_t first = (ReadMemory(address) << 8) | ReadMemory(address + 1);
 
-                case 0x33: //SPLIT NUM INTO DIGITS
+    if (first == (0x1000 | address)) return 1;
+
+    if ((first & 0xF0FF) == 0xF00A)
+    {
+        bool waiting_for_press = (get_key_key_pressed == false) && (keypad.key_just_pressed == false);
+        bool waiting_for_release = get_key_key_pressed && (keypad.keys[keypad.last_key_pressed] != 0);
+
+        return (waiting_for_press || waiting_for_release) ? 1 : 0;
+    }
+
+    if ((first & 0xF0FF) == 0xF007)
+    {
+        uint16_t skip = (ReadMemory(address + 2) << 8) | ReadMemory(address + 3);
+        uint16_t jump = (ReadMemory(address + 4) << 8) | ReadMemory(address + 5);
+
+        if (jump != (0x1000 | address)) return 0;
+        if (((skip >> 8) & 0xF) != ((first >> 8) & 0xF)) return 0;
+
+        uint8_t nn = skip & 0xFF;
+        if ((skip & 0xF000) == 0x3000) return (delay_timer != nn) ? 3 : 0;
+        if ((skip & 0xF000) == 0x4000) return (delay_timer == nn) ? 3 : 0;
+    }
+
+    return 0;
+}
+
+
+//Skips whole iterations of the idle loop at address out of remaining instructions.
+//Returns how many were skipped. The partial iteration at the end still runs so the state is exact
+int Emulator::SkipIdleLoop(uint16_t address, int remaining)
+{
+    int length = IdleLoopLength(address);
+    if (length == 0) return 0;
+
+    int skipped = remaining - (remaining % length);
+    if (skipped == 0) return 0;
+
+    //The only thing an iteration writes. Already true when coming from the loop's own jump
+    if (length == 3)
+    {
+        v[ReadMemory(address) & 0xF] = delay_timer;
+    }
+
+    instructions_elided += skipped;
+    return skipped;
+}
+
+
+void Emulator::Execute()
+{
+    ExecuteInstructions(1);
+}
+
+
+int quirk_profile_for_mode(int mode)
+{
+    if (mode & COMP_MODE_AMIGA) return QUIRK_PROFILE_AMIGA;
+    if (mode & COMP_MODE_MODERN) return QUIRK_PROFILE_MODERN;
+    if (mode & COMP_MODE_COSMAC) return QUIRK_PROFILE_COSMAC;
+
+    return QUIRK_PROFILE_MODERN;
+}
+
+
+void Emulator::SetCompatibilityMode(int mode)
+{
+    compatibility_mode = mode;
+    execute_mode = mode;
+
+    switch (quirk_profile_for_mode(mode))
+    {
+        case QUIRK_PROFILE_COSMAC: execute_instructions = &Emulator::ExecuteInstructionsWith<QuirksCosmac>; break;
+        case QUIRK_PROFILE_AMIGA: execute_instructions = &Emulator::ExecuteInstructionsWith<QuirksAmiga>; break;
+        default: execute_instructions = &Emulator::ExecuteInstructionsWith<QuirksModern>; break;
+    }
+}
+
+
+void Emulator::ExecuteInstructions(int count)
+{
+    //compatibility_mode can also be assigned directly. Picking the profile here keeps that working
+    if (compatibility_mode != execute_mode)
+    {
+        SetCompatibilityMode(compatibility_mode);
+    }
+
+    (this->*execute_instructions)(count);
+}
+
+
+//The program counter is kept in a local for the whole batch so it can live in a register
+//instead of being stored and reloaded through the struct every instruction.
+//Quirks are compile time constants here, so every profile gets its own copy without mode checks
+template <typename Quirks>
+void Emulator::ExecuteInstructionsWith(int count)
+{
+    uint16_t pc = program_counter;
+
+    //decoded_pages of the page the program counter was in, so the next instruction's address only depends on
+    //the program counter and not on loading the page too. NO_PAGE after anything that can change decoded_pages
+    const uint16_t NO_PAGE = 0x8000;
+    uint16_t page_start = NO_PAGE;
+    const DecodedOp* page_ops = nullptr;
+
+    for (int instruction_index = 0; instruction_index < count; instruction_index++)
+    {
+        uint16_t offset = pc - page_start;
+        if (offset >= EMULATOR_PAGE_SIZE)
+        {
+            //BNNN can jump past the end of memory. The program counter stays there for the rest of the batch
+            if (pc >= EMULATOR_RAM_SIZE)
+            {
+                continue;
+            }
+
+            page_start = pc - (pc % EMULATOR_PAGE_SIZE);
+            page_ops = use_decode_cache ? decoded_pages[pc / EMULATOR_PAGE_SIZE] : undecoded_page.data();
+            offset = pc % EMULATOR_PAGE_SIZE;
+        }
+
+        //Going through the shared table on every instruction is slower than a decoded_pages slot: the table
+        //address depends on two memory loads, the slot only on the program counter
+        const DecodedOp* op = page_ops + offset;
+
+    dispatch:
+        uint8_t x = op->x;
+        uint8_t y = op->y;
+        uint8_t n = op->n;
+        uint8_t nn = op->nn;
+        uint16_t nnn = op->nnn;
+
+        //For instructions that can use v[f] as vx or vy
+        uint8_t vx = v[x];
+        uint8_t vy = v[y];
+
+        bool increment_pc = true;
+
+        switch (op->handler)
+        {
+            //The last two addresses are never decoded, so the end of memory is only checked for here
+            case OP_UNDECODED:
+            {
+                if (pc >= (EMULATOR_RAM_SIZE-2))
                 {
-                    int num = v[x]; //NOTE(omar): the original COSMAC only took the last nibble
-                    uint8_t digits[3] = {0};
-                    int digit_count = 0;
+                    continue;
+                }
 
-                    while (num != 0 && (digit_count <= 2))
-                    {
-                        digits[digit_count] = num % 10;
-                        num /= 10;
-                        digit_count++;
-                    }
+                if (use_decode_cache)
+                {
+                    op = DecodeAt(pc);
+                    page_start = NO_PAGE;
+                }
+                else
+                {
+                    uint16_t instruction = ReadMemory(pc+1) | (((uint16_t)ReadMemory(pc)) << 8);
+                    op = decode_table() + instruction;
+                }
+            } goto dispatch;
 
-                    int j = 0;
-                    for (int i = 2; i >= 0; i--)
+            case OP_CLEAR: //CLEAR SCREEN
+            {
+                //Only rows that had something on them change
+                for (int i = 0; i < DISPLAY_HEIGHT; i++)
+                {
+                    if (display[i])
                     {
-                        memory[(I + j) % EMULATOR_RAM_SIZE] = digits[i];
-                        j++;
+                        dirty_rows |= (1u << i);
+                        dirty_columns |= display[i];
                     }
-                } break;
+                }
 
-                case 0x55: //STORE REGISTER TO MEMORY
+                memset(display.data(), 0, sizeof(display));
+                should_draw_this_frame = true;
+            } break;
+
+            case OP_RETURN: //RETURN FROM SUBROUTINE
+            {
+                stack_pointer = (stack_pointer - 1) & (EMULATOR_STACK_SIZE - 1);
+                pc = stack[stack_pointer];
+                stack[stack_pointer] = 0;
+
+    //            increment_pc = false;
+            } break;
+
+            case OP_JUMP: //JUMP
+            {
+                if (skip_idle_loops && (nnn <= pc))
                 {
-                    int16_t address = I;
-                    for (int i = 0; i <= x; i++)
-                    {
-                        memory[address % EMULATOR_RAM_SIZE] = v[i];
-                        address++;
-                    }
+                    instruction_index += SkipIdleLoop(nnn, count - instruction_index - 1);
+                }
 
-                    if (compatibility_mode & COMP_MODE_COSMAC) 
-                    {
-                        I += x + 1; //the og cosmac incremented the I register
-                    }
-                } break;
+                pc = nnn;
+
+                increment_pc = false;
+            } break;
+
+            case OP_CALL: //JUMP SUBROUTINE
+            {
+                //A 17th call wraps around and overwrites the oldest return address, like BatchEmulator.
+                //The stack pointer never leaves the stack, so every state can be saved and loaded
+                stack[stack_pointer] = pc;
+                stack_pointer = (stack_pointer + 1) & (EMULATOR_STACK_SIZE - 1);
 
-                case 0x65: //LOAD REGISTER FROM MEMORY
+                pc = nnn;
+
+                increment_pc = false;
+            } break;
+
+            //Taken skips go to the next instruction on their own instead of adding to the pc += 2 below.
+            //Otherwise the compiler turns the skip into a conditional move, and the next instruction's address has
+            //to wait for v[x] to load instead of being predicted
+            case OP_SKIP_EQ_NN: //SKIP IF EQUAL
+            {
+                if (v[x] == nn)
                 {
-                    int16_t address = I;
-                    for (int i = 0; i <= x; i++)
-                    {
-                        v[i] = memory[address % EMULATOR_RAM_SIZE];
-                        address++;
-                    }
+                    pc += 4;
+                    continue;
+                }
+            } break;
 
-                    if (compatibility_mode & COMP_MODE_COSMAC) 
-                    {
-                        I += x + 1; //the og cosmac incremented the I register
-                    }
-                } break;
-            }
-        } break;
+            case OP_SKIP_NE_NN: //SKIP IF NOT EQUAL
+            {
+                if (v[x] != nn)
+                {
+                    pc += 4;
+                    continue;
+                }
+            } break;
 
-        case 0x8: //LOGICAL/ARITHEMTIC FAMILY
-        {
-            switch (n)
+            case OP_SKIP_EQ_VY: //SKIP IF EQUAL
             {
-                case 0: //SET
+                if (v[x] == v[y])
                 {
-                    v[x] = v[y];
-                } break;
+                    pc += 4;
+                    continue;
+                }
+            } break;
 
-                case 1: //OR
+            case OP_SKIP_NE_VY: //SKIP IF NOT EQUAL
+            {
+                if (v[x] != v[y])
                 {
-                    v[x] |= v[y];
-                    if (compatibility_mode == COMP_MODE_COSMAC)
-                    {
-                        v[0xf] = 0;
-                    }
-                } break;
+                    pc += 4;
+                    continue;
+                }
+            } break;
 
-                case 2: //AND
+            case OP_SET_NN: //SET V
+            {
+                v[x] = nn;
+            } break;
+
+            case OP_ADD_NN: //ADD TO V
+            {
+                v[x] += nn;
+            } break;
+
+            case OP_SET_I: //SET I
+            {
+                I = nnn;
+            } break;
+
+            case OP_JUMP_OFFSET: //JUMP WITH OFFSET
+            {
+                if (Quirks::JUMP_OFFSET_USES_V0)
                 {
-                    v[x] &= v[y];
-                    if (compatibility_mode == COMP_MODE_COSMAC)
-                    {
-                        v[0xf] = 0;
-                    }
-                } break;
+                    pc = nnn + v[0];
+                }
+                else
+                {
+                    pc = nnn + vx;
+                }
+
+                increment_pc = false;
+            } break;
 
-                case 3: //XOR
+            case OP_RANDOM: //RANDOM NUMBER GEN
+            {
+                v[x] = NextRandom() & nn;
+            } break;
+
+            case OP_SKIP_KEY: //SKIP IF KEY
+            {
+                int index  = (v[x] % EMULATOR_KEY_COUNT);
+                if (keypad.keys[index] == 1)
                 {
-                    v[x] ^= v[y];
-                    if (compatibility_mode == COMP_MODE_COSMAC)
-                    {
-                        v[0xf] = 0;
-                    }
-                } break;
+                    pc += 4;
+                    continue;
+                }
+            } break;
 
-                case 4: //ADD
+            case OP_SKIP_NOT_KEY: //SKIP IF NOT KEY
+            {
+                int index  = (v[x] % EMULATOR_KEY_COUNT);
+                if (keypad.keys[index] == 0)
                 {
-                    v[x] += v[y];
+                    pc += 4;
+                    continue;
+                }
+            } break;
 
-                    //Check carry
-                    if ((vx + vy) > 255)
-                    {
-                        v[0xf] = 1;
-                    }
-                    else
-                    {
-                        v[0xf] = 0;
-                    }
-                } break;
+            //TIMER STUFF
+            case OP_GET_DELAY:
+            {
+                v[x] = delay_timer;
+            } break;
 
-                case 5: //SUBTRACT v[x] - v[y]
+            case OP_SET_DELAY:
+            {
+                delay_timer = v[x];
+            } break;
+
+            case OP_SET_SOUND:
+            {
+                sound_timer = v[x];
+                if (sound_timer)
                 {
-                    v[x] = vx - vy;
+                    sound_state = SOUND_STATE_PLAY;
+                }
+                else
+                {
+                    sound_state = SOUND_STATE_STOP;
+                }
+                SetBeeperAt(sound_timer != 0, EmulatedTime(instruction_index));
+            } break;
+
+            case OP_ADD_I: //ADD TO INDEX REGISTER
+            {
+                I += v[x];
 
-                    if (vx >= vy)
+                if (Quirks::ADD_I_SETS_VF_ON_OVERFLOW)
+                {
+                    if (I > 0x1000) //overflow from addressing range
                     {
                         v[0xf] = 1;
                     }
-                    else
-                    {
-                        v[0xf] = 0;
-                    }
-                } break;
+                }
+            } break;
 
-                case 7: //SUBTRACT v[y] - v[x]
+            case OP_GET_KEY: //Get key
+            {
+                if (get_key_key_pressed)
                 {
-                    v[x] = vy - vx;
-
-                    if (vy >= vx)
+                    uint8_t key = keypad.keys[keypad.last_key_pressed];
+                    if (key != 0) //not yet released
                     {
-                        v[0xf] = 1;
+                        increment_pc = false;
                     }
                     else
                     {
-                        v[0xf] = 0;
+                        //instruction done
+                        v[x] = keypad.last_key_pressed;
+                        get_key_key_pressed = false;
                     }
-                } break;
-
-                case 6: //SHIFT RIGHT
+                }
+                else
                 {
-                    if (compatibility_mode == COMP_MODE_COSMAC) 
+
+                    increment_pc = false; //loop 
+                    if (keypad.key_just_pressed == true)
                     {
-                        v[x] = vy;
+                        get_key_key_pressed = true;
                     }
+                }
 
-                    uint8_t bit = v[x] & 1;
+                if (skip_idle_loops && (increment_pc == false))
+                {
+                    instruction_index += SkipIdleLoop(pc, count - instruction_index - 1);
+                }
+            } break;
 
-                    v[x] >>= 1;
-                    v[0xf] = bit;
-                } break;
+            case OP_FONT_CHAR: //GET FONT CHARACTER ADDRESS
+            {
+                uint8_t character = (v[x] % EMULATOR_KEY_COUNT);
+                I = FONT_ADDRESS + (character * FONT_CHAR_HEIGHT);
+            } break;
 
-                case 0xE: //SHIFT LEFT
+            case OP_BCD: //SPLIT NUM INTO DIGITS
+            {
+                int num = v[x]; //NOTE(omar): the original COSMAC only took the last nibble
+                uint8_t digits[3] = {0};
+                int digit_count = 0;
+
+                while (num != 0 && (digit_count <= 2))
                 {
-                    if (compatibility_mode == COMP_MODE_COSMAC) 
-                    {
-                        v[x] = vy;
-                    }
+                    digits[digit_count] = num % 10;
+                    num /= 10;
+                    digit_count++;
+                }
 
-                    uint8_t bit = (v[x] & 0x80) >> 7;
+                uint8_t bcd[3] = {digits[2], digits[1], digits[0]};
+                WriteMemoryBlock(I % EMULATOR_RAM_SIZE, 3, bcd);
+                page_start = NO_PAGE; //the page it wrote to might not be shared anymore
+            } break;
 
-                    v[x] <<= 1;
-                    v[0xf] = bit;
-                } break;
-            }
-        } break;
+            case OP_STORE: //STORE REGISTER TO MEMORY
+            {
+                WriteMemoryBlock(I % EMULATOR_RAM_SIZE, x + 1, v.data());
+                page_start = NO_PAGE;
 
-        case 0xD: //DRAW
-        {
-            uint8_t sprite_height = NIBBLE(instruction, 0);
-            x = v[x] % DISPLAY_WIDTH; 
-            y = v[y] % DISPLAY_HEIGHT;
+                if (Quirks::LOAD_STORE_INCREMENTS_I)
+                {
+                    I += x + 1; //the og cosmac incremented the I register
+                }
+            } break;
+
+            case OP_LOAD: //LOAD REGISTER FROM MEMORY
+            {
+                ReadMemoryBlock(I % EMULATOR_RAM_SIZE, x + 1, v.data());
 
-            v[0xf] = 0; //Only set to 1 if any pixel gets turned off
+                if (Quirks::LOAD_STORE_INCREMENTS_I)
+                {
+                    I += x + 1; //the og cosmac incremented the I register
+                }
+            } break;
 
-            for (int i = I; i < (I + sprite_height); i++)
+            //LOGICAL/ARITHEMTIC FAMILY
+            case OP_SET_VY: //SET
             {
-                uint8_t row = memory[i % EMULATOR_RAM_SIZE];
+                v[x] = v[y];
+            } break;
 
-                for (int j = 0; j < 8; j++)
+            case OP_OR: //OR
+            {
+                v[x] |= v[y];
+                if (Quirks::LOGIC_RESETS_VF)
                 {
-                    if ((row & (0x80 >> j)) != 0)
-                    {
-                        if ((x + j) >= DISPLAY_WIDTH)
-                        {
-                            break;
-                        }
-
-                        uint8_t* pixel = display.data() + ((x+j) + (y * DISPLAY_WIDTH));
-
-                        if ((*pixel) == 1)
-                        {
-                            //it will be turned off. set vf to 1
-                            v[0xf] = 1;
-                        }
-                        *pixel ^= 1; 
-                    }
+                    v[0xf] = 0;
                 }
+            } break;
 
-                y++;
-                if (y > DISPLAY_HEIGHT)
+            case OP_AND: //AND
+            {
+                v[x] &= v[y];
+                if (Quirks::LOGIC_RESETS_VF)
                 {
-                    break;
+                    v[0xf] = 0;
                 }
-            }
+            } break;
 
-            should_draw_this_frame = true;
-        } break;
+            case OP_XOR: //XOR
+            {
+                v[x] ^= v[y];
+                if (Quirks::LOGIC_RESETS_VF)
+                {
+                    v[0xf] = 0;
+                }
+            } break;
+
+            case OP_ADD_VY: //ADD
+            {
+                v[x] += v[y];
+
+                //Check carry
+                if ((vx + vy) > 255)
+                {
+                    v[0xf] = 1;
+                }
+                else
+                {
+                    v[0xf] = 0;
+                }
+            } break;
+
+            case OP_SUB: //SUBTRACT v[x] - v[y]
+            {
+                v[x] = vx - vy;
+
+                if (vx >= vy)
+                {
+                    v[0xf] = 1;
+                }
+                else
+                {
+                    v[0xf] = 0;
+                }
+            } break;
+
+            case OP_SUBN: //SUBTRACT v[y] - v[x]
+            {
+                v[x] = vy - vx;
+
+                if (vy >= vx)
+                {
+                    v[0xf] = 1;
+                }
+                else
+                {
+                    v[0xf] = 0;
+                }
+            } break;
+
+            case OP_SHIFT_RIGHT: //SHIFT RIGHT
+            {
+                if (Quirks::SHIFT_USES_VY)
+                {
+                    v[x] = vy;
+                }
+
+                uint8_t bit = v[x] & 1;
+
+                v[x] >>= 1;
+                v[0xf] = bit;
+            } break;
+
+            case OP_SHIFT_LEFT: //SHIFT LEFT
+            {
+                if (Quirks::SHIFT_USES_VY)
+                {
+                    v[x] = vy;
+                }
+
+                uint8_t bit = (v[x] & 0x80) >> 7;
+
+                v[x] <<= 1;
+                v[0xf] = bit;
+            } break;
+
+            case OP_DRAW: //DRAW
+            {
+                uint8_t sprite_height = n;
+                x = v[x] % DISPLAY_WIDTH; 
+                y = v[y] % DISPLAY_HEIGHT;
+
+                //Each sprite row is shifted into place and XORed with the whole display row at once.
+                //Pixels past the right edge fall off the end of the shift
+                DisplayRow collision = 0;
+
+                for (int i = 0; i < sprite_height; i++)
+                {
+                    if ((y + i) >= DISPLAY_HEIGHT)
+                    {
+                        break;
+                    }
+
+                    DisplayRow sprite_row = ReadMemory((I + i) % EMULATOR_RAM_SIZE);
+                    DisplayRow mask = (sprite_row << (DISPLAY_WIDTH - 8)) >> x;
+
+                    DisplayRow* row = display.data() + (y + i);
+                    collision |= (*row) & mask;
+                    *row ^= mask;
+
+                    if (mask)
+                    {
+                        dirty_rows |= (1u << (y + i));
+                        dirty_columns |= mask;
+                    }
+                }
+
+                //Only set to 1 if any pixel gets turned off
+                v[0xf] = (collision != 0) ? 1 : 0;
+
+                should_draw_this_frame = true;
+            } break;
+        }
+
+        if (increment_pc)
+        {
+            pc += 2;
+        }
+    }
+
+    //Running off the end of memory stops the program for good. Parked on the last address so it stays in memory
+    program_counter = (pc < EMULATOR_RAM_SIZE) ? pc : (EMULATOR_RAM_SIZE - 2);
+    instructions_executed += count;
+}
+
+void Emulator::SetKeypadKey(int index, uint8_t new_state)
+{
+    //Releasing a key that's already up changes nothing. Everything else is recorded,
+    //repeated presses too since they set key_just_pressed
+    if ((new_state == 0) && (keypad.keys[index] == 0)) return;
+
+    if (input_hooks.record)
+    {
+        int frame = (input_frame >= 0) ? input_frame : tic;
+        input_hooks.record(input_hooks.context, frame, input_slice, index, new_state);
     }
 
-    if (increment_pc)
+    keypad.keys[index] = new_state;
+    if (new_state == 1)
     {
-        program_counter += 2;
+        keypad.key_just_pressed = true;
+        keypad.last_key_pressed = (int8_t)(index);
     }
 }
 
-#define IS_KEYPAD_CHAR(x) ((x >= 'A') && (x <= 'F'))
-#define IS_KEYPAD_DIGIT(x) ((x >= '0') && (x <= '9'))
+
+void Emulator::SetRunning(bool new_running)
+{
+    if (input_hooks.play) return;
+    if (new_running == running) return;
+
+    if (input_hooks.record)
+    {
+        int frame = (input_frame >= 0) ? input_frame : tic;
+        input_hooks.record(input_hooks.context, frame, input_slice, EMULATOR_INPUT_RUNNING, new_running ? 1 : 0);
+    }
+
+    running = new_running;
+}
+
 
 //TODO(omar):
 ///On the original COSMAC VIP, the key was only registered when it was pressed and then released. maybe we should do that
-void Emulator::SetKey(int code, uint8_t new_state)
+bool Emulator::SetKey(int code, uint8_t new_state)
 {
+    if ((code < 0) || (code >= KEYMAP_HOST_CODE_COUNT)) return false;
 
-/*    switch (code)
+    int index = key_lookup[code];
+    if (index == KEYMAP_UNBOUND) return false;
+
+    //Played back input owns the keypad
+    if (input_hooks.play) return true;
+
+    SetKeypadKey(index, new_state);
+    return true;
+}
+
+
+/*int Emulator::IsCharKeyDown(char c)
+{
+    int code = ASCII_TO_KEYCODE(c);
+    if (code >= KEYCODE_MAX)
     {
-        case 'W': chip8_code = '2'; break;
-        case 'A': chip8_code = '4'; break;
-        case 'D': chip8_code = '6'; break;
-        case 'S': chip8_code = '8'; break;
+        return KEYCODE_NONE;
+    }
+
+    return keystate[ASCII_TO_KEYCODE(c)];
+}
+*/
 
-        default: chip8_code = code;
-    }*/
 
-    int chip8_code = code;
-    int index = -1;
+uint64_t Emulator::EmulatedTime(int instruction_offset) const
+{
+    uint64_t frame = (tic > 0) ? (uint64_t)(tic - 1) : 0;
+    uint64_t position = (instructions_executed + instruction_offset) - frame_start_instructions;
 
-    //See if the key pressed is one of the mapped out keys
-    for (int i = 0; i < keymap.size(); i++)
+    return (frame << 16) + ((position << 16) / instructions_per_frame);
+}
+
+
+void Emulator::SetBeeperAt(bool on, uint64_t time)
+{
+    if (on == beeper_on) return;
+
+    if (sound_events)
     {
-        if (code == keymap[i])
+        SoundEvent event;
+        event.time = time;
+        event.on = on ? 1 : 0;
+
+        //A full queue leaves beeper_on alone so the change is sent again next frame
+        if (sound_events->Push(event) == false)
         {
-            index = i;
-            break;
+            sound_events_dropped++;
+            return;
         }
     }
 
-    //If not. Check if its a valid key itself (0 to 9, A to F)
-    //Then the EMULATOR_KEY_COUNT cap will validate A to F
-    if (index == -1)
-    {
-        if (((code >= '0') && (code <= '9')) || ((code >= 'A') && (code <= 'F')))
-        {
-            char str[2] = {(char)code, 0};
-            int num = std::stoi(str, nullptr, 16);
+    beeper_on = on;
+}
 
-            if (num < EMULATOR_KEY_COUNT)
-            {
-                index = num;
-            }
-        }
 
+void Emulator::BindKey(int profile, int index, int slot, uint8_t host_code)
+{
+    assert((profile >= 0) && (profile < KEYMAP_PROFILE_COUNT));
+    assert((index >= 0) && (index < EMULATOR_KEY_COUNT));
+    assert((slot >= 0) && (slot < KEYMAP_MAX_BINDINGS));
+
+    keymap_profiles[profile].bindings[index][slot] = host_code;
+    if (profile == keymap_profile)
+    {
+        RebuildKeyLookup();
     }
+}
+
+
+void Emulator::SetKeymapProfile(int profile)
+{
+    if ((profile < 0) || (profile >= KEYMAP_PROFILE_COUNT)) return;
+
+    keymap_profile = profile;
+    RebuildKeyLookup();
+}
+
+
+std::array<int8_t, KEYMAP_HOST_CODE_COUNT> key_lookup_unbound()
+{
+    std::array<int8_t, KEYMAP_HOST_CODE_COUNT> lookup;
+    lookup.fill(KEYMAP_UNBOUND);
+
+    return lookup;
+}
+
 
-    if (index > -1)
+void Emulator::RebuildKeyLookup()
+{
+    key_lookup.fill(KEYMAP_UNBOUND);
+
+    //Bindings first. If a host key is bound twice the lower keypad key gets it
+    const KeymapProfile& profile = keymap_profiles[keymap_profile];
+    for (int i = EMULATOR_KEY_COUNT - 1; i >= 0; i--)
     {
-        keypad.keys[index] = new_state;
-        if (new_state == 1)
+        for (int slot = 0; slot < KEYMAP_MAX_BINDINGS; slot++)
         {
-            keypad.key_just_pressed = true;
-            keypad.last_key_pressed = (int8_t)(index);
+            uint8_t code = profile.bindings[i][slot];
+            if (code)
+            {
+                key_lookup[code] = (int8_t)i;
+            }
         }
     }
 
-/*    if (IS_KEYPAD_DIGIT(chip8_code) || IS_KEYPAD_CHAR(chip8_code))
+    //Then the hex characters nothing else took
+    for (int i = 0; i < EMULATOR_KEY_COUNT; i++)
     {
-        char str[2] = {(char)chip8_code, 0};
-        int index = std::stoi(str, nullptr, 16);
-
-        if (index < EMULATOR_KEY_COUNT)
+        int code = (i < 10) ? (i + '0') : ((i - 10) + 'A');
+        if (key_lookup[code] == KEYMAP_UNBOUND)
         {
-            keypad.keys[index] = new_state;
-            if (new_state == 1)
-            {
-                keypad.key_just_pressed = true;
-                keypad.last_key_pressed = (int8_t)(index);
-            }
+            key_lookup[code] = (int8_t)i;
         }
-    }*/
+    }
 }
 
 
-/*int Emulator::IsCharKeyDown(char c)
+void Emulator::DrainInput(int frame, int slice, int64_t until)
 {
-    int code = ASCII_TO_KEYCODE(c);
-    if (code >= KEYCODE_MAX)
+    input_frame = frame;
+    input_slice = slice;
+
+    if (input_hooks.play)
     {
-        return KEYCODE_NONE;
+        input_hooks.play(input_hooks.context, this, frame, slice);
     }
 
-    return keystate[ASCII_TO_KEYCODE(c)];
+    //Live input is still drained during playback so it doesn't pile up. SetKey ignores it then
+    if (input_queue)
+    {
+        const InputEvent* event = input_queue->Peek();
+        while (event && (event->time <= until))
+        {
+            bool pressed = SetKey(event->code, event->state) && (event->state != 0);
+            last_input_time = event->time;
+            input_queue->Pop();
+
+            //A press and its release in the same slice would never be seen by EX9E/FX0A
+            if (pressed) break;
+
+            event = input_queue->Peek();
+        }
+    }
+
+    input_frame = -1;
+    input_slice = 0;
 }
-*/
\ No newline at end of file
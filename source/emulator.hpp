@@ -1,8 +1,12 @@
 #pragma once
 
 #include "bitmap.hpp"
+#include "triple_buffer.hpp"
+#include "spsc_queue.hpp"
 
 #include <array>
+#include <memory>
+#include <vector>
 
 enum
 {
@@ -20,11 +24,31 @@ const int EMULATOR_STACK_SIZE = 16;
 const int EMULATOR_REGISTER_COUNT = 16;
 const int EMULATOR_KEY_COUNT = 0xf + 1;
 
+//Memory is shared with the ROM image in pages this size until an emulator writes to them. See RomImage
+const int EMULATOR_PAGE_SIZE = 256;
+const int EMULATOR_PAGE_COUNT = EMULATOR_RAM_SIZE / EMULATOR_PAGE_SIZE;
+const int EMULATOR_PROGRAM_ADDRESS = 0x200;
+const int EMULATOR_MAX_PROGRAM_SIZE = EMULATOR_RAM_SIZE - EMULATOR_PROGRAM_ADDRESS;
+
+//Timers tick and Update runs once per frame. The instruction rate is per emulator, see SetClockHz
+const int EMULATOR_FRAMES_PER_SECOND = 60;
+const int EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME = 15; //900Hz. close enough to what most games were tuned for
+const int EMULATOR_MAX_INSTRUCTIONS_PER_FRAME = 100000;
+
 const int DISPLAY_WIDTH = 64;
 const int DISPLAY_HEIGHT = 32;
 
 const int DISPLAY_PIXEL_COUNT = DISPLAY_WIDTH * DISPLAY_HEIGHT;
 
+//One bit per pixel. The leftmost pixel of a row is the most significant bit.
+//A hi-res mode would need a wider row type (two words per row at 128 pixels)
+typedef uint64_t DisplayRow;
+static_assert(sizeof(DisplayRow) * 8 == DISPLAY_WIDTH, "a display row has to fit DISPLAY_WIDTH pixels");
+
+//Bitmap colors of lit and unlit pixels. See Bitmap::PackColor
+const uint32_t DISPLAY_ON_COLOR = 0xA0A0A0;
+const uint32_t DISPLAY_OFF_COLOR = 0x1E1E1E;
+
 const int16_t FONT_ADDRESS = 0x0;
 const int FONT_CHAR_HEIGHT = 5;
 
@@ -56,6 +80,103 @@ enum
 };
 
 
+//Each compatibility mode runs one quirk profile. Flags are checked in this order: AMIGA, MODERN, COSMAC.
+//No flags at all is MODERN
+enum
+{
+    QUIRK_PROFILE_COSMAC,
+    QUIRK_PROFILE_MODERN,
+    QUIRK_PROFILE_AMIGA
+};
+
+int quirk_profile_for_mode(int mode);
+
+
+//Quirk profiles. The interpreter is instantiated once per profile so these fold away at compile time.
+//New profiles (SCHIP, XO-CHIP) are another struct plus a case in Emulator::SetCompatibilityMode
+struct QuirksCosmac
+{
+    static const bool LOGIC_RESETS_VF = true; //8XY1/8XY2/8XY3 clear vf
+    static const bool SHIFT_USES_VY = true; //8XY6/8XYE shift vy into vx instead of shifting vx
+    static const bool JUMP_OFFSET_USES_V0 = true; //BNNN jumps to nnn + v0. otherwise to nnn + vx
+    static const bool LOAD_STORE_INCREMENTS_I = true; //FX55/FX65 leave I one past the last register
+    static const bool ADD_I_SETS_VF_ON_OVERFLOW = false; //FX1E sets vf when I goes past 0xFFF
+};
+
+struct QuirksModern
+{
+    static const bool LOGIC_RESETS_VF = false;
+    static const bool SHIFT_USES_VY = false;
+    static const bool JUMP_OFFSET_USES_V0 = false;
+    static const bool LOAD_STORE_INCREMENTS_I = false;
+    static const bool ADD_I_SETS_VF_ON_OVERFLOW = false;
+};
+
+//Modern, except for FX1E. SpaceFight 2091! relies on it
+struct QuirksAmiga : QuirksModern
+{
+    static const bool ADD_I_SETS_VF_ON_OVERFLOW = true;
+};
+
+
+//Handler indices for predecoded instructions. See DecodedOp
+enum
+{
+    OP_UNDECODED, //the slot hasn't been decoded yet (or was invalidated by a memory write)
+    OP_NOP, //unknown instructions. they do nothing but advance the program counter
+
+    OP_CLEAR, //00E0
+    OP_RETURN, //00EE
+    OP_JUMP, //1NNN
+    OP_CALL, //2NNN
+    OP_SKIP_EQ_NN, //3XNN
+    OP_SKIP_NE_NN, //4XNN
+    OP_SKIP_EQ_VY, //5XY0
+    OP_SET_NN, //6XNN
+    OP_ADD_NN, //7XNN
+    OP_SET_VY, //8XY0
+    OP_OR, //8XY1
+    OP_AND, //8XY2
+    OP_XOR, //8XY3
+    OP_ADD_VY, //8XY4
+    OP_SUB, //8XY5
+    OP_SHIFT_RIGHT, //8XY6
+    OP_SUBN, //8XY7
+    OP_SHIFT_LEFT, //8XYE
+    OP_SKIP_NE_VY, //9XY0
+    OP_SET_I, //ANNN
+    OP_JUMP_OFFSET, //BNNN
+    OP_RANDOM, //CXNN
+    OP_DRAW, //DXYN
+    OP_SKIP_KEY, //EX9E
+    OP_SKIP_NOT_KEY, //EXA1
+    OP_GET_DELAY, //FX07
+    OP_GET_KEY, //FX0A
+    OP_SET_DELAY, //FX15
+    OP_SET_SOUND, //FX18
+    OP_ADD_I, //FX1E
+    OP_FONT_CHAR, //FX29
+    OP_BCD, //FX33
+    OP_STORE, //FX55
+    OP_LOAD, //FX65
+
+    OP_COUNT
+};
+
+
+//An instruction decoded once into its handler and operands so Execute doesn't have to
+//refetch and re-extract nibbles every time it runs the same address
+struct DecodedOp
+{
+    uint8_t handler = OP_UNDECODED;
+    uint8_t x = 0;
+    uint8_t y = 0;
+    uint8_t n = 0;
+    uint8_t nn = 0;
+    uint16_t nnn = 0;
+};
+
+
 //platform layer stuff
 enum
 {
@@ -65,6 +186,47 @@ enum
 };
 
 
+//A host key change, stamped on the host's monotonic clock (see FrameScheduler::Now) when it happened
+struct InputEvent
+{
+    int64_t time = 0;
+    int code = 0; //host key code. Mapped through the keymap like SetKey
+    uint8_t state = 0;
+};
+
+const int INPUT_QUEUE_SIZE = 256;
+typedef SpscQueue<InputEvent, INPUT_QUEUE_SIZE> InputQueue;
+
+//The beeper turning on or off, in emulated time: frames in 16.16 fixed point. See Emulator::SetBeeper and AudioEngine
+struct SoundEvent
+{
+    uint64_t time = 0;
+    uint8_t on = 0;
+};
+
+const int SOUND_EVENT_QUEUE_SIZE = 256;
+typedef SpscQueue<SoundEvent, SOUND_EVENT_QUEUE_SIZE> SoundEventQueue;
+
+
+//Host key codes are a byte (ASCII, Windows virtual keys). SetKey looks them up in a table this size
+const int KEYMAP_HOST_CODE_COUNT = 256;
+const int KEYMAP_MAX_BINDINGS = 4; //host keys per keypad key
+const int KEYMAP_PROFILE_COUNT = 4;
+const int8_t KEYMAP_UNBOUND = -1;
+
+enum
+{
+    KEYMAP_PROFILE_HEX, //every keypad key on its own character. 0 to 9, A to F
+    KEYMAP_PROFILE_COSMAC_VIP //the VIP's 4x4 keypad on the left of a QWERTY keyboard. 1234 QWER ASDF ZXCV
+};
+
+//Which host keys press each keypad key. A 0 code is an empty slot
+struct KeymapProfile
+{
+    std::array<std::array<uint8_t, KEYMAP_MAX_BINDINGS>, EMULATOR_KEY_COUNT> bindings = {};
+};
+
+
 struct Keypad
 {
     std::array<uint8_t, EMULATOR_KEY_COUNT> keys = {0}; //the chip 8's emulated keypad. from 0 to F
@@ -73,23 +235,172 @@ struct Keypad
 };
 
 
+//Save states are a fixed layout blob so saving and loading are a handful of memcpys.
+//Values are stored in host byte order. Bump the version whenever the layout changes
+const uint32_t SAVE_STATE_MAGIC = 0x53533843; //"C8SS"
+const uint16_t SAVE_STATE_VERSION = 1;
+
+const int SAVE_STATE_HEADER_SIZE = 8; //magic, version, 2 reserved bytes
+const int SAVE_STATE_SIZE = SAVE_STATE_HEADER_SIZE +
+    EMULATOR_RAM_SIZE +
+    EMULATOR_REGISTER_COUNT +
+    (EMULATOR_STACK_SIZE * 2) +
+    (DISPLAY_HEIGHT * (int)sizeof(DisplayRow)) +
+    EMULATOR_KEY_COUNT +
+    2 + 2 + 1 + 1 + 1 + //I, program counter, stack pointer, delay and sound timers
+    1 + 1 + 1 + //key_just_pressed, last_key_pressed, get_key_key_pressed
+    1 + //compatibility mode
+    4 + //tic
+    8 + 8; //random seed and state
+
+//Where I starts. Followed by the program counter, stack pointer, timers and the keypad bytes, see SaveState
+const int SAVE_STATE_REGISTERS_OFFSET = SAVE_STATE_HEADER_SIZE + EMULATOR_RAM_SIZE + EMULATOR_REGISTER_COUNT +
+    (EMULATOR_STACK_SIZE * 2) + (DISPLAY_HEIGHT * (int)sizeof(DisplayRow)) + EMULATOR_KEY_COUNT;
+
+
+struct Jit;
+struct Emulator;
+
+
+//An input change with this key pauses (state 0) or resumes (state 1) the emulator instead of changing a keypad key
+const uint8_t EMULATOR_INPUT_RUNNING = 0xFF;
+
+//Input recording and playback, see Movie. While play is set it owns the keypad: it's called before every input slice
+//to apply that slice's changes, and live input through SetKey and SetRunning is ignored.
+//record gets every keypad and running change with the frame and slice it landed on
+struct InputHooks
+{
+    void* context = nullptr;
+    void (*play)(void* context, Emulator* emu, int frame, int slice) = nullptr;
+    void (*record)(void* context, int frame, int slice, int key, int state) = nullptr;
+};
+
+
+//Memory the way it is right after a ROM is loaded: the font, the program at 0x200 and zeroes.
+//Read only once made, so any number of emulators can share one. Each emulator only gets its own copy of
+//the pages it writes to, see Emulator::WriteMemory
+struct RomImage
+{
+    std::array<uint8_t, EMULATOR_RAM_SIZE> memory = {0};
+    int program_size = 0;
+
+    //memory decoded once for everyone sharing the image. The last address of each page is left OP_UNDECODED,
+    //its instruction runs into the next page and that one might not be shared. So are the last two of memory
+    std::array<DecodedOp, EMULATOR_RAM_SIZE> decoded;
+};
+
+//Why a ROM didn't load. See rom_error_string
+enum
+{
+    ROM_OK,
+    ROM_ERROR_OPEN, //missing, a directory or no permission
+    ROM_ERROR_READ,
+    ROM_ERROR_EMPTY,
+    ROM_ERROR_TOO_BIG //doesn't fit between the program address and the end of memory
+};
+
+const char* rom_error_string(int error);
+
+//ROM_OK if a program this many bytes fits in a memory_size bytes machine when it's loaded at the program address.
+//Every platform the emulator runs has EMULATOR_RAM_SIZE bytes. A bigger one passes its own size
+int rom_check_size(long long size, int memory_size);
+
+//nullptr if the ROM can't be loaded. error can be nullptr, otherwise it's set to ROM_OK or why it failed.
+//Files are checked before they're read and read into the image in one go, see rom_image.cpp
+std::shared_ptr<const RomImage> rom_image_from_buffer(const uint8_t* data, int size, int* error);
+std::shared_ptr<const RomImage> rom_image_from_file(const char* filename, int* error);
+std::shared_ptr<const RomImage> rom_image_from_file(const wchar_t* filename, int* error);
+
+//Just the font. What a fresh emulator starts with
+std::shared_ptr<const RomImage> rom_image_blank();
+
+//Where each page starts in the image. What an emulator reads and decodes from before it writes anything
+std::array<const uint8_t*, EMULATOR_PAGE_COUNT> rom_image_pages(const RomImage& image);
+std::array<const DecodedOp*, EMULATOR_PAGE_COUNT> rom_image_decoded_pages(const RomImage& image);
+
+//Defined in emulator.cpp. Shared with the JIT so both see the same instruction set
+DecodedOp decode_instruction(uint16_t instruction);
+
+//decode_instruction for all 65536 instructions, built the first time it's asked for.
+//Decodes ROM images and written pages, and is what BatchEmulator dispatches on directly
+const DecodedOp* decode_table();
+
+//Every host code unbound. What key_lookup holds until RebuildKeyLookup runs
+std::array<int8_t, KEYMAP_HOST_CODE_COUNT> key_lookup_unbound();
+
+//CXNN random numbers. Shared with BatchEmulator so a lane gives the same numbers as an Emulator with the same seed.
+//splitmix64 of the seed, never 0
+uint64_t random_state_for_seed(uint64_t seed);
+
+//xorshift64*. Returns the top 8 bits, the best ones
+inline uint8_t random_next(uint64_t* state)
+{
+    uint64_t s = *state;
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    *state = s;
+    return (uint8_t)((s * 0x2545F4914F6CDD1Dull) >> 56);
+}
+
+//Upscales the dirty part of a display into the bitmap and fills dirty_rects (DISPLAY_HEIGHT entries) with the
+//areas it repainted. Returns how many. Everything is repainted if the bitmap size changed since the last call
+int draw_display(Bitmap* bitmap, const DisplayRow* display, uint32_t dirty_rows, DisplayRow dirty_columns,
+    BitmapRect* dirty_rects);
+
+
+//A finished frame as the emulation thread hands it to the presentation thread. See Emulator::PublishFrame
+struct DisplayFrame
+{
+    std::array<DisplayRow, DISPLAY_HEIGHT> display = {0};
+    uint64_t frame_number = 0;
+    int64_t input_time = 0; //Emulator::last_input_time. The presenter can tell how long input took to show up
+};
+
+
 struct Emulator
 {
     bool running = false;
-    int compatibility_mode = COMP_MODE_COSMAC;
+    int compatibility_mode = COMP_MODE_COSMAC; //see SetCompatibilityMode
     int tic = 0;
+    uint64_t instructions_executed = 0; //every instruction run so far, interpreted or compiled
+    int instructions_per_frame = EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME; //see SetClockHz
+
+    //Instructions of idle loops that were skipped instead of run. They're still counted in instructions_executed.
+    //See IdleLoopLength
+    bool skip_idle_loops = true;
+    uint64_t instructions_elided = 0;
+
+    //CXNN random numbers. Each emulator has its own generator so runs can be reproduced. See SetSeed
+    uint64_t random_seed = 0;
+    uint64_t random_state = 1;
 
     Bitmap bitmap;
 
-//    std::array<
+    //Memory is read through memory_pages. A page points into rom_image until the emulator writes something
+    //different to it, then it gets its own copy in private_pages and its bit in owned_pages is set.
+    //Always read with ReadMemory and write with WriteMemory
+    std::shared_ptr<const RomImage> rom_image = rom_image_blank();
+    std::array<const uint8_t*, EMULATOR_PAGE_COUNT> memory_pages = rom_image_pages(*rom_image);
+    std::array<uint8_t*, EMULATOR_PAGE_COUNT> private_pages = {}; //kept once allocated, even after a page is shared again
+    uint32_t owned_pages = 0;
 
-    std::array<uint8_t, EMULATOR_RAM_SIZE> memory = {0};
+    //Decoded instructions, one per address since the program counter can land on odd addresses.
+    //Shared pages use the image's. An owned page starts with none and only gets its own in private_decoded
+    //once code runs from it, so pages that only hold data cost nothing extra. See DecodeAt
+    std::array<const DecodedOp*, EMULATOR_PAGE_COUNT> decoded_pages = rom_image_decoded_pages(*rom_image);
+    std::array<DecodedOp*, EMULATOR_PAGE_COUNT> private_decoded = {}; //kept once allocated, like private_pages
 
     Keypad keypad;
 
-    //Maps emulator keys (0 to F) to ascii characters. used for keybinds 
-    //This array should be set by the platform layer
-    std::array<char, EMULATOR_KEY_COUNT> keymap = {0};
+    //Maps emulator keys (0 to F) to host key codes. used for keybinds.
+    //Change them through BindKey/SetKeymapProfile so key_lookup gets rebuilt
+    std::array<KeymapProfile, KEYMAP_PROFILE_COUNT> keymap_profiles;
+    int keymap_profile = KEYMAP_PROFILE_HEX;
+
+    //Host code to keypad index (or KEYMAP_UNBOUND) for the current profile. Built by RebuildKeyLookup.
+    //The hex characters that aren't bound to anything else press their own key, like on the real keypad
+    std::array<int8_t, KEYMAP_HOST_CODE_COUNT> key_lookup = key_lookup_unbound();
 
     //registers
     std::array<uint8_t, EMULATOR_REGISTER_COUNT> v = {0};
@@ -101,7 +412,53 @@ struct Emulator
 
     std::array<uint16_t, EMULATOR_STACK_SIZE> stack = {0};
 
-    std::array<uint8_t, DISPLAY_PIXEL_COUNT> display = {0};
+    std::array<DisplayRow, DISPLAY_HEIGHT> display = {0};
+
+    //What changed on the display since the last Draw. One bit per display row and the
+    //columns touched across all of them. Draw only re-rasterizes these
+    uint32_t dirty_rows = 0xFFFFFFFF;
+    DisplayRow dirty_columns = ~((DisplayRow)0);
+
+    //Areas of the bitmap the last Draw repainted. The platform layer only needs to present these.
+    //Reset by LateUpdate
+    std::array<BitmapRect, DISPLAY_HEIGHT> dirty_rects;
+    int dirty_rect_count = 0;
+
+    //false decodes every instruction again instead of using decoded_pages. For checking the decoding
+    bool use_decode_cache = true;
+
+    //Optional recompiler. nullptr means the interpreter runs everything. See SetJitEnabled
+    Jit* jit = nullptr;
+
+    //The interpreter instantiation for compatibility_mode. Picked again by ExecuteInstructions if the mode changed
+    typedef void (Emulator::*ExecuteFunc)(int count);
+    ExecuteFunc execute_instructions = nullptr;
+    int execute_mode = -1;
+
+    InputHooks input_hooks;
+
+    //Key changes from the platform, possibly from another thread. Update splits the frame's instructions into
+    //input_slices slices and drains the queue in order before each one. See DrainInput
+    InputQueue* input_queue = nullptr;
+    int input_slices = 1;
+
+    //The host time span the frame stands for. A slice only takes events up to its share of it, so input keeps
+    //its spacing within the frame. Leave both 0 to take whatever is queued
+    int64_t input_time_start = 0;
+    int64_t input_time_end = 0;
+    int64_t last_input_time = 0; //timestamp of the newest event applied
+
+    //Beeper changes go here with the emulated time they happened at, for an AudioEngine to render.
+    //Events that don't fit are counted and dropped
+    SoundEventQueue* sound_events = nullptr;
+    bool beeper_on = false; //what was sent last
+    uint64_t sound_events_dropped = 0;
+    uint64_t frame_start_instructions = 0; //instructions_executed when this frame's Update started
+
+    //Where in the frame key changes are landing, for movies. -1 outside Update: the change is for the next frame
+    int input_frame = -1;
+    int input_slice = 0;
+
     bool get_key_key_pressed = false; //used for the 0x0A (get key) instruction
 
 
@@ -110,20 +467,117 @@ struct Emulator
     bool should_draw_this_frame = false;
     int sound_state = SOUND_STATE_CONTINUE;
 
+    //Update leaves drawing to the caller. The dirty rows keep piling up until the next Draw.
+    //Used to skip rasterizing frames nobody will see (turbo, headless runs)
+    bool defer_draw = false;
+
+    Emulator() = default;
+    ~Emulator();
+
+    //Owns the JIT code cache. copy the state out instead
+    Emulator(const Emulator&) = delete;
+    Emulator& operator=(const Emulator&) = delete;
+
     void Init();
     void Update();
     void Draw();
     void LateUpdate(); //Called at the very end of the frame
 
-    void Execute();
+    //Copies the display out for another thread to draw and present. Never waits on the reader
+    void PublishFrame(TripleBuffer<DisplayFrame>* frames) const;
 
-    bool LoadFromFile(wchar_t* filename);
+    //Instructions run per frame. Hz is rounded to whole instructions per frame, at least one.
+    //Not part of the save state, like the JIT setting
+    void SetClockHz(int hz);
+    void SetInstructionsPerFrame(int count);
+    int ClockHz() const { return instructions_per_frame * EMULATOR_FRAMES_PER_SECOND; }
+
+    //Also picks the interpreter instantiation for the mode's quirk profile
+    void SetCompatibilityMode(int mode);
+
+    void Execute();
+    void ExecuteInstructions(int count);
+
+    template <typename Quirks>
+    void ExecuteInstructionsWith(int count);
+    void ExecuteJit(int count); //Runs compiled blocks where possible and interprets the rest
+
+    //Returns false if the JIT isn't available on this host. The interpreter is used then
+    bool SetJitEnabled(bool enabled);
+
+    int IdleLoopLength(uint16_t address) const;
+    int SkipIdleLoop(uint16_t address, int remaining);
+
+    uint8_t ReadMemory(uint16_t address) const
+    {
+        return memory_pages[address / EMULATOR_PAGE_SIZE][address % EMULATOR_PAGE_SIZE];
+    }
+
+    void WriteMemory(uint16_t address, uint8_t value);
+    void MakePagePrivate(int page);
+    void SharePage(int page); //back to reading from the image. The caller checks the page matches it
+    const DecodedOp* DecodeAt(uint16_t address);
+    void ReadMemoryBlock(int address, int size, uint8_t* out) const;
+    void WriteMemoryBlock(int address, int size, const uint8_t* data);
+    void InvalidateCode(int start, int end); //[start, end). drops decoded and compiled instructions
+
+    //Starts the program in the image from scratch. The image is shared, not copied
+    void LoadRom(const std::shared_ptr<const RomImage>& image);
+
+    //Back to how the emulator was right after LoadRom: registers, stack, timers, keypad, display and counters
+    //cleared, memory the ROM image again and the random numbers started over from the seed.
+    //Settings (clock, compatibility mode, keymap, JIT) and attached queues are kept. running isn't touched
+    void Reset();
+    void ShareRomImage(const std::shared_ptr<const RomImage>& image); //only resets memory
+    bool LoadFromFile(const wchar_t* filename);
+    bool LoadFromFile(const char* filename);
+
+    //Writes SAVE_STATE_SIZE bytes. Returns how many bytes were written, 0 if the buffer is too small.
+    //The bitmap and platform settings (keymap, JIT) aren't part of the state
+    int SaveState(uint8_t* buffer, int buffer_size) const;
+    void SaveState(std::vector<uint8_t>* out) const;
+
+    //Returns false and leaves the emulator untouched if the blob isn't a save state of this version
+    bool LoadState(const uint8_t* buffer, int buffer_size);
 
     void ClearDisplay();
+    void InvalidateDisplay(); //Makes the next Draw repaint everything. Use after the bitmap is resized
+
+    uint8_t GetPixel(int x, int y) const
+    {
+        return (uint8_t)((display[y] >> (DISPLAY_WIDTH - 1 - x)) & 1);
+    }
 
     inline void WriteInstToMemory(uint16_t inst);
 
-    void SetKey(int code, uint8_t state);
+    //The same seed always gives the same CXNN results. Init seeds from the clock
+    void SetSeed(uint64_t seed);
+
+    uint8_t NextRandom() { return random_next(&random_state); }
+
+    //Emulated time of an instruction of the current frame, as in SoundEvent. Only meaningful during Update
+    uint64_t EmulatedTime(int instruction_offset) const;
+
+    //Sends a sound event if the beeper changes
+    void SetBeeper(bool on) { SetBeeperAt(on, EmulatedTime(0)); }
+    void SetBeeperAt(bool on, uint64_t time);
+
+    //Returns true if the code is bound to a keypad key
+    bool SetKey(int code, uint8_t state);
+
+    //slot is which of the key's KEYMAP_MAX_BINDINGS bindings to replace. A 0 host_code clears it
+    void BindKey(int profile, int index, int slot, uint8_t host_code);
+    uint8_t KeyBinding(int index, int slot) const { return keymap_profiles[keymap_profile].bindings[index][slot]; }
+    void SetKeymapProfile(int profile);
+    void RebuildKeyLookup();
+    void SetKeypadKey(int index, uint8_t new_state); //index is the emulator key, 0 to F
+
+    //Pauses or resumes. Recorded like key changes and ignored while input is played back, that owns the timeline then
+    void SetRunning(bool new_running);
+
+    //Applies queued events with a time up to until, plus the played back changes for this slice.
+    //Stops after the first keypad press so presses closer together than a slice are still seen one by one
+    void DrainInput(int frame, int slice, int64_t until);
 
 //    int IsCharKeyDown(char c);
 };
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "emulator_pool.hpp"
+
+
+EmulatorPool::~EmulatorPool()
+{
+    Destroy();
+}
+
+
+void EmulatorPool::Init(int count)
+{
+    Destroy();
+
+    emulators.reserve(count);
+    free_emulators.reserve(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        Emulator* emu = new Emulator();
+        emu->Init();
+        emulators.push_back(emu);
+        free_emulators.push_back(emu);
+    }
+}
+
+
+void EmulatorPool::Destroy()
+{
+    for (Emulator* emu : emulators)
+    {
+        delete emu;
+    }
+    emulators.clear();
+    free_emulators.clear();
+}
+
+
+Emulator* EmulatorPool::Acquire(const std::shared_ptr<const RomImage>& image)
+{
+    Emulator* emu = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_emulators.empty() == false)
+        {
+            emu = free_emulators.back();
+            free_emulators.pop_back();
+        }
+    }
+
+    //Ran out. Made outside the lock, construction is the slow part
+    if (emu == nullptr)
+    {
+        emu = new Emulator();
+        emu->Init();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        emulators.push_back(emu);
+    }
+
+    emu->LoadRom(image);
+    return emu;
+}
+
+
+void EmulatorPool::Release(Emulator* emu)
+{
+    emu->input_hooks = InputHooks();
+    emu->input_queue = nullptr;
+    emu->sound_events = nullptr;
+    emu->beeper_on = false; //the queue it was sent to is gone
+
+    emu->running = false;
+    emu->SetCompatibilityMode(COMP_MODE_COSMAC);
+    emu->SetInstructionsPerFrame(EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME);
+    emu->skip_idle_loops = true;
+    emu->use_decode_cache = true;
+    emu->defer_draw = false;
+    emu->input_slices = 1;
+    emu->input_time_start = 0;
+    emu->input_time_end = 0;
+    emu->sound_events_dropped = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    free_emulators.push_back(emu);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "emulator.hpp"
+
+#include <mutex>
+#include <vector>
+
+//Emulators made and Init'd once up front, then handed out session after session.
+//Acquire starts a ROM on a free emulator with LoadRom, which shares the image and Resets. No allocation,
+//no Init, no keymap rebuild. A new emulator is only made when every one is in use. Safe to call from any thread
+struct EmulatorPool
+{
+    std::mutex mutex;
+    std::vector<Emulator*> emulators; //everything the pool made. Owned by it
+    std::vector<Emulator*> free_emulators;
+
+    EmulatorPool() = default;
+    ~EmulatorPool();
+
+    EmulatorPool(const EmulatorPool&) = delete;
+    EmulatorPool& operator=(const EmulatorPool&) = delete;
+
+    void Init(int count);
+    void Destroy(); //every emulator has to be released first
+
+    //The emulator runs image from power on. It keeps the JIT enabled if an earlier session turned it on
+    Emulator* Acquire(const std::shared_ptr<const RomImage>& image);
+
+    //Detaches the platform hooks (movie, input and sound queues) and puts the clock, compatibility mode and
+    //run flags back to what Init gives, so they don't leak into the next session. The keymap and JIT are kept
+    void Release(Emulator* emu);
+};
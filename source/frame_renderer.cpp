@@ -0,0 +1,33 @@
+#include "frame_renderer.hpp"
+
+
+void FrameRenderer::Draw(const DisplayFrame& frame)
+{
+    dirty_rect_count = 0;
+
+    if (bitmap.data == NULL) return;
+
+    uint32_t dirty_rows = 0xFFFFFFFF;
+    DisplayRow dirty_columns = ~((DisplayRow)0);
+
+    if (drawn_valid)
+    {
+        dirty_rows = 0;
+        dirty_columns = 0;
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            DisplayRow changed = frame.display[y] ^ drawn_display[y];
+            if (changed)
+            {
+                dirty_rows |= (1u << y);
+                dirty_columns |= changed;
+            }
+        }
+    }
+
+    dirty_rect_count = draw_display(&bitmap, frame.display.data(), dirty_rows, dirty_columns, dirty_rects.data());
+
+    drawn_display = frame.display;
+    drawn_valid = true;
+    drawn_frame_number = frame.frame_number;
+}
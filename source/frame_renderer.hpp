@@ -0,0 +1,21 @@
+#pragma once
+
+#include "emulator.hpp"
+
+//Draws frames published by Emulator::PublishFrame into its own bitmap, on whatever thread presents them.
+//It repaints the rows that differ from the last frame it drew, so it doesn't matter how many frames it never saw
+struct FrameRenderer
+{
+    Bitmap bitmap;
+
+    std::array<DisplayRow, DISPLAY_HEIGHT> drawn_display = {0};
+    bool drawn_valid = false; //false repaints everything on the next Draw
+    uint64_t drawn_frame_number = 0;
+
+    //Areas of the bitmap the last Draw repainted. See Emulator::dirty_rects
+    std::array<BitmapRect, DISPLAY_HEIGHT> dirty_rects;
+    int dirty_rect_count = 0;
+
+    void Invalidate() { drawn_valid = false; } //Use after the bitmap is resized
+    void Draw(const DisplayFrame& frame);
+};
@@ -0,0 +1,202 @@
+#include "frame_scheduler.hpp"
+
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+//Windows 10 1803 and up. Older SDKs don't have the define
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#else
+#include <errno.h>
+#include <time.h>
+#endif
+
+static const int64_t NANOSECONDS_PER_SECOND = 1000000000;
+
+
+double FrameSchedulerStats::MeanLatenessMicroseconds() const
+{
+    if (samples == 0) return 0;
+
+    return (lateness_sum / samples) / 1000.0;
+}
+
+
+double FrameSchedulerStats::JitterMicroseconds() const
+{
+    if (samples == 0) return 0;
+
+    double mean = lateness_sum / samples;
+    double variance = (lateness_square_sum / samples) - (mean * mean);
+    if (variance < 0)
+    {
+        variance = 0;
+    }
+
+    return sqrt(variance) / 1000.0;
+}
+
+
+FrameScheduler::~FrameScheduler()
+{
+    Destroy();
+}
+
+
+void FrameScheduler::Init(int new_frames_per_second, int new_max_frameskip)
+{
+    frames_per_second = (new_frames_per_second > 0) ? new_frames_per_second : 60;
+    max_frameskip = (new_max_frameskip > 0) ? new_max_frameskip : 0;
+
+#ifdef _WIN32
+    if (wait_timer == nullptr)
+    {
+        wait_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (wait_timer == nullptr)
+        {
+            //Older Windows. A regular timer is only as precise as timeBeginPeriod allows, the spin covers the rest
+            wait_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+        }
+    }
+#endif
+
+    ResetStats();
+    Resync();
+}
+
+
+void FrameScheduler::Destroy()
+{
+#ifdef _WIN32
+    if (wait_timer)
+    {
+        CloseHandle((HANDLE)wait_timer);
+        wait_timer = nullptr;
+    }
+#endif
+}
+
+
+void FrameScheduler::Resync()
+{
+    start_time = Now();
+    frame_number = 0;
+}
+
+
+int64_t FrameScheduler::Deadline(uint64_t frame) const
+{
+    //Whole seconds and the remainder separately so the multiply can't overflow on long runs
+    uint64_t seconds = frame / frames_per_second;
+    uint64_t remainder = frame % frames_per_second;
+
+    return start_time + (int64_t)(seconds * NANOSECONDS_PER_SECOND) +
+    (int64_t)((remainder * NANOSECONDS_PER_SECOND) / frames_per_second);
+}
+
+
+int FrameScheduler::WaitForNextFrame()
+{
+    int64_t deadline = Deadline(frame_number);
+    if (Now() < deadline)
+    {
+        SleepUntil(deadline);
+    }
+    int64_t now = Now();
+
+    int64_t lateness = now - deadline;
+    stats.samples++;
+    stats.lateness_sum += (double)lateness;
+    stats.lateness_square_sum += (double)lateness * (double)lateness;
+    if (lateness > stats.lateness_max)
+    {
+        stats.lateness_max = lateness;
+    }
+
+    //Every frame whose deadline already passed is due
+    uint64_t last_due = (uint64_t)(((now - start_time) / NANOSECONDS_PER_SECOND) * frames_per_second +
+    (((now - start_time) % NANOSECONDS_PER_SECOND) * frames_per_second) / NANOSECONDS_PER_SECOND);
+    if (last_due < frame_number)
+    {
+        last_due = frame_number; //rounding. the deadline has passed so this frame is due
+    }
+
+    uint64_t due_count = last_due - frame_number + 1;
+    if (due_count > (uint64_t)max_frameskip + 1)
+    {
+        //Too far behind. The dropped frames' deadlines are skipped, the schedule itself stays where it is
+        uint64_t dropped = due_count - (max_frameskip + 1);
+        stats.dropped_frames += dropped;
+        frame_number += dropped;
+        due_count -= dropped;
+    }
+
+    frame_number += due_count;
+    stats.frames += due_count;
+    stats.skipped_frames += due_count - 1;
+
+    return (int)due_count;
+}
+
+
+int64_t FrameScheduler::Now()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    int64_t seconds = counter.QuadPart / frequency.QuadPart;
+    int64_t remainder = counter.QuadPart % frequency.QuadPart;
+    return (seconds * NANOSECONDS_PER_SECOND) + ((remainder * NANOSECONDS_PER_SECOND) / frequency.QuadPart);
+#else
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((int64_t)time.tv_sec * NANOSECONDS_PER_SECOND) + time.tv_nsec;
+#endif
+}
+
+
+void FrameScheduler::SleepUntil(int64_t time)
+{
+#ifdef _WIN32
+    int64_t remaining = time - Now();
+    if (remaining > FRAME_SCHEDULER_SPIN_NANOSECONDS)
+    {
+        int64_t sleep_time = remaining - FRAME_SCHEDULER_SPIN_NANOSECONDS;
+
+        LARGE_INTEGER due_time;
+        due_time.QuadPart = -(sleep_time / 100); //negative is relative, in 100ns units
+        if (wait_timer && SetWaitableTimer((HANDLE)wait_timer, &due_time, 0, NULL, NULL, FALSE))
+        {
+            WaitForSingleObject((HANDLE)wait_timer, INFINITE);
+        }
+        else
+        {
+            Sleep((DWORD)(sleep_time / 1000000));
+        }
+    }
+
+    while (Now() < time)
+    {
+        YieldProcessor();
+    }
+#else
+    timespec deadline;
+    deadline.tv_sec = (time_t)(time / NANOSECONDS_PER_SECOND);
+    deadline.tv_nsec = (long)(time % NANOSECONDS_PER_SECOND);
+
+    //Absolute, so being interrupted and sleeping again doesn't push the wake up back
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    {
+    }
+#endif
+}
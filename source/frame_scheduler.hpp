@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+//How many frames may run without being presented when the loop falls behind. Past that the
+//missed frames are dropped instead, so a long stall doesn't turn into a burst of catch-up frames
+const int FRAME_SCHEDULER_DEFAULT_MAX_FRAMESKIP = 5;
+
+//Windows timers can wake up a bit late even at high resolution. The last stretch before a deadline is spun instead
+const int64_t FRAME_SCHEDULER_SPIN_NANOSECONDS = 1000000;
+
+
+struct FrameSchedulerStats
+{
+    uint64_t frames = 0; //frames handed out by WaitForNextFrame, including the skipped ones
+    uint64_t skipped_frames = 0; //ran without being presented to catch up
+    uint64_t dropped_frames = 0; //so late they never ran at all
+
+    //How far past the frame's deadline WaitForNextFrame returned, in nanoseconds. One sample per call
+    uint64_t samples = 0;
+    int64_t lateness_max = 0;
+    double lateness_sum = 0;
+    double lateness_square_sum = 0;
+
+    double MeanLatenessMicroseconds() const;
+    double JitterMicroseconds() const; //standard deviation of the lateness
+};
+
+
+//Paces a loop to a fixed frame rate against absolute deadlines. Frame N is due at
+//start_time + N / frames_per_second exactly, so time spent working and sleep overshoot never add up into drift
+struct FrameScheduler
+{
+    int frames_per_second = 60;
+    int max_frameskip = FRAME_SCHEDULER_DEFAULT_MAX_FRAMESKIP;
+
+    int64_t start_time = 0; //when frame 0 was due. nanoseconds on the monotonic clock
+    uint64_t frame_number = 0; //the next frame to hand out
+
+    FrameSchedulerStats stats;
+
+    void* wait_timer = nullptr; //Windows only. a high resolution waitable timer if the OS has them
+
+    FrameScheduler() = default;
+    ~FrameScheduler();
+
+    FrameScheduler(const FrameScheduler&) = delete;
+    FrameScheduler& operator=(const FrameScheduler&) = delete;
+
+    void Init(int new_frames_per_second, int new_max_frameskip);
+    void Destroy();
+
+    //Starts the schedule over from now. Use after the loop wasn't paced for a while (turbo, a modal dialog)
+    //so the time in between isn't treated as frames to catch up on
+    void Resync();
+
+    //Sleeps until the next frame is due. Returns how many frames are due, at least 1 and at most max_frameskip + 1.
+    //Run all of them and present the last one
+    int WaitForNextFrame();
+
+    int64_t Deadline(uint64_t frame) const;
+
+    void ResetStats() { stats = FrameSchedulerStats(); }
+
+    static int64_t Now(); //monotonic clock in nanoseconds
+    void SleepUntil(int64_t time);
+};
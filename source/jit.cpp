@@ -0,0 +1,810 @@
+#include "jit.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+
+//Native register numbers used in ModRM encodings
+enum
+{
+    X64_AL = 0,
+    X64_CL = 1,
+    X64_DL = 2
+};
+
+
+//Appends x86-64 machine code. Every memory operand is [r8 + disp32] where r8 holds the Emulator pointer
+struct JitEmitter
+{
+    uint8_t* cursor = nullptr;
+
+    void Byte(uint8_t b)
+    {
+        *cursor = b;
+        cursor++;
+    }
+
+    void Word(uint16_t w)
+    {
+        memcpy(cursor, &w, sizeof(w));
+        cursor += sizeof(w);
+    }
+
+    void Dword(int32_t d)
+    {
+        memcpy(cursor, &d, sizeof(d));
+        cursor += sizeof(d);
+    }
+
+    //opcode with a [r8 + disp32] operand
+    void MemOp(uint8_t opcode, int reg, int32_t disp)
+    {
+        Byte(0x41); //REX.B selects r8 as the base
+        Byte(opcode);
+        Byte((uint8_t)(0x80 | (reg << 3)));
+        Dword(disp);
+    }
+
+    void LoadByte(int reg, int32_t disp) { MemOp(0x8A, reg, disp); } //mov reg8, [r8+disp]
+    void StoreByte(int32_t disp, int reg) { MemOp(0x88, reg, disp); } //mov [r8+disp], reg8
+
+    void StoreByteImm(int32_t disp, uint8_t imm) //mov byte [r8+disp], imm8
+    {
+        MemOp(0xC6, 0, disp);
+        Byte(imm);
+    }
+
+    void AddByteImm(int32_t disp, uint8_t imm) //add byte [r8+disp], imm8
+    {
+        MemOp(0x80, 0, disp);
+        Byte(imm);
+    }
+
+    void CmpByteImm(int32_t disp, uint8_t imm) //cmp byte [r8+disp], imm8
+    {
+        MemOp(0x80, 7, disp);
+        Byte(imm);
+    }
+
+    void CmpRegMem(int reg, int32_t disp) { MemOp(0x3A, reg, disp); } //cmp reg8, [r8+disp]
+
+    void StoreWordImm(int32_t disp, uint16_t imm) //mov word [r8+disp], imm16
+    {
+        Byte(0x66);
+        MemOp(0xC7, 0, disp);
+        Word(imm);
+    }
+
+    void CmpWordImm(int32_t disp, uint16_t imm) //cmp word [r8+disp], imm16
+    {
+        Byte(0x66);
+        MemOp(0x81, 7, disp);
+        Word(imm);
+    }
+
+    void StoreWordAx(int32_t disp) //mov word [r8+disp], ax
+    {
+        Byte(0x66);
+        MemOp(0x89, X64_AL, disp);
+    }
+
+    void AddWordCx(int32_t disp) //add word [r8+disp], cx
+    {
+        Byte(0x66);
+        MemOp(0x01, X64_CL, disp);
+    }
+
+    void MovzxByte(int reg, int32_t disp) //movzx reg32, byte [r8+disp]
+    {
+        Byte(0x41);
+        Byte(0x0F);
+        Byte(0xB6);
+        Byte((uint8_t)(0x80 | (reg << 3)));
+        Dword(disp);
+    }
+
+    //opcode with a [r8 + rax*2 + disp32] operand. For indexing the stack
+    void StackOp(uint8_t opcode, int reg, int32_t disp)
+    {
+        Byte(0x41); //REX.B selects r8 as the base
+        Byte(opcode);
+        Byte((uint8_t)(0x84 | (reg << 3))); //SIB follows
+        Byte(0x40); //scale 2, index rax, base r8
+        Dword(disp);
+    }
+
+    void LoadStackWordCx(int32_t disp) //movzx ecx, word [r8+rax*2+disp]
+    {
+        Byte(0x41);
+        Byte(0x0F);
+        Byte(0xB7);
+        Byte((uint8_t)(0x84 | (X64_CL << 3)));
+        Byte(0x40);
+        Dword(disp);
+    }
+
+    void StoreStackWordImm(int32_t disp, uint16_t imm) //mov word [r8+rax*2+disp], imm16
+    {
+        Byte(0x66);
+        StackOp(0xC7, 0, disp);
+        Word(imm);
+    }
+
+    void StoreWordCx(int32_t disp) //mov word [r8+disp], cx
+    {
+        Byte(0x66);
+        MemOp(0x89, X64_CL, disp);
+    }
+
+    //op al, cl
+    void AluAlCl(uint8_t opcode)
+    {
+        Byte(opcode);
+        Byte(0xC8);
+    }
+
+    void SetCarry(bool carry_set) //setc dl / setnc dl
+    {
+        Byte(0x0F);
+        Byte(carry_set ? 0x92 : 0x93);
+        Byte(0xC2);
+    }
+
+    //r9d counts the budget down, r10d keeps what it started at
+    void Prologue()
+    {
+#ifdef _WIN32
+        Byte(0x49); Byte(0x89); Byte(0xC8); //mov r8, rcx
+        Byte(0x41); Byte(0x89); Byte(0xD1); //mov r9d, edx
+        Byte(0x41); Byte(0x89); Byte(0xD2); //mov r10d, edx
+#else
+        Byte(0x49); Byte(0x89); Byte(0xF8); //mov r8, rdi
+        Byte(0x41); Byte(0x89); Byte(0xF1); //mov r9d, esi
+        Byte(0x41); Byte(0x89); Byte(0xF2); //mov r10d, esi
+#endif
+    }
+
+    //Returns the number of instructions executed, the part of the budget that was used
+    void Return()
+    {
+        Byte(0x44); Byte(0x89); Byte(0xD0); //mov eax, r10d
+        Byte(0x44); Byte(0x29); Byte(0xC8); //sub eax, r9d
+        Byte(0xC3); //ret
+    }
+
+    //Sets the program counter and returns
+    void Exit(int32_t pc_disp, uint16_t pc)
+    {
+        StoreWordImm(pc_disp, pc);
+        Return();
+    }
+
+    void CountInstruction()
+    {
+        Byte(0x41); Byte(0xFF); Byte(0xC9); //dec r9d
+    }
+
+    //Leaves the block early once the budget runs out
+    void CheckBudget(int32_t pc_disp, uint16_t next_pc)
+    {
+        CountInstruction();
+        uint8_t* over_exit = JumpRel8(0x75); //jnz
+        Exit(pc_disp, next_pc);
+        PatchRel8(over_exit);
+    }
+
+    //Short jump forward to wherever PatchRel8 is called. Returns the byte to patch
+    uint8_t* JumpRel8(uint8_t opcode)
+    {
+        Byte(opcode);
+        Byte(0);
+        return cursor - 1;
+    }
+
+    void PatchRel8(uint8_t* at)
+    {
+        *at = (uint8_t)(cursor - (at + 1));
+    }
+
+    //jcc rel32. Returns the offset to patch when the target isn't known yet
+    uint8_t* JumpCondRel32(uint8_t condition)
+    {
+        Byte(0x0F);
+        Byte(condition);
+        Dword(0);
+        return cursor - 4;
+    }
+
+    void PatchRel32(uint8_t* at, const uint8_t* target)
+    {
+        int32_t rel = (int32_t)(target - (at + 4));
+        memcpy(at, &rel, sizeof(rel));
+    }
+};
+
+
+//A jump inside a block to an instruction that wasn't compiled when the jump was
+struct JitFixup
+{
+    uint8_t* at;
+    uint16_t target;
+};
+
+
+//Byte offsets of the emulator fields the generated code touches
+struct JitOffsets
+{
+    int32_t v[EMULATOR_REGISTER_COUNT];
+    int32_t I;
+    int32_t program_counter;
+    int32_t delay_timer;
+    int32_t stack;
+    int32_t stack_pointer;
+};
+
+static JitOffsets jit_get_offsets(Emulator* emu)
+{
+    JitOffsets offsets;
+    uint8_t* base = (uint8_t*)emu;
+
+    for (int i = 0; i < EMULATOR_REGISTER_COUNT; i++)
+    {
+        offsets.v[i] = (int32_t)((uint8_t*)&(emu->v[i]) - base);
+    }
+    offsets.I = (int32_t)((uint8_t*)&(emu->I) - base);
+    offsets.program_counter = (int32_t)((uint8_t*)&(emu->program_counter) - base);
+    offsets.delay_timer = (int32_t)((uint8_t*)&(emu->delay_timer) - base);
+    offsets.stack = (int32_t)((uint8_t*)emu->stack.data() - base);
+    offsets.stack_pointer = (int32_t)((uint8_t*)&(emu->stack_pointer) - base);
+
+    return offsets;
+}
+
+
+bool Jit::Init()
+{
+#if JIT_SUPPORTED
+#ifdef _WIN32
+    code_cache = (uint8_t*)VirtualAlloc(NULL, JIT_CODE_CACHE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void* memory = mmap(NULL, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    code_cache = (memory == MAP_FAILED) ? nullptr : (uint8_t*)memory;
+#endif
+#endif
+
+    if (code_cache == nullptr)
+    {
+        printf("WARNING: Allocating the JIT code cache failed. Falling back to the interpreter.\n");
+        return false;
+    }
+
+    Flush();
+    return true;
+}
+
+
+void Jit::Destroy()
+{
+    if (code_cache)
+    {
+#ifdef _WIN32
+        VirtualFree(code_cache, 0, MEM_RELEASE);
+#else
+        munmap(code_cache, JIT_CODE_CACHE_SIZE);
+#endif
+        code_cache = nullptr;
+    }
+}
+
+
+void Jit::Flush()
+{
+    code_cache_used = 0;
+    blocks.fill(JitBlock());
+    covered.fill(0);
+}
+
+
+void Jit::Invalidate(int start, int end)
+{
+    if (end > EMULATOR_RAM_SIZE) end = EMULATOR_RAM_SIZE;
+
+    bool any_covered = false;
+    for (int i = start; i < end; i++)
+    {
+        if (covered[i])
+        {
+            any_covered = true;
+            break;
+        }
+    }
+
+    if (any_covered == false) return;
+
+    //Any block that starts early enough to reach the written range
+    int first = start - JIT_MAX_BLOCK_BYTES;
+    if (first < 0) first = 0;
+
+    for (int i = first; i < end; i++)
+    {
+        JitBlock* block = &(blocks[i]);
+        if ((block->state != JIT_BLOCK_NONE) && (block->end > start))
+        {
+            *block = JitBlock();
+        }
+    }
+
+    //The code stays in the cache until the next flush. it just can't be reached anymore
+}
+
+
+static bool jit_is_supported(const DecodedOp& op)
+{
+    switch (op.handler)
+    {
+        case OP_NOP:
+        case OP_SET_NN:
+        case OP_ADD_NN:
+        case OP_SET_VY:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        case OP_ADD_VY:
+        case OP_SUB:
+        case OP_SUBN:
+        case OP_SHIFT_RIGHT:
+        case OP_SHIFT_LEFT:
+        case OP_SET_I:
+        case OP_ADD_I:
+        case OP_GET_DELAY:
+        case OP_SET_DELAY:
+        case OP_FONT_CHAR:
+        case OP_JUMP:
+        case OP_CALL:
+        case OP_RETURN:
+        case OP_JUMP_OFFSET:
+        case OP_SKIP_EQ_NN:
+        case OP_SKIP_NE_NN:
+        case OP_SKIP_EQ_VY:
+        case OP_SKIP_NE_VY:
+            return true;
+    }
+
+    return false;
+}
+
+
+//Instructions that always leave the block. Jumps can stay in it, see Jit::Compile
+static bool jit_ends_block(const DecodedOp& op)
+{
+    switch (op.handler)
+    {
+        case OP_CALL:
+        case OP_RETURN:
+        case OP_JUMP_OFFSET:
+            return true;
+    }
+
+    return false;
+}
+
+
+static bool jit_is_skip(const DecodedOp& op)
+{
+    switch (op.handler)
+    {
+        case OP_SKIP_EQ_NN:
+        case OP_SKIP_NE_NN:
+        case OP_SKIP_EQ_VY:
+        case OP_SKIP_NE_VY:
+            return true;
+    }
+
+    return false;
+}
+
+
+//Compares v[x] for a skip. The flags say equal or not
+static void jit_emit_skip_compare(JitEmitter* e, const JitOffsets& o, const DecodedOp& op)
+{
+    if ((op.handler == OP_SKIP_EQ_NN) || (op.handler == OP_SKIP_NE_NN))
+    {
+        e->CmpByteImm(o.v[op.x], op.nn);
+    }
+    else
+    {
+        e->LoadByte(X64_AL, o.v[op.x]);
+        e->CmpRegMem(X64_AL, o.v[op.y]);
+    }
+}
+
+
+//Emits one instruction. Has to match Emulator::ExecuteInstructions exactly, including
+//the order v[x] and v[f] are written in when x is 0xF
+static void jit_emit_op(JitEmitter* e, const JitOffsets& o, const DecodedOp& op, uint16_t address, int mode)
+{
+    int32_t vx = o.v[op.x];
+    int32_t vy = o.v[op.y];
+    int32_t vf = o.v[0xF];
+    int profile = quirk_profile_for_mode(mode);
+    bool cosmac = (profile == QUIRK_PROFILE_COSMAC); //vf reset and shifting vy
+
+    switch (op.handler)
+    {
+        case OP_NOP: break;
+
+        case OP_SET_NN:
+        {
+            e->StoreByteImm(vx, op.nn);
+        } break;
+
+        case OP_ADD_NN:
+        {
+            e->AddByteImm(vx, op.nn);
+        } break;
+
+        case OP_SET_VY:
+        {
+            e->LoadByte(X64_AL, vy);
+            e->StoreByte(vx, X64_AL);
+        } break;
+
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        {
+            uint8_t opcode = 0x08; //or
+            if (op.handler == OP_AND) opcode = 0x20;
+            if (op.handler == OP_XOR) opcode = 0x30;
+
+            e->LoadByte(X64_AL, vx);
+            e->LoadByte(X64_CL, vy);
+            e->AluAlCl(opcode);
+            e->StoreByte(vx, X64_AL);
+            if (cosmac)
+            {
+                e->StoreByteImm(vf, 0);
+            }
+        } break;
+
+        case OP_ADD_VY:
+        {
+            e->LoadByte(X64_AL, vx);
+            e->LoadByte(X64_CL, vy);
+            e->AluAlCl(0x00); //add al, cl
+            e->SetCarry(true);
+            e->StoreByte(vx, X64_AL);
+            e->StoreByte(vf, X64_DL);
+        } break;
+
+        case OP_SUB:
+        case OP_SUBN:
+        {
+            //borrow clears the flag
+            bool subn = (op.handler == OP_SUBN);
+            e->LoadByte(X64_AL, subn ? vy : vx);
+            e->LoadByte(X64_CL, subn ? vx : vy);
+            e->AluAlCl(0x28); //sub al, cl
+            e->SetCarry(false);
+            e->StoreByte(vx, X64_AL);
+            e->StoreByte(vf, X64_DL);
+        } break;
+
+        case OP_SHIFT_RIGHT:
+        case OP_SHIFT_LEFT:
+        {
+            e->LoadByte(X64_AL, cosmac ? vy : vx);
+            e->Byte(0xD0);
+            e->Byte(op.handler == OP_SHIFT_RIGHT ? 0xE8 : 0xE0); //shr al, 1 / shl al, 1
+            e->SetCarry(true); //the shifted out bit
+            e->StoreByte(vx, X64_AL);
+            e->StoreByte(vf, X64_DL);
+        } break;
+
+        case OP_SET_I:
+        {
+            e->StoreWordImm(o.I, op.nnn);
+        } break;
+
+        case OP_ADD_I:
+        {
+            e->MovzxByte(X64_CL, vx);
+            e->AddWordCx(o.I);
+
+            if (profile == QUIRK_PROFILE_AMIGA)
+            {
+                e->CmpWordImm(o.I, 0x1000);
+                e->Byte(0x76); e->Byte(8); //jbe over the next store
+                e->StoreByteImm(vf, 1);
+            }
+        } break;
+
+        case OP_GET_DELAY:
+        {
+            e->LoadByte(X64_AL, o.delay_timer);
+            e->StoreByte(vx, X64_AL);
+        } break;
+
+        case OP_SET_DELAY:
+        {
+            e->LoadByte(X64_AL, vx);
+            e->StoreByte(o.delay_timer, X64_AL);
+        } break;
+
+        case OP_FONT_CHAR:
+        {
+            e->MovzxByte(X64_AL, vx);
+            e->Byte(0x83); e->Byte(0xE0); e->Byte(0x0F); //and eax, 0xF
+            e->Byte(0x8D); e->Byte(0x04); e->Byte(0x80); //lea eax, [rax + rax*4]
+            if (FONT_ADDRESS != 0)
+            {
+                e->Byte(0x05); e->Dword(FONT_ADDRESS); //add eax, FONT_ADDRESS
+            }
+            e->StoreWordAx(o.I);
+        } break;
+
+        //The stack pointer wraps around like the interpreter's, so it never leaves the stack
+        case OP_CALL:
+        {
+            e->MovzxByte(X64_AL, o.stack_pointer);
+            e->StoreStackWordImm(o.stack, address);
+            e->Byte(0xFF); e->Byte(0xC0); //inc eax
+            e->Byte(0x83); e->Byte(0xE0); e->Byte(EMULATOR_STACK_SIZE - 1); //and eax, stack size - 1
+            e->StoreByte(o.stack_pointer, X64_AL);
+            e->StoreWordImm(o.program_counter, op.nnn);
+        } break;
+
+        case OP_RETURN:
+        {
+            e->MovzxByte(X64_AL, o.stack_pointer);
+            e->Byte(0xFF); e->Byte(0xC8); //dec eax
+            e->Byte(0x83); e->Byte(0xE0); e->Byte(EMULATOR_STACK_SIZE - 1); //and eax, stack size - 1
+            e->StoreByte(o.stack_pointer, X64_AL);
+            e->LoadStackWordCx(o.stack);
+            e->StoreStackWordImm(o.stack, 0);
+            e->Byte(0x83); e->Byte(0xC1); e->Byte(2); //add ecx, 2. returns past the call
+            e->StoreWordCx(o.program_counter);
+        } break;
+
+        case OP_JUMP_OFFSET:
+        {
+            e->MovzxByte(X64_AL, cosmac ? o.v[0] : vx);
+            e->Byte(0x05); e->Dword(op.nnn); //add eax, nnn
+            e->StoreWordAx(o.program_counter);
+        } break;
+    }
+}
+
+
+JitBlock* Jit::Compile(Emulator* emu, uint16_t address)
+{
+    JitBlock* block = &(blocks[address]);
+
+    if ((code_cache_used + JIT_MAX_BLOCK_CODE_SIZE) > JIT_CODE_CACHE_SIZE)
+    {
+        Flush();
+    }
+
+    JitOffsets offsets = jit_get_offsets(emu);
+    int mode = emu->compatibility_mode;
+
+    JitEmitter e;
+    e.cursor = code_cache + code_cache_used;
+    uint8_t* code_start = e.cursor;
+
+    e.Prologue();
+
+    //Where each compiled instruction's code starts. Skips and jumps inside the block go straight there
+    uint8_t* labels[JIT_MAX_BLOCK_INSTRUCTIONS] = {};
+    JitFixup fixups[JIT_MAX_BLOCK_INSTRUCTIONS];
+    int fixup_count = 0;
+
+    int count = 0;
+    uint16_t pc = address;
+    bool reachable = true; //false after a jump until an instruction a skip lands on
+
+    while ((count < JIT_MAX_BLOCK_INSTRUCTIONS) && (pc < (EMULATOR_RAM_SIZE-2)))
+    {
+        uint16_t instruction = emu->ReadMemory(pc+1) | (((uint16_t)emu->ReadMemory(pc)) << 8);
+        DecodedOp op = decode_instruction(instruction);
+
+        if (jit_is_supported(op) == false)
+        {
+            break;
+        }
+
+        bool targeted = false;
+        for (int i = 0; i < fixup_count; i++)
+        {
+            targeted |= (fixups[i].target == pc);
+        }
+        if ((reachable == false) && (targeted == false))
+        {
+            break;
+        }
+
+        //Skips that land here jump to the code that follows
+        for (int i = 0; i < fixup_count; i++)
+        {
+            if (fixups[i].target == pc)
+            {
+                e.PatchRel32(fixups[i].at, e.cursor);
+                fixups[i] = fixups[fixup_count-1];
+                fixup_count--;
+                i--;
+            }
+        }
+
+        labels[count] = e.cursor;
+        uint16_t next_pc = (uint16_t)(pc + 2);
+        reachable = true;
+
+        if (jit_is_skip(op))
+        {
+            bool skip_if_equal = (op.handler == OP_SKIP_EQ_NN) || (op.handler == OP_SKIP_EQ_VY);
+
+            //Out of budget, so this is the last instruction. Sets the program counter like the interpreter
+            e.CountInstruction();
+            uint8_t* go = e.JumpRel8(0x75); //jnz
+            e.StoreWordImm(offsets.program_counter, next_pc);
+            jit_emit_skip_compare(&e, offsets, op);
+            uint8_t* not_skipped = e.JumpRel8(skip_if_equal ? 0x75 : 0x74); //jne or je
+            e.StoreWordImm(offsets.program_counter, (uint16_t)(pc + 4));
+            e.PatchRel8(not_skipped);
+            e.Return();
+            e.PatchRel8(go);
+
+            jit_emit_skip_compare(&e, offsets, op);
+            fixups[fixup_count].at = e.JumpCondRel32(skip_if_equal ? 0x84 : 0x85); //je or jne
+            fixups[fixup_count].target = (uint16_t)(pc + 4);
+            fixup_count++;
+        }
+        else if (op.handler == OP_JUMP)
+        {
+            //Jumps back into the block loop in native code. Not to an FX07 though, the idle loop check in Run has to see those
+            uint16_t target = op.nnn;
+            bool inside = (target >= address) && (target < pc) && (((target - address) & 1) == 0);
+            bool timer_wait = inside && ((emu->ReadMemory(target) & 0xF0) == 0xF0) && (emu->ReadMemory(target + 1) == 0x07);
+
+            if (inside && (timer_wait == false))
+            {
+                e.CountInstruction();
+                e.PatchRel32(e.JumpCondRel32(0x85), labels[(target - address) / 2]); //jnz
+                e.Exit(offsets.program_counter, target);
+            }
+            else
+            {
+                e.StoreWordImm(offsets.program_counter, target);
+                e.CountInstruction();
+                e.Return();
+            }
+            reachable = false;
+        }
+        else if (jit_ends_block(op))
+        {
+            jit_emit_op(&e, offsets, op, pc, mode);
+            e.CountInstruction();
+            e.Return();
+            reachable = false;
+        }
+        else
+        {
+            jit_emit_op(&e, offsets, op, pc, mode);
+            e.CheckBudget(offsets.program_counter, next_pc);
+        }
+
+        count++;
+        pc = next_pc;
+    }
+
+    if (count == 0)
+    {
+        //Everything up to the next instruction a block can start with runs in one interpreter call.
+        //A skip or FX0A can move the program counter anywhere, so the run ends after one
+        int run = 0;
+        uint16_t run_pc = address;
+        while ((run < JIT_MAX_BLOCK_INSTRUCTIONS) && (run_pc < (EMULATOR_RAM_SIZE-2)))
+        {
+            uint16_t run_instruction = emu->ReadMemory(run_pc+1) | (((uint16_t)emu->ReadMemory(run_pc)) << 8);
+            DecodedOp run_op = decode_instruction(run_instruction);
+            if ((run > 0) && jit_is_supported(run_op)) break;
+
+            run++;
+            run_pc += 2;
+
+            if ((run_op.handler == OP_SKIP_KEY) || (run_op.handler == OP_SKIP_NOT_KEY) || (run_op.handler == OP_GET_KEY)) break;
+        }
+        if (run == 0) run = 1;
+
+        block->state = JIT_BLOCK_INTERPRET;
+        block->end = (uint16_t)(address + (run * 2));
+        block->instruction_count = (uint8_t)run;
+        for (int i = address; i < block->end; i++)
+        {
+            covered[i] = 1;
+        }
+        return block;
+    }
+
+    if (reachable)
+    {
+        e.Exit(offsets.program_counter, pc);
+    }
+
+    //Skips past the end of the block leave it
+    for (int i = 0; i < fixup_count; i++)
+    {
+        e.PatchRel32(fixups[i].at, e.cursor);
+        e.Exit(offsets.program_counter, fixups[i].target);
+    }
+
+    code_cache_used += (int)(e.cursor - code_start);
+
+    block->code = (JitBlockFunc)code_start;
+    block->end = pc;
+    block->instruction_count = (uint8_t)count;
+    block->state = JIT_BLOCK_COMPILED;
+
+    for (int i = address; i < pc; i++)
+    {
+        covered[i] = 1;
+    }
+
+    return block;
+}
+
+
+int Jit::Run(Emulator* emu, int max_instructions)
+{
+    if (emu->compatibility_mode != compiled_mode)
+    {
+        Flush();
+        compiled_mode = emu->compatibility_mode;
+    }
+
+    //Compiled blocks run back to back until one needs the interpreter
+    int executed = 0;
+    while (executed < max_instructions)
+    {
+        uint16_t pc = emu->program_counter;
+        if (pc >= (EMULATOR_RAM_SIZE-2)) break;
+
+        JitBlock* block = &(blocks[pc]);
+        if (block->state == JIT_BLOCK_NONE)
+        {
+            block = Compile(emu, pc);
+        }
+
+        if (block->state != JIT_BLOCK_COMPILED) break;
+
+        executed += block->code(emu, max_instructions - executed);
+
+        //Loops only go backwards. Same check the interpreter does on its jumps
+        if (emu->skip_idle_loops && (emu->program_counter <= pc))
+        {
+            int skipped = emu->SkipIdleLoop(emu->program_counter, max_instructions - executed);
+            executed += skipped;
+        }
+    }
+
+    return executed;
+}
+
+
+int Jit::InterpretCount(uint16_t address) const
+{
+    if (address >= (EMULATOR_RAM_SIZE-2)) return 1;
+
+    const JitBlock& block = blocks[address];
+    if ((block.state != JIT_BLOCK_INTERPRET) || (block.instruction_count == 0)) return 1;
+
+    return block.instruction_count;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "emulator.hpp"
+
+#include <array>
+#include <stdint.h>
+
+//Dynamic recompiler for straight-line CHIP-8 code. Only x86-64 hosts are supported.
+//On anything else Init fails and the emulator keeps interpreting
+#if defined(_M_X64) || defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+const int JIT_CODE_CACHE_SIZE = 256 * 1024;
+const int JIT_MAX_BLOCK_INSTRUCTIONS = 32;
+const int JIT_MAX_BLOCK_BYTES = JIT_MAX_BLOCK_INSTRUCTIONS * 2;
+
+//Largest amount of native code a single block can need. Used to flush the cache before compiling
+const int JIT_MAX_BLOCK_CODE_SIZE = 64 + (JIT_MAX_BLOCK_INSTRUCTIONS * 128);
+
+//Runs at most budget instructions of the block and returns how many ran.
+//Blocks check the budget after every instruction so a frame never runs more instructions than the interpreter would
+typedef int (*JitBlockFunc)(Emulator* emu, int budget);
+
+enum
+{
+    JIT_BLOCK_NONE, //not compiled yet
+    JIT_BLOCK_COMPILED,
+    JIT_BLOCK_INTERPRET //the instruction at this address isn't supported. always use the interpreter
+};
+
+struct JitBlock
+{
+    JitBlockFunc code = nullptr;
+    uint16_t end = 0; //one past the last byte the block was compiled from
+    uint8_t instruction_count = 0; //for JIT_BLOCK_INTERPRET, how many instructions the interpreter should run
+    uint8_t state = JIT_BLOCK_NONE;
+};
+
+
+struct Jit
+{
+    uint8_t* code_cache = nullptr;
+    int code_cache_used = 0;
+
+    //Blocks are compiled for one compatibility mode. Changing it flushes the cache
+    int compiled_mode = 0;
+
+    //Indexed by the address the block starts at
+    std::array<JitBlock, EMULATOR_RAM_SIZE> blocks;
+
+    //Set for every address some block was compiled from. Writes to other addresses skip invalidation
+    std::array<uint8_t, EMULATOR_RAM_SIZE> covered = {0};
+
+    bool Init();
+    void Destroy();
+
+    //Runs compiled blocks starting at the emulator's program counter until one isn't compiled or the budget runs out.
+    //Idle loops are skipped like the interpreter does. Returns how many instructions were executed or skipped.
+    //0 means the caller has to interpret InterpretCount instructions
+    int Run(Emulator* emu, int max_instructions);
+    int InterpretCount(uint16_t address) const;
+
+    void Invalidate(int start, int end); //[start, end)
+    void Flush();
+
+    JitBlock* Compile(Emulator* emu, uint16_t address);
+};
@@ -10,8 +10,17 @@
 #include <dinput.h>
 #include <stdbool.h>
 #include <commctrl.h>
+#include <atomic>
+#include <thread>
 #include "bitmap.hpp"
 #include "emulator.hpp"
+#include "rewind.hpp"
+#include "movie.hpp"
+#include "frame_scheduler.hpp"
+#include "frame_renderer.hpp"
+#include "triple_buffer.hpp"
+#include "spsc_queue.hpp"
+#include "audio.hpp"
 
 #ifndef UNICODE
 #define UNICODE
@@ -30,6 +39,19 @@ enum
 static bool running = true;
 static Emulator* emu;
 
+static Rewind rewind_history;
+static bool rewinding = false; //backspace is held. steps back a frame per tick instead of running
+
+//Tab is held. Frames run back to back and only the last one of every SKIP_TICKS slice is drawn and presented.
+//The achieved frame rate goes in the window title once a second
+static bool turbo = false;
+static DWORD turbo_report_time = 0;
+static int turbo_report_frames = 0;
+
+//F5 starts/stops recording input, F6 plays the recording back
+static Movie movie;
+static const wchar_t* MOVIE_FILENAME = L"recording.c8m";
+
 static bool emulator_prev_running = true; //used for polished state switching for actions like
 //                                          opening the settings menu
 //                                          not part of Emulator because it has no use there.??
@@ -38,10 +60,39 @@ static const int BPP = 4;
 
 static const unsigned int TICKS_PER_SECOND = 60; // frame rate per second
 static const unsigned int SKIP_TICKS = 1000 / TICKS_PER_SECOND;
-static const unsigned int MAX_FRAMESKIP = 1;
+static const unsigned int MAX_FRAMESKIP = 5; //frames run without presenting when the loop falls behind
+
+//Paces the loop. Its jitter stats go to the console every SCHEDULER_REPORT_FRAMES frames
+static FrameScheduler scheduler;
+static const uint64_t SCHEDULER_REPORT_FRAMES = TICKS_PER_SECOND * 10;
 
 static const int EMULATOR_STATUS_TEXT_Y = 1; //Y pos
 
+//Scaling and presenting run on their own thread so a slow present never holds up emulation.
+//The loop publishes every finished frame into the triple buffer and signals the event, it never waits on the presenter
+static TripleBuffer<DisplayFrame> frames;
+static FrameRenderer renderer; //presentation thread only, like the bitmap it draws into
+static std::thread present_thread;
+static std::atomic<bool> presenting{false};
+static HANDLE frame_ready_event = nullptr;
+
+//Key changes go through the queue instead of straight into the emulator, so the emulation can move to another
+//thread. Each frame is split into INPUT_SLICES_PER_FRAME slices and events land in the slice matching their time
+static InputQueue input_queue;
+static const int INPUT_SLICES_PER_FRAME = 4;
+static int64_t input_window_end = 0; //host time up to which the frames so far covered input
+
+//How long it takes from a key event to the first present that includes it. Presentation thread only
+static const int LATENCY_REPORT_EVENTS = 32;
+static int64_t latency_input_time = 0;
+static int64_t latency_sum = 0;
+static int64_t latency_max = 0;
+static int latency_count = 0;
+
+//Set by the window thread, picked up by the presenter
+static std::atomic<uint32_t> present_size{0}; //client area the bitmap should cover. width << 16 | height
+static std::atomic<bool> repaint_requested{false}; //present the whole bitmap, not just what changed
+
 static HWND window_handle = nullptr;
 static HWND settings_handle = nullptr;
 static std::array<HWND, EMULATOR_KEY_COUNT> hotkeys = {nullptr};
@@ -54,6 +105,12 @@ static IDirectSoundBuffer* ds_buffer = nullptr;
 static DSBUFFERDESC ds_buffer_desc = {0};
 static WAVEFORMATEX ds_audio_format = {0};
 
+//The beep is rendered on the audio thread from the emulator's sound events and streamed into ds_buffer,
+//which loops the whole time. ds_write_offset is where the next block goes. Audio thread only
+static AudioEngine audio;
+static uint32_t ds_write_offset = 0;
+static const int AUDIO_QUEUED_BLOCKS = 3; //how far ahead of the play cursor blocks are written
+
 static HMENU menu = nullptr;
 
 
@@ -80,11 +137,28 @@ static void win32_handle_menu_command(WPARAM w_param);
 
 static void win32_resize_bitmap(int width, int height);
 
+static void win32_present_loop();
+
+static void win32_request_repaint();
+
+static void win32_measure_input_latency(int64_t input_time);
+
+static void win32_queue_key(int code, uint8_t state);
+
 static void win32_draw_bitmap();
 
+static void win32_present_dirty_rects();
+
 static int win32_keycode_to_emulator_keycode(int code);
 
-static void win32_fill_sound_buffer_with_square_wave();
+static void win32_start_audio();
+static void win32_stop_audio();
+static void win32_write_audio(void* context, const int16_t* samples, int count);
+
+static void win32_run_frames(int frame_count);
+static void win32_report_scheduler_stats();
+static void win32_run_turbo_frames();
+static void win32_set_turbo(bool new_turbo);
 
 static void win32_set_emulator_state(bool new_running);
 
@@ -100,6 +174,7 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 {
     emu = new Emulator();
     emu->Init();
+    rewind_history.Init(REWIND_DEFAULT_BUFFER_SIZE, REWIND_DEFAULT_KEYFRAME_INTERVAL);
    
     int code = win32_init(hInstance, hPrevInstance, pCmdLine);
     if (code)
@@ -137,7 +212,20 @@ static void win32_loop()
 
     timeBeginPeriod(1);
 
-    win32_draw_bitmap();
+    frame_ready_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    presenting = true;
+    present_thread = std::thread(win32_present_loop);
+    win32_request_repaint();
+
+    emu->input_queue = &input_queue;
+    emu->input_slices = INPUT_SLICES_PER_FRAME;
+
+    win32_start_audio();
+
+    scheduler.Init(TICKS_PER_SECOND, MAX_FRAMESKIP);
+    input_window_end = FrameScheduler::Now();
+    int frame_count = 1;
+    bool paced = true;
 
     while (running)
     {
@@ -155,31 +243,100 @@ static void win32_loop()
         }
         
         {
-            emu->Update();
-            if (emu->should_draw_this_frame)
+            if (rewinding && emu->running)
             {
-                win32_draw_bitmap();
+                rewind_history.StepBack(emu);
+                emu->SetBeeper(false);
             }
-
-            if (emu->running)
+            else if (turbo && emu->running)
             {
-                win32_fill_sound_buffer_with_square_wave();
+                win32_run_turbo_frames();
             }
-
-            if (emu->sound_state == SOUND_STATE_PLAY)
+            else
             {
-                ds_buffer->Play(0, 0, DSBPLAY_LOOPING);
+                win32_run_frames(frame_count);
             }
-            else if (emu->sound_state == SOUND_STATE_STOP)
+
+            emu->PublishFrame(&frames);
+            SetEvent(frame_ready_event);
+
+            emu->LateUpdate();
+        }
+
+        //Turbo already spent the frame's time emulating. The schedule starts over once it's done
+        if (turbo && emu->running)
+        {
+            paced = false;
+            frame_count = 1;
+        }
+        else
+        {
+            if (paced == false)
             {
-                ds_buffer->Stop();
+                scheduler.Resync();
+                paced = true;
             }
 
+            frame_count = scheduler.WaitForNextFrame();
+            win32_report_scheduler_stats();
+        }
+    }
+
+    presenting = false;
+    SetEvent(frame_ready_event);
+    present_thread.join();
+    CloseHandle(frame_ready_event);
+
+    win32_stop_audio();
+    scheduler.Destroy();
+}
+
+
+//Runs the frames that are due. Only the last one gets published, the ones before it were skipped to catch up
+static void win32_run_frames(int frame_count)
+{
+    //These frames stand for the time since the last ones ran. Input is spread over them by its timestamps
+    int64_t window_start = input_window_end;
+    int64_t window_end = FrameScheduler::Now();
+    input_window_end = window_end;
+
+    if (emu->running == false)
+    {
+        emu->Update();
+        return;
+    }
+
+    for (int i = 0; i < frame_count; i++)
+    {
+        emu->input_time_start = window_start + ((window_end - window_start) * i) / frame_count;
+        emu->input_time_end = window_start + ((window_end - window_start) * (i + 1)) / frame_count;
+
+        movie.OnFrame(emu);
+        emu->Update();
+        rewind_history.Record(emu);
+
+        if (i < frame_count - 1)
+        {
             emu->LateUpdate();
         }
+    }
+}
+
 
-        Sleep(16);
+static void win32_report_scheduler_stats()
+{
+    const FrameSchedulerStats& stats = scheduler.stats;
+    if (stats.frames < SCHEDULER_REPORT_FRAMES)
+    {
+        return;
     }
+
+    printf("INFO: %llu frames, %llu skipped, %llu dropped. lateness mean %.1f us, jitter %.1f us, max %.1f us\n",
+    (unsigned long long)stats.frames, (unsigned long long)stats.skipped_frames,
+    (unsigned long long)stats.dropped_frames, stats.MeanLatenessMicroseconds(), stats.JitterMicroseconds(),
+    stats.lateness_max / 1000.0);
+
+    scheduler.ResetStats();
 }
 
 
@@ -348,7 +505,7 @@ static int win32_init_directsound()
 
 static void win32_destroy()
 {
-    VirtualFree(emu->bitmap.data, 0, MEM_RELEASE);
+    VirtualFree(renderer.bitmap.data, 0, MEM_RELEASE);
     DestroyWindow(window_handle);
 
     ds_object->Release();
@@ -378,7 +535,10 @@ static void win32_handle_menu_command(WPARAM w_param)
 
             GetOpenFileName(&ofn);
 
-            emu->LoadFromFile(filepath);
+            if (emu->LoadFromFile(filepath))
+            {
+                rewind_history.Clear();
+            }
             
             emu->should_draw_this_frame = true;
         } break;
@@ -414,53 +574,169 @@ static void win32_handle_menu_command(WPARAM w_param)
 }
 
 
+//The presentation thread. Sleeps until a frame is published or the window needs repainting, then scales the
+//newest frame and presents what changed. Frames published in between are skipped, the emulation never waits here
+static void win32_present_loop()
+{
+    uint32_t size = 0;
+
+    while (presenting)
+    {
+        WaitForSingleObject(frame_ready_event, INFINITE);
+
+        bool repaint = repaint_requested.exchange(false);
+
+        uint32_t new_size = present_size.load();
+        if (new_size != size)
+        {
+            size = new_size;
+            win32_resize_bitmap((int)(size >> 16), (int)(size & 0xFFFF));
+            renderer.Invalidate();
+            repaint = true;
+        }
+
+        if (frames.Acquire() || repaint)
+        {
+            renderer.Draw(frames.ReadSlot());
+        }
+
+        if (repaint)
+        {
+            win32_draw_bitmap();
+        }
+        else if (renderer.dirty_rect_count)
+        {
+            win32_present_dirty_rects();
+        }
+
+        win32_measure_input_latency(frames.ReadSlot().input_time);
+    }
+}
+
+
+static void win32_measure_input_latency(int64_t input_time)
+{
+    if (input_time == latency_input_time)
+    {
+        return;
+    }
+    latency_input_time = input_time;
+
+    int64_t latency = FrameScheduler::Now() - input_time;
+    latency_sum += latency;
+    if (latency > latency_max)
+    {
+        latency_max = latency;
+    }
+    latency_count++;
+
+    if (latency_count == LATENCY_REPORT_EVENTS)
+    {
+        printf("INFO: Input to present latency over %d events. mean %.2f ms, max %.2f ms\n", latency_count,
+        (latency_sum / (double)latency_count) / 1000000.0, latency_max / 1000000.0);
+
+        latency_sum = 0;
+        latency_max = 0;
+        latency_count = 0;
+    }
+}
+
+
+static void win32_queue_key(int code, uint8_t state)
+{
+    InputEvent event;
+    event.time = FrameScheduler::Now();
+    event.code = code;
+    event.state = state;
+
+    if (input_queue.Push(event) == false)
+    {
+        printf("WARNING: Input queue is full. A key event was dropped.\n");
+    }
+}
+
+
+//Called from any thread
+static void win32_request_repaint()
+{
+    repaint_requested = true;
+    if (frame_ready_event)
+    {
+        SetEvent(frame_ready_event);
+    }
+}
+
+
+//Presentation thread only
 static void win32_draw_bitmap()
 {
-    PAINTSTRUCT ps;
-    BeginPaint(window_handle, &ps);
+    if (renderer.bitmap.data == NULL) return;
 
-    RECT rect;
-    GetClientRect(window_handle, &rect);
-    int width = rect.right - rect.left;
-    int height = rect.bottom - rect.top;
+    HDC dc = GetDC(window_handle);
 
-    StretchDIBits(GetDC(window_handle), 0, 0,
-    width, height,
+    StretchDIBits(dc, 0, 0,
+    renderer.bitmap.w, renderer.bitmap.h,
     0, 0,
-    emu->bitmap.w, emu->bitmap.h,
-    emu->bitmap.data, &bitmap_info, DIB_RGB_COLORS,
+    renderer.bitmap.w, renderer.bitmap.h,
+    renderer.bitmap.data, &bitmap_info, DIB_RGB_COLORS,
     SRCCOPY);
 
-    EndPaint(window_handle, &ps);
+    ReleaseDC(window_handle, dc);
+}
+
+
+//Only copies the parts of the bitmap the last FrameRenderer::Draw repainted. Presentation thread only
+static void win32_present_dirty_rects()
+{
+    HDC dc = GetDC(window_handle);
+
+    for (int i = 0; i < renderer.dirty_rect_count; i++)
+    {
+        const BitmapRect& rect = renderer.dirty_rects[i];
+
+        StretchDIBits(dc, rect.x, rect.y,
+        rect.w, rect.h,
+        rect.x, rect.y,
+        rect.w, rect.h,
+        renderer.bitmap.data, &bitmap_info, DIB_RGB_COLORS,
+        SRCCOPY);
+    }
+
+    ReleaseDC(window_handle, dc);
 }
 
 
+//Presentation thread only
 static void win32_resize_bitmap(int width, int height)
 {
-    if (emu->bitmap.data)
+    if (renderer.bitmap.data)
     {
-        VirtualFree(emu->bitmap.data, 0, MEM_RELEASE);
-        emu->bitmap.data = NULL;
+        VirtualFree(renderer.bitmap.data, 0, MEM_RELEASE);
+        renderer.bitmap.data = NULL;
     }
 
     //Create bitmap
-    emu->bitmap.w = width;
-    emu->bitmap.h = height;
-    emu->bitmap.bpp = BPP;
+    renderer.bitmap.w = width;
+    renderer.bitmap.h = height;
+    renderer.bitmap.bpp = BPP;
 
     memset(&bitmap_info, 0, sizeof(BITMAPINFO));
     {
         BITMAPINFOHEADER* h = &bitmap_info.bmiHeader;
         h->biSize = sizeof(BITMAPINFOHEADER);
 
-        h->biWidth = emu->bitmap.w;
-        h->biHeight = -(emu->bitmap.h);
+        h->biWidth = renderer.bitmap.w;
+        h->biHeight = -(renderer.bitmap.h);
         h->biPlanes = 1;
         h->biBitCount = BPP * 8;
         h->biCompression = BI_RGB;
     }
 
-    emu->bitmap.data = (char*)VirtualAlloc(NULL, emu->bitmap.w * emu->bitmap.h * BPP, MEM_COMMIT, PAGE_READWRITE);
+    if (width > 0 && height > 0)
+    {
+        renderer.bitmap.data = (char*)VirtualAlloc(NULL, renderer.bitmap.w * renderer.bitmap.h * BPP,
+        MEM_COMMIT, PAGE_READWRITE);
+    }
 }
 
 
@@ -477,18 +753,63 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg,
         case WM_KEYDOWN:
         {
             int code = win32_keycode_to_emulator_keycode((int)wParam);
-            emu->SetKey(code, 1);
+            win32_queue_key(code, 1);
+
+            if (wParam == VK_BACK)
+            {
+                rewinding = true;
+            }
+            else if (wParam == VK_TAB)
+            {
+                win32_set_turbo(true);
+            }
         } break;
 
         case WM_KEYUP:
         {
             int code = win32_keycode_to_emulator_keycode((int)wParam);
-            emu->SetKey(code, 0);
+            win32_queue_key(code, 0);
 
             if (wParam == VK_RETURN)
             {
                 win32_set_emulator_state(!(emu->running));
             }
+            else if (wParam == VK_BACK)
+            {
+                rewinding = false;
+            }
+            else if (wParam == VK_TAB)
+            {
+                win32_set_turbo(false);
+            }
+            else if (wParam == VK_F5)
+            {
+                if (movie.recording)
+                {
+                    movie.StopRecording(emu);
+                    movie.SaveToFile(MOVIE_FILENAME);
+                    printf("INFO: Recording stopped. %d frames\n", movie.end_frame - movie.snapshots[0].frame);
+                }
+                else
+                {
+                    movie.StartRecording(emu);
+                    printf("INFO: Recording input\n");
+                }
+            }
+            else if (wParam == VK_F6)
+            {
+                if (movie.playing)
+                {
+                    movie.StopPlayback(emu);
+                }
+                else if (movie.recording == false)
+                {
+                    if (movie.LoadFromFile(MOVIE_FILENAME) && movie.StartPlayback(emu))
+                    {
+                        printf("INFO: Playing back '%ls'\n", MOVIE_FILENAME);
+                    }
+                }
+            }
         } break;
 
         case WM_SIZE:
@@ -498,8 +819,9 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg,
             int width = rect.right - rect.left;
             int height = rect.bottom - rect.top;
 
-            win32_resize_bitmap(width, height);
-            emu->should_draw_this_frame = true;
+            //The presenter owns the bitmap, it resizes it before drawing the next frame
+            present_size = ((uint32_t)width << 16) | (uint32_t)(height & 0xFFFF);
+            win32_request_repaint();
         } break;
 
         case WM_DESTROY:
@@ -511,7 +833,11 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg,
 
         case WM_PAINT:
         {
-            win32_draw_bitmap();
+            PAINTSTRUCT ps;
+            BeginPaint(window_handle, &ps);
+            EndPaint(window_handle, &ps);
+
+            win32_request_repaint();
         } break;
     }
 
@@ -553,7 +879,7 @@ LRESULT CALLBACK SettingsWindowProc(HWND hwnd, UINT uMsg,
 
             if (((code >= '0') && (code <= '9')) || ((code >= 'A') || (code <= 'Z')))
             {
-                emu->keymap[index] = code;
+                emu->BindKey(emu->keymap_profile, index, 0, code);
             }
             else
             {
@@ -645,114 +971,160 @@ static int win32_keycode_to_emulator_keycode(int code)
 }
 
 
-static void win32_fill_sound_buffer_with_square_wave()
+//Zeroes the DirectSound buffer and starts it looping. From then on the audio thread keeps it fed
+static void win32_start_audio()
 {
-    const int hz = 600;
-    const int square_wave_period = ds_audio_format.nSamplesPerSec / hz;
-    const int bytes_per_sample = ds_audio_format.wBitsPerSample / 8;
-    const int buffer_size = ds_buffer_desc.dwBufferBytes;
-    int16_t square_wave_volume = 200;
-    static uint32_t sample_index = 0;
+    if (ds_buffer == nullptr) return;
 
-    if (ds_buffer)
-    {
-        int err_code;
+    void* region1;
+    DWORD region1_size;
+    void* region2;
+    DWORD region2_size;
 
-        uint32_t write_cursor;
-        uint32_t play_cursor;
+    if (ds_buffer->Lock(0, 0, &region1, &region1_size, &region2, &region2_size, DSBLOCK_ENTIREBUFFER) == DS_OK)
+    {
+        memset(region1, 0, region1_size);
+        ds_buffer->Unlock(region1, region1_size, region2, region2_size);
+    }
 
-        err_code = ds_buffer->GetCurrentPosition((LPDWORD)&play_cursor, (LPDWORD)&write_cursor);
-//            printf("%u\n", play_cursor);
-        if (err_code == DS_OK)
-        {
-            char* region1;
-            unsigned long region1_size;
-            char* region2;
-            unsigned long region2_size;
+    ds_write_offset = 0;
+    ds_buffer->Play(0, 0, DSBPLAY_LOOPING);
 
-            uint32_t lock_start_byte = (sample_index * bytes_per_sample) % buffer_size;
-            uint32_t write_size = 0; //amount of bytes to write
+    AudioSink sink;
+    sink.write = win32_write_audio;
 
-            if (lock_start_byte > play_cursor)
-            {
-                write_size = (buffer_size - lock_start_byte) + play_cursor;
-            }
-            else
-            {
-                write_size = play_cursor - lock_start_byte;
-                if (write_size == 0)
-                {
-                    //edge case for when play_cursor is 0. fill an arbitrary "start" size
-                    write_size = bytes_per_sample;
-                }
-            }
+    audio.Init(ds_audio_format.nSamplesPerSec, AUDIO_DEFAULT_TONE_HZ, AUDIO_DEFAULT_VOLUME, true, sink);
+    emu->sound_events = &audio.events;
+    audio.Start();
+}
 
-            err_code = ds_buffer->Lock(lock_start_byte, write_size,
-            (void**)(&region1), &region1_size,
-            (void**)(&region2), &region2_size,
-            0);
 
-            if (err_code == DS_OK)
-            {
-                if (region1)
-                {
-                    int16_t* sample = (int16_t*)region1;
-                    int sample_count = region1_size / bytes_per_sample;
+static void win32_stop_audio()
+{
+    audio.Stop();
+    emu->sound_events = nullptr;
 
-                    for (int i = 0; i < sample_count; i++)
-                    {
-                        int16_t sample_val = square_wave_volume;
-                        if (((sample_index / (square_wave_period / 2)) % 2) == 0)
-                        {
-                            sample_val = -sample_val;
-                        }
-
-                        *sample = sample_val;
-                        sample++;
-                        sample_index++;
-                    }
-                }
+    if (ds_buffer)
+    {
+        ds_buffer->Stop();
+    }
+}
 
-                if (region2)
-                {
-                    int16_t* sample = (int16_t*)region2;
-                    int sample_count = region2_size / bytes_per_sample;
 
-                    for (int i = 0; i < sample_count; i++)
-                    {
-                        int16_t sample_val = square_wave_volume;
-                        if (((sample_index / (square_wave_period / 2)) % 2) == 0)
-                        {
-                            sample_val = -sample_val;
-                        }
-
-                        *sample = sample_val;
-                        sample++;
-                        sample_index++;
-                    }
-                }
+//AudioSink::write for the DirectSound buffer. Runs on the audio thread. Waits until the play cursor is less than
+//AUDIO_QUEUED_BLOCKS blocks behind, which is what paces the audio thread, then copies the block in
+static void win32_write_audio(void* /*context*/, const int16_t* samples, int count)
+{
+    const uint32_t buffer_size = ds_buffer_desc.dwBufferBytes;
+    const uint32_t block_bytes = count * sizeof(int16_t);
+    const uint32_t max_queued = AUDIO_BLOCK_SIZE * sizeof(int16_t) * AUDIO_QUEUED_BLOCKS;
 
-                err_code = ds_buffer->Unlock(region1, region1_size, region2, region2_size);
+    while (audio.running)
+    {
+        DWORD play_cursor;
+        DWORD write_cursor;
+        HRESULT err_code = ds_buffer->GetCurrentPosition(&play_cursor, &write_cursor);
+        if (err_code != DS_OK)
+        {
+            printf("Getting sound buffer cursors failed, Code: %x\n", err_code);
+            return;
+        }
 
-                if (err_code != DS_OK)
-                {
-                    printf("Unlocking sound buffer failed. Code: %x\n", err_code);
-                    assert(false);
-                }
-            }
-            else
-            {
-                printf("Locking sound buffer failed, Code: %x\n", err_code);
-                assert(false);
-            }
+        uint32_t queued = (ds_write_offset + buffer_size - play_cursor) % buffer_size;
+        if (queued > (buffer_size / 2))
+        {
+            //The play cursor overtook us. Start over right after where it's safe to write
+            ds_write_offset = write_cursor;
+            queued = 0;
         }
-        else
+
+        if ((queued + block_bytes) <= max_queued)
         {
-            printf("Getting sound buffer cursors failed, Code: %x\n", err_code);
-            assert(false);
+            break;
         }
+
+        Sleep(1);
+    }
+
+    void* region1;
+    DWORD region1_size;
+    void* region2;
+    DWORD region2_size;
+
+    HRESULT err_code = ds_buffer->Lock(ds_write_offset, block_bytes,
+    &region1, &region1_size,
+    &region2, &region2_size,
+    0);
+
+    if (err_code != DS_OK)
+    {
+        printf("Locking sound buffer failed, Code: %x\n", err_code);
+        return;
+    }
+
+    memcpy(region1, samples, region1_size);
+    if (region2)
+    {
+        memcpy(region2, (const char*)samples + region1_size, region2_size);
+    }
+
+    ds_buffer->Unlock(region1, region1_size, region2, region2_size);
+    ds_write_offset = (ds_write_offset + block_bytes) % buffer_size;
+}
+
+
+//Runs frames until the slice's time is up. Only the state at the end of the slice is published
+static void win32_run_turbo_frames()
+{
+    DWORD start = timeGetTime();
+    int frame_count = 0;
+
+    //Emulated time runs far ahead of the host clock. Take input as soon as it's there
+    emu->input_time_start = 0;
+    emu->input_time_end = 0;
+    input_window_end = FrameScheduler::Now();
+
+    do
+    {
+        movie.OnFrame(emu);
+        emu->Update();
+        rewind_history.Record(emu);
+        emu->LateUpdate();
+        frame_count++;
+    } while (emu->running && (timeGetTime() - start) < SKIP_TICKS);
+
+    turbo_report_frames += frame_count;
+    DWORD now = timeGetTime();
+    if ((now - turbo_report_time) >= 1000)
+    {
+        double fps = (turbo_report_frames * 1000.0) / (now - turbo_report_time);
+
+        wchar_t title[64] = {0};
+        swprintf(title, sizeof(title) / sizeof(wchar_t), L"CHIP-8 - turbo %.0f fps (%.1fx)",
+        fps, fps / TICKS_PER_SECOND);
+        SetWindowText(window_handle, title);
+
+        turbo_report_time = now;
+        turbo_report_frames = 0;
     }
+}
+
 
+static void win32_set_turbo(bool new_turbo)
+{
+    if (turbo == new_turbo)
+    {
+        return;
+    }
+
+    turbo = new_turbo;
+    turbo_report_time = timeGetTime();
+    turbo_report_frames = 0;
+
+    if (turbo == false)
+    {
+        SetWindowText(window_handle, L"CHIP-8");
+    }
 }
 
 
@@ -760,7 +1132,7 @@ static void win32_fill_sound_buffer_with_square_wave()
 static void win32_set_emulator_state(bool new_running)
 {
     emulator_prev_running = emu->running;
-    emu->running = new_running;
+    emu->SetRunning(new_running);
     if ((emu->running == false) && (emulator_prev_running != false))
     {
         std::string text = "PAUSED";
@@ -769,7 +1141,7 @@ static void win32_set_emulator_state(bool new_running)
     }
     else if (emu->running == true)
     {
-        win32_draw_bitmap(); //To clear over the text
+        win32_request_repaint(); //To clear over the text
     }
 }
 
@@ -821,7 +1193,7 @@ static void win32_create_hotkey_control(HWND parent, int index, int x, int y, in
     }
 
     //Set default hotkey from keymap
-    DWORD w_param = emu->keymap[index];
+    DWORD w_param = emu->KeyBinding(index, 0);
     SendMessage(*hotkey, HKM_SETHOTKEY, w_param, 0);
 }
 
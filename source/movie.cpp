@@ -0,0 +1,339 @@
+#include "movie.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+
+
+void Movie::StartRecording(Emulator* emu)
+{
+    StopPlayback(emu);
+
+    seed = emu->random_seed;
+    end_frame = emu->tic;
+    input_slices = emu->input_slices;
+    events.clear();
+    snapshots.clear();
+
+    TakeSnapshot(emu);
+    AddEvent(emu->tic, 0, MOVIE_KEY_RUNNING, emu->running ? 1 : 0);
+
+    recording = true;
+    emu->input_hooks.context = this;
+    emu->input_hooks.play = nullptr;
+    emu->input_hooks.record = Record;
+}
+
+
+void Movie::StopRecording(Emulator* emu)
+{
+    if (recording == false) return;
+
+    end_frame = emu->tic;
+    recording = false;
+    emu->input_hooks = InputHooks();
+}
+
+
+bool Movie::StartPlayback(Emulator* emu)
+{
+    StopRecording(emu);
+
+    if (snapshots.empty()) return false;
+
+    const MovieSnapshot& first = snapshots[0];
+    if (emu->LoadState(first.state.data(), (int)first.state.size()) == false) return false;
+
+    next_event = first.event_index;
+    emu->input_slices = input_slices;
+    playing = true;
+    emu->input_hooks.context = this;
+    emu->input_hooks.play = Play;
+    emu->input_hooks.record = nullptr;
+
+    return true;
+}
+
+
+void Movie::StopPlayback(Emulator* emu)
+{
+    if (playing == false) return;
+
+    playing = false;
+    emu->input_hooks = InputHooks();
+}
+
+
+void Movie::OnFrame(Emulator* emu)
+{
+    if (recording)
+    {
+        if (emu->tic >= (snapshots.back().frame + snapshot_interval))
+        {
+            TakeSnapshot(emu);
+        }
+    }
+    else if (playing)
+    {
+        if (emu->tic >= end_frame)
+        {
+            StopPlayback(emu);
+            return;
+        }
+
+        ApplyEvents(emu, emu->tic, 0);
+    }
+}
+
+
+void Movie::ApplyEvents(Emulator* emu, int frame, int slice)
+{
+    while (next_event < events.size())
+    {
+        const MovieEvent& event = events[next_event];
+        if ((event.frame > frame) || ((event.frame == frame) && (event.slice > slice)))
+        {
+            break;
+        }
+
+        if (event.key == MOVIE_KEY_RUNNING)
+        {
+            emu->running = (event.state != 0);
+        }
+        else
+        {
+            emu->SetKeypadKey(event.key, event.state);
+        }
+        next_event++;
+    }
+}
+
+
+bool Movie::Seek(Emulator* emu, int frame)
+{
+    if (playing == false) return false;
+    if (snapshots.empty() || (frame < snapshots[0].frame) || (frame > end_frame)) return false;
+
+    //Snapshots are in frame order. OnFrame takes them at the start of their frame, before DrainInput applies
+    //that frame's key changes, and event_index is the first change still to apply. Start from the last one
+    //before the frame and run forward
+    size_t index = 0;
+    while (((index + 1) < snapshots.size()) && (snapshots[index + 1].frame < frame))
+    {
+        index++;
+    }
+
+    const MovieSnapshot& snapshot = snapshots[index];
+    if (emu->LoadState(snapshot.state.data(), (int)snapshot.state.size()) == false) return false;
+    next_event = snapshot.event_index;
+
+    //Save states don't hold whether the emulator was paused. The last pause change before the snapshot does
+    for (size_t i = snapshot.event_index; i > 0; i--)
+    {
+        if (events[i - 1].key == MOVIE_KEY_RUNNING)
+        {
+            emu->running = (events[i - 1].state != 0);
+            break;
+        }
+    }
+
+    //Run the rest without drawing
+    bool defer_draw = emu->defer_draw;
+    emu->defer_draw = true;
+
+    while (playing && (emu->tic < frame))
+    {
+        OnFrame(emu);
+        emu->Update();
+        emu->LateUpdate();
+    }
+
+    emu->defer_draw = defer_draw;
+    emu->InvalidateDisplay();
+    emu->should_draw_this_frame = true;
+
+    return true;
+}
+
+
+void Movie::Play(void* context, Emulator* emu, int frame, int slice)
+{
+    ((Movie*)context)->ApplyEvents(emu, frame, slice);
+}
+
+
+void Movie::Record(void* context, int frame, int slice, int key, int state)
+{
+    ((Movie*)context)->AddEvent(frame, slice, key, state);
+}
+
+
+void Movie::AddEvent(int frame, int slice, int key, int state)
+{
+    MovieEvent event;
+    event.frame = frame;
+    event.slice = (uint8_t)slice;
+    event.key = (uint8_t)key;
+    event.state = (uint8_t)state;
+
+    events.push_back(event);
+}
+
+
+void Movie::TakeSnapshot(const Emulator* emu)
+{
+    MovieSnapshot snapshot;
+    snapshot.frame = emu->tic;
+    snapshot.event_index = (uint32_t)events.size();
+    emu->SaveState(&snapshot.state);
+
+    snapshots.push_back(snapshot);
+}
+
+
+//Bytes in the file before the events, per event and per snapshot. See SaveToFile
+static const int MOVIE_HEADER_SIZE = 4 + 2 + 2 + 8 + 4 + 4 + 4 + 4;
+static const int MOVIE_EVENT_SIZE = 4 + 1 + 1 + 1;
+static const int MOVIE_SNAPSHOT_SIZE = 4 + 4 + SAVE_STATE_SIZE;
+
+
+//File layout, host byte order:
+//magic, version, input slices u16, seed u64, end frame, snapshot interval, event count, snapshot count,
+//then the events (frame i32, slice u8, key u8, state u8) and the snapshots (frame i32, event index u32, save state)
+bool Movie::SaveToFile(const wchar_t* filename) const
+{
+    std::ofstream file(std::filesystem::path(filename), std::ios::binary);
+    if (file.good() == false)
+    {
+        printf("Saving movie to '%ls' failed.\n", filename);
+        return false;
+    }
+
+    uint16_t slices = (uint16_t)input_slices;
+    int32_t frame = end_frame;
+    int32_t interval = snapshot_interval;
+    uint32_t event_count = (uint32_t)events.size();
+    uint32_t snapshot_count = (uint32_t)snapshots.size();
+
+    file.write((const char*)&MOVIE_MAGIC, 4);
+    file.write((const char*)&MOVIE_VERSION, 2);
+    file.write((const char*)&slices, 2);
+    file.write((const char*)&seed, 8);
+    file.write((const char*)&frame, 4);
+    file.write((const char*)&interval, 4);
+    file.write((const char*)&event_count, 4);
+    file.write((const char*)&snapshot_count, 4);
+
+    for (const MovieEvent& event : events)
+    {
+        file.write((const char*)&event.frame, 4);
+        file.write((const char*)&event.slice, 1);
+        file.write((const char*)&event.key, 1);
+        file.write((const char*)&event.state, 1);
+    }
+
+    for (const MovieSnapshot& snapshot : snapshots)
+    {
+        file.write((const char*)&snapshot.frame, 4);
+        file.write((const char*)&snapshot.event_index, 4);
+        file.write((const char*)snapshot.state.data(), SAVE_STATE_SIZE);
+    }
+
+    if (file.good() == false)
+    {
+        printf("Saving movie to '%ls' failed.\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool Movie::LoadFromFile(const wchar_t* filename)
+{
+    std::filesystem::path path = filename;
+    std::ifstream file(path, std::ios::binary);
+
+    std::error_code error;
+    uintmax_t filesize = std::filesystem::file_size(path, error);
+    if (error)
+    {
+        filesize = 0;
+    }
+
+    uint32_t magic = 0;
+    uint16_t version = 0;
+    uint16_t slices = 0;
+    uint64_t new_seed = 0;
+    int32_t frame = 0;
+    int32_t interval = 0;
+    uint32_t event_count = 0;
+    uint32_t snapshot_count = 0;
+
+    file.read((char*)&magic, 4);
+    file.read((char*)&version, 2);
+    file.read((char*)&slices, 2);
+    file.read((char*)&new_seed, 8);
+    file.read((char*)&frame, 4);
+    file.read((char*)&interval, 4);
+    file.read((char*)&event_count, 4);
+    file.read((char*)&snapshot_count, 4);
+
+    if ((file.good() == false) || (magic != MOVIE_MAGIC) || (version != MOVIE_VERSION) || (snapshot_count == 0) ||
+    (slices == 0))
+    {
+        printf("Loading movie from '%ls' failed.\n", filename);
+        return false;
+    }
+
+    //The counts come from the file. Check they fit in it before allocating anything for them
+    uint64_t body_size = ((uint64_t)event_count * MOVIE_EVENT_SIZE) + ((uint64_t)snapshot_count * MOVIE_SNAPSHOT_SIZE);
+    if ((filesize < MOVIE_HEADER_SIZE) || (body_size > (filesize - MOVIE_HEADER_SIZE)))
+    {
+        printf("Loading movie from '%ls' failed. The file is damaged.\n", filename);
+        return false;
+    }
+
+    std::vector<MovieEvent> new_events(event_count);
+    for (MovieEvent& event : new_events)
+    {
+        file.read((char*)&event.frame, 4);
+        file.read((char*)&event.slice, 1);
+        file.read((char*)&event.key, 1);
+        file.read((char*)&event.state, 1);
+
+        bool valid_key = (event.key < EMULATOR_KEY_COUNT) || (event.key == MOVIE_KEY_RUNNING);
+        if ((valid_key == false) || (event.slice >= slices)) file.setstate(std::ios::failbit);
+    }
+
+    std::vector<MovieSnapshot> new_snapshots(snapshot_count);
+    for (MovieSnapshot& snapshot : new_snapshots)
+    {
+        snapshot.state.resize(SAVE_STATE_SIZE);
+        file.read((char*)&snapshot.frame, 4);
+        file.read((char*)&snapshot.event_index, 4);
+        file.read((char*)snapshot.state.data(), SAVE_STATE_SIZE);
+
+        if (snapshot.event_index > event_count) file.setstate(std::ios::failbit);
+    }
+
+    if (file.good() == false)
+    {
+        printf("Loading movie from '%ls' failed. The file is damaged.\n", filename);
+        return false;
+    }
+
+    seed = new_seed;
+    end_frame = frame;
+    snapshot_interval = interval;
+    input_slices = slices;
+    events.swap(new_events);
+    snapshots.swap(new_snapshots);
+
+    recording = false;
+    playing = false;
+    next_event = 0;
+
+    return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "emulator.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+//Input movies. Every keypad change is stored with the frame (Emulator::tic) and input slice it happened on.
+//Playing one back from its first snapshot reproduces the run bit for bit at any speed,
+//since the snapshot holds the random generator state too
+const uint32_t MOVIE_MAGIC = 0x564D3843; //"C8MV"
+const uint16_t MOVIE_VERSION = 2;
+
+const int MOVIE_DEFAULT_SNAPSHOT_INTERVAL = 600; //every 10 seconds. Seeking runs at most this many frames
+
+//An event with this key pauses (state 0) or resumes (state 1) the emulator instead of changing a keypad key.
+//Paused frames still count, so a pause has to replay where it happened. See Emulator::SetRunning
+const uint8_t MOVIE_KEY_RUNNING = EMULATOR_INPUT_RUNNING;
+
+struct MovieEvent
+{
+    int32_t frame = 0;
+    uint8_t slice = 0; //see Emulator::input_slices. 0 is before any of the frame's instructions
+    uint8_t key = 0;
+    uint8_t state = 0;
+};
+
+struct MovieSnapshot
+{
+    int32_t frame = 0;
+    uint32_t event_index = 0; //events before this one are already part of the state
+    std::vector<uint8_t> state;
+};
+
+
+struct Movie
+{
+    uint64_t seed = 0; //the emulator's seed when recording started
+    int end_frame = 0;
+    int snapshot_interval = MOVIE_DEFAULT_SNAPSHOT_INTERVAL;
+    int input_slices = 1; //the emulator's when recording started. Playback uses the same so events land the same
+
+    std::vector<MovieEvent> events;
+    std::vector<MovieSnapshot> snapshots; //the first one is where the movie starts
+
+    bool recording = false;
+    bool playing = false;
+    size_t next_event = 0; //playback position
+
+    //Attaches to the emulator's input hooks. The movie has to outlive the recording/playback.
+    //The first event is whether the emulator was paused, since save states don't hold it
+    void StartRecording(Emulator* emu);
+    void StopRecording(Emulator* emu);
+
+    //Loads the first snapshot and starts feeding the keypad
+    bool StartPlayback(Emulator* emu);
+    void StopPlayback(Emulator* emu);
+
+    //Call before every Emulator::Update. Takes the periodic snapshots while recording and
+    //applies this frame's slice 0 key changes while playing
+    void OnFrame(Emulator* emu);
+
+    //Applies every event up to and including this frame's slice. The emulator calls it through its input hooks while playing
+    void ApplyEvents(Emulator* emu, int frame, int slice);
+
+    //Jumps to any frame of the movie while playing. Loads the closest snapshot before it and runs the rest.
+    //Nothing is drawn while running, the display is invalidated instead
+    bool Seek(Emulator* emu, int frame);
+
+    void AddEvent(int frame, int slice, int key, int state);
+    void TakeSnapshot(const Emulator* emu);
+
+    //InputHooks entry points. context is the movie
+    static void Play(void* context, Emulator* emu, int frame, int slice);
+    static void Record(void* context, int frame, int slice, int key, int state);
+
+    bool SaveToFile(const wchar_t* filename) const;
+    bool LoadFromFile(const wchar_t* filename);
+};
@@ -0,0 +1,321 @@
+#include "rewind.hpp"
+
+#include <assert.h>
+#include <string.h>
+
+const uint32_t REWIND_WRAP = 0xFFFFFFFF;
+
+//Zero runs shorter than this stay in the literal run. Keeps alternating bytes from doubling in size
+const int REWIND_MIN_ZERO_RUN = 4;
+
+static const uint8_t rewind_zero_state[SAVE_STATE_SIZE] = {0};
+
+
+//Encodes state ^ base as chunks of [uint16_t zero run][uint16_t literal count][literals].
+//Returns the encoded size. Never more than REWIND_MAX_RECORD_SIZE - 4
+static int rewind_encode(const uint8_t* state, const uint8_t* base, uint8_t* out)
+{
+    int size = 0;
+    int i = 0;
+
+    while (i < SAVE_STATE_SIZE)
+    {
+        //Unchanged bytes. 8 at a time while possible
+        int zero_start = i;
+        while ((i + 8) <= SAVE_STATE_SIZE)
+        {
+            uint64_t a, b;
+            memcpy(&a, state + i, 8);
+            memcpy(&b, base + i, 8);
+            if (a != b) break;
+            i += 8;
+        }
+        while ((i < SAVE_STATE_SIZE) && (state[i] == base[i]))
+        {
+            i++;
+        }
+        int zero_run = i - zero_start;
+
+        //Changed bytes, up to the next long enough zero run
+        int literal_start = i;
+        while (i < SAVE_STATE_SIZE)
+        {
+            if (state[i] != base[i])
+            {
+                i++;
+                continue;
+            }
+
+            int zero_end = i;
+            while ((zero_end < SAVE_STATE_SIZE) && (state[zero_end] == base[zero_end]) &&
+                ((zero_end - i) < REWIND_MIN_ZERO_RUN))
+            {
+                zero_end++;
+            }
+
+            if (((zero_end - i) >= REWIND_MIN_ZERO_RUN) || (zero_end == SAVE_STATE_SIZE)) break;
+            i = zero_end;
+        }
+        int literal_count = i - literal_start;
+
+        uint16_t header[2] = {(uint16_t)zero_run, (uint16_t)literal_count};
+        memcpy(out + size, header, 4);
+        size += 4;
+
+        for (int j = 0; j < literal_count; j++)
+        {
+            out[size + j] = state[literal_start + j] ^ base[literal_start + j];
+        }
+        size += literal_count;
+    }
+
+    return size;
+}
+
+
+//XORs an encoded delta into state
+static void rewind_decode(const uint8_t* in, int size, uint8_t* state)
+{
+    int read = 0;
+    int offset = 0;
+
+    while (read < size)
+    {
+        uint16_t header[2];
+        memcpy(header, in + read, 4);
+        read += 4;
+
+        offset += header[0];
+        for (int j = 0; j < header[1]; j++)
+        {
+            state[offset + j] ^= in[read + j];
+        }
+
+        offset += header[1];
+        read += header[1];
+    }
+
+    assert(offset <= SAVE_STATE_SIZE);
+}
+
+
+void Rewind::Init(int buffer_size, int new_keyframe_interval)
+{
+    keyframe_interval = (new_keyframe_interval > 0) ? new_keyframe_interval : 1;
+
+    int min_size = 2 * (keyframe_interval + 1) * REWIND_MAX_RECORD_SIZE;
+    if (buffer_size < min_size)
+    {
+        buffer_size = min_size;
+    }
+
+    buffer.assign(buffer_size, 0);
+
+    //Worst case every group is as small as it can get (keyframe_interval 4 byte records)
+    groups.resize((buffer_size / (keyframe_interval * 4)) + 2);
+
+    keyframe_state.resize(SAVE_STATE_SIZE);
+    frame_state.resize(SAVE_STATE_SIZE);
+    record.resize(REWIND_MAX_RECORD_SIZE);
+
+    Clear();
+}
+
+
+void Rewind::Clear()
+{
+    head = 0;
+    oldest_group = 0;
+    group_count = 0;
+    next_frame = 0;
+}
+
+
+int Rewind::FrameCount() const
+{
+    if (group_count == 0) return 0;
+
+    return next_frame - groups[oldest_group].first_frame;
+}
+
+
+size_t Rewind::MemoryUsed() const
+{
+    if (group_count == 0) return 0;
+
+    uint32_t tail = groups[oldest_group].offset;
+    if (tail < head) return head - tail;
+
+    return (buffer.size() - tail) + head;
+}
+
+
+uint32_t Rewind::NextRecord(uint32_t offset) const
+{
+    uint32_t size;
+    memcpy(&size, buffer.data() + offset, 4);
+
+    offset += 4 + size;
+    if ((offset + 4) > buffer.size()) return 0;
+
+    uint32_t next_size;
+    memcpy(&next_size, buffer.data() + offset, 4);
+    if (next_size == REWIND_WRAP) return 0;
+
+    return offset;
+}
+
+
+void Rewind::EvictOldestGroup()
+{
+    oldest_group = (oldest_group + 1) % (int)groups.size();
+    group_count--;
+}
+
+
+//Evicts the oldest groups until size bytes starting at head are free. Wraps head if they don't fit before the end
+void Rewind::MakeRoom(uint32_t size)
+{
+    if ((head + size) > buffer.size())
+    {
+        //The rest of the ring is skipped. It has to be free too, since the mark goes there
+        MakeRoom((uint32_t)buffer.size() - head);
+
+        if ((head + 4) <= buffer.size())
+        {
+            memcpy(buffer.data() + head, &REWIND_WRAP, 4);
+        }
+        head = 0;
+    }
+
+    while (group_count > 0)
+    {
+        uint32_t tail = groups[oldest_group].offset;
+
+        //Live data is behind head and wraps into the region in front of it
+        bool overlaps = (tail > head) ? ((head + size) > tail) : (tail == head);
+        if (overlaps == false) break;
+
+        assert(group_count > 1); //Init makes the ring big enough for two groups
+        EvictOldestGroup();
+    }
+}
+
+
+void Rewind::Record(const Emulator* emu)
+{
+    if (buffer.empty()) return;
+
+    emu->SaveState(frame_state.data(), SAVE_STATE_SIZE);
+
+    RewindGroup* newest = NULL;
+    if (group_count > 0)
+    {
+        newest = &(groups[(oldest_group + group_count - 1) % (int)groups.size()]);
+    }
+
+    bool keyframe = (newest == NULL) || (newest->frame_count >= keyframe_interval);
+
+    const uint8_t* base = keyframe ? rewind_zero_state : keyframe_state.data();
+    uint32_t size = (uint32_t)rewind_encode(frame_state.data(), base, record.data());
+
+    MakeRoom(4 + size);
+
+    if (keyframe)
+    {
+        if (group_count == (int)groups.size())
+        {
+            EvictOldestGroup();
+        }
+
+        newest = &(groups[(oldest_group + group_count) % (int)groups.size()]);
+        newest->offset = head;
+        newest->first_frame = next_frame;
+        newest->frame_count = 0;
+        group_count++;
+
+        memcpy(keyframe_state.data(), frame_state.data(), SAVE_STATE_SIZE);
+    }
+    else if (group_count == 0)
+    {
+        //MakeRoom evicted the group this delta belongs to. Can't happen with the minimum ring size
+        return;
+    }
+
+    memcpy(buffer.data() + head, &size, 4);
+    memcpy(buffer.data() + head + 4, record.data(), size);
+    head += 4 + size;
+
+    newest->frame_count++;
+    next_frame++;
+}
+
+
+bool Rewind::DecodeFrame(int frame, uint8_t* state)
+{
+    if (group_count == 0) return false;
+
+    const RewindGroup& oldest = groups[oldest_group];
+    if ((frame < oldest.first_frame) || (frame >= next_frame)) return false;
+
+    int group_index = (frame - oldest.first_frame) / keyframe_interval;
+    const RewindGroup& group = groups[(oldest_group + group_index) % (int)groups.size()];
+
+    uint32_t size;
+    uint32_t offset = group.offset;
+
+    memset(state, 0, SAVE_STATE_SIZE);
+    memcpy(&size, buffer.data() + offset, 4);
+    rewind_decode(buffer.data() + offset + 4, (int)size, state);
+
+    if (frame == group.first_frame) return true;
+
+    //Hop over the deltas in between. Only their sizes are read
+    for (int i = group.first_frame; i < frame; i++)
+    {
+        offset = NextRecord(offset);
+    }
+
+    memcpy(&size, buffer.data() + offset, 4);
+    rewind_decode(buffer.data() + offset + 4, (int)size, state);
+
+    return true;
+}
+
+
+bool Rewind::Restore(Emulator* emu, int frames_back)
+{
+    if (DecodeFrame((next_frame - 1) - frames_back, frame_state.data()) == false) return false;
+
+    return emu->LoadState(frame_state.data(), SAVE_STATE_SIZE);
+}
+
+
+bool Rewind::StepBack(Emulator* emu)
+{
+    if (FrameCount() < 2) return false;
+
+    RewindGroup* newest = &(groups[(oldest_group + group_count - 1) % (int)groups.size()]);
+
+    //Find the newest record so head can move back over it
+    uint32_t offset = newest->offset;
+    for (int i = 1; i < newest->frame_count; i++)
+    {
+        offset = NextRecord(offset);
+    }
+
+    head = offset;
+    newest->frame_count--;
+    next_frame--;
+
+    if (newest->frame_count == 0)
+    {
+        group_count--;
+
+        //New deltas go against the now newest group's keyframe
+        newest = &(groups[(oldest_group + group_count - 1) % (int)groups.size()]);
+        DecodeFrame(newest->first_frame, keyframe_state.data());
+    }
+
+    return Restore(emu, 0);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "emulator.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+//Rewind history. Every frame's save state is stored as the XOR against the last keyframe with the zero runs
+//squeezed out, so a frame usually costs a few dozen bytes. Any frame is rebuilt from its keyframe and its own
+//delta, so going back never takes longer than two decodes no matter how far back it is
+const int REWIND_DEFAULT_BUFFER_SIZE = 8 * 1024 * 1024;
+const int REWIND_DEFAULT_KEYFRAME_INTERVAL = 60; //one second
+
+//Worst case size of an encoded frame. See rewind_encode
+const int REWIND_MAX_RECORD_SIZE = 4 + (SAVE_STATE_SIZE * 2) + 4;
+
+//A keyframe and the deltas recorded against it. They are evicted together
+struct RewindGroup
+{
+    uint32_t offset = 0; //of the keyframe record in the ring
+    int first_frame = 0;
+    int frame_count = 0;
+};
+
+
+struct Rewind
+{
+    //Ring of records. Each one is a uint32_t size followed by the encoded frame.
+    //A size of REWIND_WRAP (or no room left for a size) means the next record is at the start of the ring
+    std::vector<uint8_t> buffer;
+    uint32_t head = 0; //where the next record goes
+
+    //Ring of groups, oldest first. Every group except the newest holds exactly keyframe_interval frames
+    std::vector<RewindGroup> groups;
+    int oldest_group = 0;
+    int group_count = 0;
+
+    int keyframe_interval = REWIND_DEFAULT_KEYFRAME_INTERVAL;
+    int next_frame = 0; //numbering of recorded frames. Not the emulator's tic
+
+    //Scratch space. Allocated once by Init so recording and stepping never allocate
+    std::vector<uint8_t> keyframe_state; //the newest group's keyframe, decoded
+    std::vector<uint8_t> frame_state;
+    std::vector<uint8_t> record;
+
+    //The buffer is grown to fit at least two full groups of worst case frames
+    void Init(int buffer_size, int new_keyframe_interval);
+    void Clear();
+
+    //Call once per emulated frame, after Update
+    void Record(const Emulator* emu);
+
+    int FrameCount() const;
+    size_t MemoryUsed() const; //bytes of the ring holding frames
+
+    //Loads the frame frames_back frames before the newest one (0 is the newest). Doesn't change the history
+    bool Restore(Emulator* emu, int frames_back);
+
+    //Drops the newest frame and loads the one before it. For holding a rewind key
+    bool StepBack(Emulator* emu);
+
+    //Internal
+    bool DecodeFrame(int frame, uint8_t* state);
+    uint32_t NextRecord(uint32_t offset) const;
+    void MakeRoom(uint32_t size);
+    void EvictOldestGroup();
+};
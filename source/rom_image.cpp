@@ -0,0 +1,233 @@
+#include "emulator.hpp"
+
+#include <filesystem>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+const char* rom_error_string(int error)
+{
+    switch (error)
+    {
+        case ROM_OK: return "No error.";
+        case ROM_ERROR_OPEN: return "The file couldn't be opened.";
+        case ROM_ERROR_READ: return "The file couldn't be read.";
+        case ROM_ERROR_EMPTY: return "The ROM is empty.";
+        case ROM_ERROR_TOO_BIG: return "The ROM is too big to fit in memory.";
+    }
+
+    return "Unknown error.";
+}
+
+
+int rom_check_size(long long size, int memory_size)
+{
+    if (size <= 0) return ROM_ERROR_EMPTY;
+    if (size > (memory_size - EMULATOR_PROGRAM_ADDRESS)) return ROM_ERROR_TOO_BIG;
+
+    return ROM_OK;
+}
+
+
+//The font is in, the program is left to the caller
+static std::shared_ptr<RomImage> rom_image_new(int program_size)
+{
+    std::shared_ptr<RomImage> image = std::make_shared<RomImage>();
+    memcpy(image->memory.data() + FONT_ADDRESS, font_data, sizeof(font_data));
+    image->program_size = program_size;
+
+    return image;
+}
+
+
+//Run after the program is in. Emulators only ever read the decoded instructions, so this is done once here
+static void rom_image_decode(RomImage* image)
+{
+    const DecodedOp* table = decode_table();
+    for (int address = 0; address < EMULATOR_RAM_SIZE; address++)
+    {
+        //The emulator doesn't run the last two addresses and expects them OP_UNDECODED
+        if (((address % EMULATOR_PAGE_SIZE) == (EMULATOR_PAGE_SIZE - 1)) || (address >= (EMULATOR_RAM_SIZE - 2)))
+        {
+            image->decoded[address] = DecodedOp();
+            continue;
+        }
+
+        uint16_t instruction = (image->memory[address] << 8) | image->memory[address + 1];
+        image->decoded[address] = table[instruction];
+    }
+}
+
+
+static std::shared_ptr<const RomImage> rom_image_failed(int* error, int reason)
+{
+    if (error)
+    {
+        *error = reason;
+    }
+
+    return nullptr;
+}
+
+
+std::shared_ptr<const RomImage> rom_image_from_buffer(const uint8_t* data, int size, int* error)
+{
+    int result = rom_check_size(size, EMULATOR_RAM_SIZE);
+    if (result != ROM_OK) return rom_image_failed(error, result);
+
+    std::shared_ptr<RomImage> image = rom_image_new(size);
+    memcpy(image->memory.data() + EMULATOR_PROGRAM_ADDRESS, data, size);
+    rom_image_decode(image.get());
+
+    if (error)
+    {
+        *error = ROM_OK;
+    }
+    return image;
+}
+
+
+//The size is checked before anything is read, then the file is read straight into the image.
+//ROMs are a few KB, so one read is cheaper than mapping the file
+static std::shared_ptr<const RomImage> rom_image_from_path(const std::filesystem::path& path, int* error)
+{
+    std::shared_ptr<RomImage> image;
+    int result = ROM_OK;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return rom_image_failed(error, ROM_ERROR_OPEN);
+
+    LARGE_INTEGER filesize;
+    if (GetFileSizeEx(file, &filesize) == FALSE)
+    {
+        result = ROM_ERROR_READ;
+    }
+    else
+    {
+        result = rom_check_size(filesize.QuadPart, EMULATOR_RAM_SIZE);
+    }
+
+    if (result == ROM_OK)
+    {
+        image = rom_image_new((int)filesize.QuadPart);
+
+        DWORD read_size = 0;
+        if ((ReadFile(file, image->memory.data() + EMULATOR_PROGRAM_ADDRESS, (DWORD)image->program_size, &read_size,
+            NULL) == FALSE) || ((int)read_size != image->program_size))
+        {
+            result = ROM_ERROR_READ;
+        }
+    }
+
+    CloseHandle(file);
+#else
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0) return rom_image_failed(error, ROM_ERROR_OPEN);
+
+    struct stat info;
+    if ((fstat(file, &info) != 0) || (S_ISREG(info.st_mode) == false))
+    {
+        result = ROM_ERROR_OPEN;
+    }
+    else
+    {
+        result = rom_check_size(info.st_size, EMULATOR_RAM_SIZE);
+    }
+
+    if (result == ROM_OK)
+    {
+        image = rom_image_new((int)info.st_size);
+
+        //read can come back short, a signal or a file that shrank since fstat
+        uint8_t* cursor = image->memory.data() + EMULATOR_PROGRAM_ADDRESS;
+        int remaining = image->program_size;
+        while (remaining > 0)
+        {
+            ssize_t read_size = read(file, cursor, remaining);
+            if ((read_size < 0) && (errno == EINTR)) continue;
+            if (read_size <= 0)
+            {
+                result = ROM_ERROR_READ;
+                break;
+            }
+
+            cursor += read_size;
+            remaining -= (int)read_size;
+        }
+    }
+
+    close(file);
+#endif
+
+    if (result != ROM_OK) return rom_image_failed(error, result);
+
+    rom_image_decode(image.get());
+
+    if (error)
+    {
+        *error = ROM_OK;
+    }
+    return image;
+}
+
+
+std::shared_ptr<const RomImage> rom_image_from_file(const char* filename, int* error)
+{
+    return rom_image_from_path(std::filesystem::path(filename), error);
+}
+
+
+std::shared_ptr<const RomImage> rom_image_from_file(const wchar_t* filename, int* error)
+{
+    return rom_image_from_path(std::filesystem::path(filename), error);
+}
+
+
+static std::shared_ptr<const RomImage> rom_image_new_blank()
+{
+    std::shared_ptr<RomImage> image = rom_image_new(0);
+    rom_image_decode(image.get());
+
+    return image;
+}
+
+
+std::shared_ptr<const RomImage> rom_image_blank()
+{
+    static const std::shared_ptr<const RomImage> blank = rom_image_new_blank();
+    return blank;
+}
+
+
+std::array<const uint8_t*, EMULATOR_PAGE_COUNT> rom_image_pages(const RomImage& image)
+{
+    std::array<const uint8_t*, EMULATOR_PAGE_COUNT> pages;
+    for (int page = 0; page < EMULATOR_PAGE_COUNT; page++)
+    {
+        pages[page] = image.memory.data() + (page * EMULATOR_PAGE_SIZE);
+    }
+
+    return pages;
+}
+
+
+std::array<const DecodedOp*, EMULATOR_PAGE_COUNT> rom_image_decoded_pages(const RomImage& image)
+{
+    std::array<const DecodedOp*, EMULATOR_PAGE_COUNT> pages;
+    for (int page = 0; page < EMULATOR_PAGE_COUNT; page++)
+    {
+        pages[page] = image.decoded.data() + (page * EMULATOR_PAGE_SIZE);
+    }
+
+    return pages;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+//Fixed size queue for one producer thread and one consumer thread. No locks, no allocations.
+//SIZE has to be a power of two. Push fails instead of waiting when the queue is full
+template <typename T, size_t SIZE>
+struct SpscQueue
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "SpscQueue SIZE has to be a power of two");
+
+    T items[SIZE];
+
+    //Both only ever count up. The difference is how many items are queued
+    alignas(64) std::atomic<size_t> head{0}; //next item to pop. written by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; //next free slot. written by the producer
+
+    SpscQueue() = default;
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    //Producer side
+    bool Push(const T& item)
+    {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        if ((current_tail - head.load(std::memory_order_acquire)) == SIZE)
+        {
+            return false;
+        }
+
+        items[current_tail & (SIZE - 1)] = item;
+        tail.store(current_tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    //Consumer side. The oldest item, or nullptr if the queue is empty. Stays valid until Pop
+    const T* Peek() const
+    {
+        size_t current_head = head.load(std::memory_order_relaxed);
+        if (current_head == tail.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+
+        return &items[current_head & (SIZE - 1)];
+    }
+
+    //Consumer side. Only after Peek returned an item
+    void Pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool Pop(T* out)
+    {
+        const T* item = Peek();
+        if (item == nullptr)
+        {
+            return false;
+        }
+
+        *out = *item;
+        Pop();
+        return true;
+    }
+
+    size_t Count() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+};
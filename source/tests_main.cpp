@@ -0,0 +1,701 @@
+//Consistency checks for the emulator core. Every check runs the same programs two ways that have to agree
+//(decode cache on and off, JIT and interpreter, batch and single, save state round trips, rewind, movies)
+//and compares save states. Exits with a failure code if any check fails.
+//Usage: chip8-tests
+#include "emulator.hpp"
+#include "batch_emulator.hpp"
+#include "rewind.hpp"
+#include "movie.hpp"
+
+#include <filesystem>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+static const int TEST_PROGRAM_COUNT = 300; //per check that runs random programs
+static const int TEST_FRAME_COUNT = 200;
+
+
+typedef int (*TestFunc)(); //returns the number of failures
+
+struct Test
+{
+    const char* name;
+    TestFunc run;
+};
+
+
+//xorshift so the programs are the same with every compiler
+static uint64_t test_random_state = 1;
+
+static void test_seed(int seed)
+{
+    test_random_state = 0x9E3779B97F4A7C15ull * (uint64_t)(seed + 1);
+}
+
+static uint32_t test_random()
+{
+    test_random_state ^= test_random_state << 13;
+    test_random_state ^= test_random_state >> 7;
+    test_random_state ^= test_random_state << 17;
+    return (uint32_t)(test_random_state >> 16);
+}
+
+
+static int test_mode(int program)
+{
+    static const int modes[] = { COMP_MODE_COSMAC, COMP_MODE_MODERN, COMP_MODE_AMIGA };
+    return modes[program % 3];
+}
+
+
+//Random instructions with jumps, calls and BNNN aimed inside the first window bytes of the program.
+//A small window makes tight loops, the kind the JIT keeps inside one block
+static uint16_t test_random_instruction(int window)
+{
+    for (;;)
+    {
+        uint16_t instruction = (uint16_t)test_random();
+        int group = instruction >> 12;
+
+        switch (group)
+        {
+            case 0x0:
+            {
+                int pick = test_random() % 3;
+                if (pick == 0) return 0x00E0;
+                if (pick == 1) return 0x00EE;
+            } break;
+
+            case 0x1:
+            case 0x2:
+            case 0xB:
+            {
+                if ((test_random() % 3) != 0) break;
+                return (uint16_t)((instruction & 0xF000) | (0x200 + ((test_random() % (window / 2)) * 2)));
+            }
+
+            case 0xA: return (uint16_t)(0xA000 | (test_random() % 0x1000));
+            case 0xE: return (uint16_t)((instruction & 0xFF00) | ((test_random() & 1) ? 0x9E : 0xA1));
+
+            case 0xF:
+            {
+                static const uint8_t low[] = { 0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65 };
+                return (uint16_t)((instruction & 0xFF00) | low[test_random() % sizeof(low)]);
+            }
+
+            default: return instruction;
+        }
+    }
+}
+
+
+static std::vector<uint8_t> test_random_program(int instruction_count, int window)
+{
+    std::vector<uint8_t> program(instruction_count * 2);
+    for (int i = 0; i < instruction_count; i++)
+    {
+        uint16_t instruction = test_random_instruction(window);
+        program[i*2] = (uint8_t)(instruction >> 8);
+        program[i*2 + 1] = (uint8_t)(instruction & 0xFF);
+    }
+    return program;
+}
+
+
+static void test_load(Emulator* emu, const std::vector<uint8_t>& program, int mode, uint64_t seed)
+{
+    emu->Init();
+    emu->compatibility_mode = mode;
+    emu->SetSeed(seed);
+    emu->LoadRom(rom_image_from_buffer(program.data(), (int)program.size(), NULL));
+    emu->running = true;
+}
+
+
+static bool test_same_state(const Emulator& a, const Emulator& b)
+{
+    std::vector<uint8_t> state_a;
+    std::vector<uint8_t> state_b;
+    a.SaveState(&state_a);
+    b.SaveState(&state_b);
+    return state_a == state_b;
+}
+
+
+//Same keys to both, every few frames
+static void test_random_keys(Emulator* a, Emulator* b, int frame)
+{
+    if ((frame % 7) != 0) return;
+
+    int key = "0123456789ABCDEF"[test_random() % 16];
+    uint8_t state = (uint8_t)(test_random() & 1);
+    a->SetKey(key, state);
+    b->SetKey(key, state);
+}
+
+
+//Runs two emulators over random programs and compares them after every frame
+static int test_compare_random(bool jit, bool uncached, int window)
+{
+    int failures = 0;
+    for (int p = 0; p < TEST_PROGRAM_COUNT; p++)
+    {
+        test_seed(p);
+        std::vector<uint8_t> program = test_random_program(0x100, window);
+
+        Emulator* reference = new Emulator();
+        Emulator* emu = new Emulator();
+        test_load(reference, program, test_mode(p), p);
+        test_load(emu, program, test_mode(p), p);
+        reference->skip_idle_loops = emu->skip_idle_loops = ((p & 1) != 0);
+        reference->use_decode_cache = !uncached;
+        if (jit) emu->SetJitEnabled(true);
+
+        for (int f = 0; f < TEST_FRAME_COUNT; f++)
+        {
+            test_random_keys(reference, emu, f);
+            reference->Update();
+            emu->Update();
+
+            if (test_same_state(*reference, *emu) == false)
+            {
+                printf("  program %d differs at frame %d, pc %03X/%03X\n", p, f, reference->program_counter, emu->program_counter);
+                failures++;
+                break;
+            }
+        }
+
+        delete reference;
+        delete emu;
+    }
+
+    return failures;
+}
+
+
+static int test_decode_cache()
+{
+    return test_compare_random(false, true, 0x200);
+}
+
+
+static int test_jit()
+{
+    return test_compare_random(true, false, 0x200);
+}
+
+
+static int test_jit_tight_loops()
+{
+    return test_compare_random(true, false, 0x30);
+}
+
+
+//Programs that store into their own code around the page boundary at 0x300, so decoded slots on both pages
+//have to be dropped when they're written. Cached and uncached decoding have to agree
+static int test_self_modifying_code()
+{
+    int failures = 0;
+    for (int p = 0; p < TEST_PROGRAM_COUNT * 4; p++)
+    {
+        test_seed(p);
+        std::vector<uint8_t> program(0x300);
+        for (size_t i = 0; i < program.size(); i += 2)
+        {
+            uint16_t instruction;
+            switch (test_random() % 6)
+            {
+                case 0: instruction = (uint16_t)(0xA000 | (0x2F0 + (test_random() % 0x30))); break; //I near 0x300
+                case 1: instruction = (uint16_t)(0xF055 | ((test_random() % 4) << 8)); break;
+                case 2: instruction = (uint16_t)(0x6000 | ((test_random() % 4) << 8) | (test_random() & 0xFF)); break;
+                case 3: instruction = (uint16_t)(0x1000 | (0x2F8 + (test_random() % 0x10))); break; //odd addresses too
+                case 4: instruction = (uint16_t)(0xF033 | ((test_random() % 4) << 8)); break;
+                default: instruction = (uint16_t)(0x7000 | ((test_random() % 4) << 8) | (test_random() & 0xFF)); break;
+            }
+            program[i] = (uint8_t)(instruction >> 8);
+            program[i+1] = (uint8_t)(instruction & 0xFF);
+        }
+
+        Emulator cached;
+        Emulator uncached;
+        test_load(&cached, program, COMP_MODE_MODERN, 1);
+        test_load(&uncached, program, COMP_MODE_MODERN, 1);
+        uncached.use_decode_cache = false;
+        cached.skip_idle_loops = uncached.skip_idle_loops = false;
+
+        for (int f = 0; f < 300; f++)
+        {
+            int count = 1 + ((f * 7) % 20);
+            cached.ExecuteInstructions(count);
+            uncached.ExecuteInstructions(count);
+
+            //Reset has to bring back the ROM's code, not the rewritten one
+            if (f == 150)
+            {
+                cached.Reset();
+                uncached.Reset();
+            }
+        }
+
+        if (test_same_state(cached, uncached) == false)
+        {
+            printf("  program %d differs, pc %03X/%03X\n", p, cached.program_counter, uncached.program_counter);
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+
+//Emulators loaded from the same ROM image share its pages until they write to them
+static int test_copy_on_write()
+{
+    int failures = 0;
+
+    //v0 = 7, I = 0x300, store v0, BCD of v0, loop
+    const uint8_t program[] = { 0x60, 0x07, 0xA3, 0x00, 0xF0, 0x55, 0xF0, 0x33, 0x12, 0x00 };
+    std::shared_ptr<const RomImage> image = rom_image_from_buffer(program, sizeof(program), NULL);
+
+    Emulator a;
+    Emulator b;
+    a.Init();
+    b.Init();
+    a.LoadRom(image);
+    b.LoadRom(image);
+
+    std::vector<uint8_t> pristine;
+    b.SaveState(&pristine);
+
+    if ((a.owned_pages != 0) || (b.owned_pages != 0))
+    {
+        printf("  pages are copied on load\n");
+        failures++;
+    }
+
+    a.ExecuteInstructions(3);
+    if ((a.ReadMemory(0x300) != 7) || (a.owned_pages == 0))
+    {
+        printf("  the writing emulator doesn't see its writes\n");
+        failures++;
+    }
+    if ((b.ReadMemory(0x300) != 0) || (b.owned_pages != 0) || (image->memory[0x300] != 0))
+    {
+        printf("  a write leaked into the shared image\n");
+        failures++;
+    }
+
+    //Loading a state that matches the image has to read the same as a fresh emulator
+    a.LoadState(pristine.data(), (int)pristine.size());
+    if (test_same_state(a, b) == false)
+    {
+        printf("  loading the pristine state doesn't match a fresh emulator\n");
+        failures++;
+    }
+
+    //Jump written into the shared code page. The writer runs it, the other emulator doesn't see it
+    a.LoadRom(image);
+    a.WriteMemory(0x208, 0x13);
+    a.WriteMemory(0x209, 0x00);
+    a.ExecuteInstructions(5);
+    if ((a.program_counter != 0x300) || (b.ReadMemory(0x208) != 0x12))
+    {
+        printf("  code written to a shared page, pc %03X\n", a.program_counter);
+        failures++;
+    }
+
+    return failures;
+}
+
+
+static int test_save_state()
+{
+    int failures = 0;
+    for (int p = 0; p < TEST_PROGRAM_COUNT; p++)
+    {
+        test_seed(p);
+        std::vector<uint8_t> program = test_random_program(0x100, 0x200);
+
+        Emulator a;
+        Emulator b;
+        test_load(&a, program, test_mode(p), p);
+        test_load(&b, test_random_program(0x100, 0x200), test_mode(p), p + 1);
+        if (p & 1)
+        {
+            a.SetJitEnabled(true);
+            b.SetJitEnabled(true);
+        }
+
+        //b has run other code, so loading has to drop its decoded and compiled code
+        b.Update();
+        for (int f = 0; f < 50; f++) a.Update();
+
+        std::vector<uint8_t> state;
+        a.SaveState(&state);
+        if (b.LoadState(state.data(), (int)state.size()) == false)
+        {
+            printf("  program %d, loading failed\n", p);
+            failures++;
+            continue;
+        }
+
+        for (int f = 0; f < 50; f++)
+        {
+            a.Update();
+            b.Update();
+        }
+
+        if (test_same_state(a, b) == false)
+        {
+            printf("  program %d differs after loading\n", p);
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+
+//Damaged states are refused and leave the emulator as it was
+static int test_load_state_validation()
+{
+    int failures = 0;
+
+    test_seed(0);
+    Emulator emu;
+    test_load(&emu, test_random_program(0x100, 0x200), COMP_MODE_MODERN, 0);
+    for (int f = 0; f < 10; f++) emu.Update();
+
+    std::vector<uint8_t> good;
+    emu.SaveState(&good);
+
+    struct Damage
+    {
+        const char* what;
+        int offset;
+        uint8_t value;
+        int size;
+    };
+    const Damage damage[] = {
+        { "magic", 0, 0x00, SAVE_STATE_SIZE },
+        { "version", 4, 0x7F, SAVE_STATE_SIZE },
+        { "program counter", SAVE_STATE_REGISTERS_OFFSET + 3, 0x10, SAVE_STATE_SIZE }, //0x10XX is past the end of memory
+        { "stack pointer", SAVE_STATE_REGISTERS_OFFSET + 4, EMULATOR_STACK_SIZE, SAVE_STATE_SIZE },
+        { "last key", SAVE_STATE_REGISTERS_OFFSET + 8, EMULATOR_KEY_COUNT, SAVE_STATE_SIZE },
+        { "size", 0, good[0], SAVE_STATE_SIZE - 1 },
+    };
+
+    for (const Damage& d : damage)
+    {
+        std::vector<uint8_t> bad = good;
+        bad[d.offset] = d.value;
+
+        if (emu.LoadState(bad.data(), d.size))
+        {
+            printf("  a state with a bad %s was loaded\n", d.what);
+            failures++;
+        }
+
+        std::vector<uint8_t> after;
+        emu.SaveState(&after);
+        if (after != good)
+        {
+            printf("  a state with a bad %s changed the emulator\n", d.what);
+            failures++;
+        }
+    }
+
+    if (emu.LoadState(NULL, SAVE_STATE_SIZE))
+    {
+        printf("  a null state was loaded\n");
+        failures++;
+    }
+
+    return failures;
+}
+
+
+//Lanes of a batch have to end up exactly where single emulators running the same program do
+static int test_batch()
+{
+    const int LANE_COUNT = 40;
+
+    int failures = 0;
+    for (int p = 0; p < 30; p++)
+    {
+        test_seed(p);
+        int mode = test_mode(p);
+        int instructions_per_frame = 20 + (p % 3);
+
+        BatchEmulator* batch = new BatchEmulator();
+        batch->Init(LANE_COUNT);
+        batch->compatibility_mode = mode;
+        batch->SetInstructionsPerFrame(instructions_per_frame);
+
+        //A few different programs so lanes diverge
+        std::vector<std::vector<uint8_t>> programs;
+        for (int i = 0; i < 4; i++) programs.push_back(test_random_program(0x100, 0x200));
+
+        std::vector<Emulator*> emus(LANE_COUNT);
+        for (int lane = 0; lane < LANE_COUNT; lane++)
+        {
+            const std::vector<uint8_t>& program = programs[lane % programs.size()];
+            emus[lane] = new Emulator();
+            test_load(emus[lane], program, mode, lane);
+            emus[lane]->SetInstructionsPerFrame(instructions_per_frame);
+            emus[lane]->defer_draw = true;
+
+            batch->LoadProgram(lane, program.data(), (int)program.size());
+            batch->SetSeed(lane, lane);
+        }
+
+        for (int f = 0; f < TEST_FRAME_COUNT; f++)
+        {
+            for (int lane = 0; lane < LANE_COUNT; lane++)
+            {
+                if ((test_random() % 7) != 0) continue;
+
+                int key = test_random() % 16;
+                uint8_t state = test_random() & 1;
+                Keypad& keypad = emus[lane]->keypad;
+                if (state || keypad.keys[key])
+                {
+                    keypad.keys[key] = state;
+                    if (state)
+                    {
+                        keypad.key_just_pressed = true;
+                        keypad.last_key_pressed = (uint8_t)key;
+                    }
+                }
+                batch->SetKeypadKey(lane, key, state);
+            }
+
+            for (int lane = 0; lane < LANE_COUNT; lane++) emus[lane]->Update();
+            batch->Update();
+        }
+
+        Emulator stored;
+        stored.Init();
+        for (int lane = 0; lane < LANE_COUNT; lane++)
+        {
+            batch->StoreLane(lane, &stored);
+            stored.random_seed = emus[lane]->random_seed;
+            if (test_same_state(*emus[lane], stored) == false)
+            {
+                printf("  batch %d lane %d differs\n", p, lane);
+                failures++;
+            }
+            delete emus[lane];
+        }
+
+        delete batch;
+    }
+
+    return failures;
+}
+
+
+//Every frame restored from the rewind buffer has to be the state that was recorded
+static int test_rewind()
+{
+    int failures = 0;
+    for (int p = 0; p < 20; p++)
+    {
+        test_seed(p);
+        Emulator emu;
+        test_load(&emu, test_random_program(0x80, 0x100), test_mode(p), p);
+
+        Rewind rewind;
+        rewind.Init((p % 2) ? 0 : 3000000, 1 + (p % 70));
+
+        std::vector<std::vector<uint8_t>> states;
+        for (int f = 0; f < 2000; f++)
+        {
+            if (((test_random() % 10) == 0) && (states.size() > 2))
+            {
+                for (int back = test_random() % 5; (back > 0) && (rewind.FrameCount() >= 2); back--)
+                {
+                    if (rewind.StepBack(&emu) == false)
+                    {
+                        printf("  run %d, stepping back failed\n", p);
+                        failures++;
+                    }
+                    states.pop_back();
+
+                    std::vector<uint8_t> state;
+                    emu.SaveState(&state);
+                    if (state != states.back())
+                    {
+                        printf("  run %d frame %d, stepping back differs\n", p, f);
+                        failures++;
+                    }
+                }
+            }
+
+            emu.SetKey("0123456789ABCDEF"[test_random() % 16], test_random() & 1);
+            emu.Update();
+            emu.LateUpdate();
+            rewind.Record(&emu);
+
+            std::vector<uint8_t> state;
+            emu.SaveState(&state);
+            states.push_back(state);
+        }
+
+        int count = rewind.FrameCount();
+        for (int back = 0; back < count; back += 1 + (test_random() % 7))
+        {
+            Emulator restored;
+            restored.Init();
+
+            std::vector<uint8_t> state;
+            if (rewind.Restore(&restored, back)) restored.SaveState(&state);
+            if (state != states[states.size() - 1 - back])
+            {
+                printf("  run %d, restoring %d frames back differs\n", p, back);
+                failures++;
+                break;
+            }
+        }
+
+        if (rewind.Restore(&emu, count))
+        {
+            printf("  run %d, restoring past the oldest frame worked\n", p);
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+
+//Records a session, saves and loads the movie, then plays it back and seeks around in it
+static int test_movie()
+{
+    std::wstring filename = (std::filesystem::temp_directory_path() / "chip8-tests.c8m").wstring();
+
+    //Wait for a key, draw something random, loop while reading keys
+    const uint8_t program[] = {
+        0xF0, 0x0A, 0xC1, 0x3F, 0xC2, 0x1F, 0xA2, 0x00, 0xD1, 0x25,
+        0xE0, 0x9E, 0x12, 0x00, 0x70, 0x01, 0x12, 0x02
+    };
+
+    int failures = 0;
+    for (int p = 0; p < 30; p++)
+    {
+        test_seed(p);
+        std::vector<uint8_t> rom(0x100);
+        for (size_t i = 0; i < rom.size(); i++) rom[i] = (i < sizeof(program)) ? program[i] : (uint8_t)test_random();
+
+        Emulator emu;
+        test_load(&emu, rom, COMP_MODE_MODERN, p);
+        emu.input_slices = 1 + (p % 5);
+        if (p & 1) emu.SetJitEnabled(true);
+        for (int f = 0; f < 30; f++) emu.Update();
+
+        Movie movie;
+        movie.snapshot_interval = 1 + (test_random() % 100);
+        movie.StartRecording(&emu);
+
+        int start = emu.tic;
+        std::vector<std::vector<uint8_t>> states;
+        for (int f = 0; f < 1000; f++)
+        {
+            for (int k = test_random() % 3; k > 0; k--)
+            {
+                emu.SetKey("0123456789ABCDEF"[test_random() % 16], test_random() & 1);
+            }
+
+            movie.OnFrame(&emu);
+            emu.Update();
+            emu.LateUpdate();
+
+            std::vector<uint8_t> state;
+            emu.SaveState(&state);
+            states.push_back(state);
+        }
+        movie.StopRecording(&emu);
+
+        Movie loaded;
+        if ((movie.SaveToFile(filename.c_str()) == false) || (loaded.LoadFromFile(filename.c_str()) == false))
+        {
+            printf("  saving or loading the movie failed\n");
+            failures++;
+            break;
+        }
+
+        Emulator player;
+        player.Init();
+        player.running = true;
+        if (p & 2) player.SetJitEnabled(true);
+
+        loaded.StartPlayback(&player);
+        for (int f = 0; f < 1000; f++)
+        {
+            player.SetKey('1', 1); //live input is ignored while playing
+
+            loaded.OnFrame(&player);
+            player.Update();
+            player.LateUpdate();
+
+            std::vector<uint8_t> state;
+            player.SaveState(&state);
+            if (state != states[f])
+            {
+                printf("  movie %d differs at frame %d\n", p, f);
+                failures++;
+                break;
+            }
+        }
+
+        loaded.StartPlayback(&player);
+        for (int s = 0; s < 20; s++)
+        {
+            int frame = start + 1 + (test_random() % 1000);
+
+            std::vector<uint8_t> state;
+            if (loaded.Seek(&player, frame)) player.SaveState(&state);
+            if (state != states[frame - start - 1])
+            {
+                printf("  movie %d, seeking to frame %d differs\n", p, frame - start);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    std::filesystem::remove(filename);
+    return failures;
+}
+
+
+int main()
+{
+    const Test tests[] = {
+        { "copy_on_write", test_copy_on_write },
+        { "self_modifying_code", test_self_modifying_code },
+        { "decode_cache", test_decode_cache },
+        { "jit", test_jit },
+        { "jit_tight_loops", test_jit_tight_loops },
+        { "save_state", test_save_state },
+        { "load_state_validation", test_load_state_validation },
+        { "batch", test_batch },
+        { "rewind", test_rewind },
+        { "movie", test_movie },
+    };
+
+    int failed = 0;
+    for (const Test& test : tests)
+    {
+        int failures = test.run();
+        printf("%s %s\n", (failures == 0) ? "ok  " : "FAIL", test.name);
+        if (failures) failed++;
+    }
+
+    printf("%d of %d checks failed\n", failed, (int)(sizeof(tests) / sizeof(tests[0])));
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,99 @@
+#include "thread_pool.hpp"
+
+
+ThreadPool::~ThreadPool()
+{
+    Destroy();
+}
+
+
+void ThreadPool::Init(int thread_count)
+{
+    if (thread_count <= 0)
+    {
+        thread_count = (int)std::thread::hardware_concurrency();
+        if (thread_count <= 0)
+        {
+            thread_count = 1;
+        }
+    }
+
+    quitting = false;
+    for (int i = 1; i < thread_count; i++)
+    {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+
+void ThreadPool::Destroy()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+    }
+    work_ready.notify_all();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+    workers.clear();
+}
+
+
+void ThreadPool::Run(ThreadPoolTask new_task, void* new_context, int count)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = new_task;
+        context = new_context;
+        task_count = count;
+        next_index.store(0);
+        busy_workers = (int)workers.size();
+        generation++;
+    }
+    work_ready.notify_all();
+
+    Work();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    work_done.wait(lock, [this] { return busy_workers == 0; });
+}
+
+
+void ThreadPool::Work()
+{
+    while (true)
+    {
+        int index = next_index.fetch_add(1);
+        if (index >= task_count) break;
+
+        task(context, index);
+    }
+}
+
+
+void ThreadPool::WorkerLoop()
+{
+    unsigned seen_generation = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_ready.wait(lock, [&] { return quitting || (generation != seen_generation); });
+
+            if (quitting) return;
+            seen_generation = generation;
+        }
+
+        Work();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy_workers--;
+        }
+        work_done.notify_one();
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Runs task(context, index) for every index in [0, count) across the workers
+typedef void (*ThreadPoolTask)(void* context, int index);
+
+//Fixed set of worker threads for parallel for loops. The thread calling Run works on the loop too.
+//Tasks are handed out one index at a time so uneven tasks still keep every thread busy
+struct ThreadPool
+{
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    //The loop currently running. Only changed by Run while every worker is idle
+    ThreadPoolTask task = nullptr;
+    void* context = nullptr;
+    int task_count = 0;
+    std::atomic<int> next_index{0};
+
+    int busy_workers = 0;
+    unsigned generation = 0; //bumped for every Run so workers know there is new work
+    bool quitting = false;
+
+    ThreadPool() = default;
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    //thread_count includes the calling thread. 0 uses one thread per hardware thread
+    void Init(int thread_count);
+    void Destroy();
+
+    int ThreadCount() const { return (int)workers.size() + 1; }
+
+    //Blocks until every index ran
+    void Run(ThreadPoolTask new_task, void* new_context, int count);
+
+    void Work(); //pulls indices until there are none left
+    void WorkerLoop();
+};
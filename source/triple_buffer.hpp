@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+//Hands the newest value from one writer thread to one reader thread without locks and without either side waiting.
+//The writer always has a slot to fill, the reader always has the newest finished one to look at. Values the reader
+//was too slow to see are simply overwritten
+template <typename T>
+struct TripleBuffer
+{
+    static const uint8_t INDEX_MASK = 3;
+    static const uint8_t FRESH_BIT = 4; //the writer published into the middle slot and the reader hasn't taken it yet
+
+    T slots[3];
+
+    //The slot between the two sides. Only ever swapped, so each slot belongs to exactly one side or the middle
+    alignas(64) std::atomic<uint8_t> middle{1};
+
+    alignas(64) uint8_t back = 0; //writer only
+    alignas(64) uint8_t front = 2; //reader only
+
+    TripleBuffer() = default;
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    //Writer side. Fill the slot, then Publish it
+    T& WriteSlot() { return slots[back]; }
+
+    void Publish()
+    {
+        uint8_t old = middle.exchange((uint8_t)(back | FRESH_BIT), std::memory_order_acq_rel);
+        back = old & INDEX_MASK;
+    }
+
+    //Reader side. Returns true if a newer value was published since the last call. ReadSlot is that value then
+    bool Acquire()
+    {
+        if ((middle.load(std::memory_order_relaxed) & FRESH_BIT) == 0)
+        {
+            return false;
+        }
+
+        uint8_t old = middle.exchange(front, std::memory_order_acq_rel);
+        front = old & INDEX_MASK;
+        return true;
+    }
+
+    const T& ReadSlot() const { return slots[front]; }
+};
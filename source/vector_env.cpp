@@ -0,0 +1,250 @@
+#include "vector_env.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+
+int EnvRamValue::Read(const Emulator* emu) const
+{
+    if (address < 0) return 0;
+
+    int value = 0;
+    for (int i = 0; i < size; i++)
+    {
+        uint8_t byte = emu->ReadMemory((uint16_t)((address + i) % EMULATOR_RAM_SIZE));
+        if (format == ENV_VALUE_DIGITS)
+        {
+            value = (value * 10) + (byte % 10);
+        }
+        else
+        {
+            value = (value << 8) | byte;
+        }
+    }
+
+    return value;
+}
+
+
+VectorEnv::~VectorEnv()
+{
+    Destroy();
+}
+
+
+bool VectorEnv::Init(const EnvConfig& new_config, int new_env_count, ThreadPool* new_pool)
+{
+    Destroy();
+
+    int error;
+    rom = rom_image_from_buffer(new_config.rom.data(), (int)new_config.rom.size(), &error);
+    if (rom == nullptr)
+    {
+        printf("WARNING: The environment's ROM can't be loaded. %s\n", rom_error_string(error));
+        return false;
+    }
+
+    config = new_config;
+    if (config.frame_skip < 1)
+    {
+        config.frame_skip = 1;
+    }
+    if ((config.ram_start < 0) || (config.ram_size < 0) || ((config.ram_start + config.ram_size) > EMULATOR_RAM_SIZE))
+    {
+        config.ram_start = 0;
+        config.ram_size = 0;
+    }
+
+    env_count = (new_env_count > 0) ? new_env_count : 1;
+    pool = new_pool;
+
+    //Every environment shares the ROM's memory. Only the pages a game writes to are copied
+    emulators.resize(env_count);
+    for (int i = 0; i < env_count; i++)
+    {
+        emulators[i] = new Emulator();
+        emulators[i]->Init();
+        emulators[i]->SetCompatibilityMode(config.compatibility_mode);
+        emulators[i]->SetInstructionsPerFrame(config.instructions_per_frame);
+        emulators[i]->LoadRom(rom);
+        emulators[i]->defer_draw = true; //nobody looks at the bitmap
+    }
+
+    held_keys.assign(env_count, ENV_NO_KEY);
+    episode_frames.assign(env_count, 0);
+    episodes.assign(env_count, 0);
+    last_scores.assign(env_count, 0);
+
+    displays.assign((config.observations & ENV_OBSERVE_DISPLAY) ? (size_t)env_count * DISPLAY_HEIGHT : 0, 0);
+    ram.assign((config.observations & ENV_OBSERVE_RAM) ? (size_t)env_count * config.ram_size : 0, 0);
+    rewards.assign(env_count, 0);
+    dones.assign(env_count, 0);
+
+    return true;
+}
+
+
+void VectorEnv::Destroy()
+{
+    for (Emulator* emu : emulators)
+    {
+        delete emu;
+    }
+    emulators.clear();
+    env_count = 0;
+}
+
+
+EnvStep VectorEnv::Results() const
+{
+    EnvStep step;
+    step.displays = displays.data();
+    step.ram = ram.data();
+    step.rewards = rewards.data();
+    step.dones = dones.data();
+    return step;
+}
+
+
+static void vector_env_reset_chunk(void* context, int chunk)
+{
+    VectorEnv* env = (VectorEnv*)context;
+
+    int end = (chunk + 1) * ENV_CHUNK_SIZE;
+    for (int i = chunk * ENV_CHUNK_SIZE; (i < end) && (i < env->env_count); i++)
+    {
+        env->ResetEnv(i);
+        env->rewards[i] = 0;
+        env->dones[i] = 0;
+        env->Observe(i);
+    }
+}
+
+
+static void vector_env_step_chunk(void* context, int chunk)
+{
+    VectorEnv* env = (VectorEnv*)context;
+
+    int end = (chunk + 1) * ENV_CHUNK_SIZE;
+    for (int i = chunk * ENV_CHUNK_SIZE; (i < end) && (i < env->env_count); i++)
+    {
+        env->StepEnv(i, env->step_actions[i]);
+    }
+}
+
+
+static void vector_env_run(VectorEnv* env, ThreadPoolTask task)
+{
+    int chunk_count = (env->env_count + ENV_CHUNK_SIZE - 1) / ENV_CHUNK_SIZE;
+
+    if (env->pool)
+    {
+        env->pool->Run(task, env, chunk_count);
+        return;
+    }
+
+    for (int chunk = 0; chunk < chunk_count; chunk++)
+    {
+        task(env, chunk);
+    }
+}
+
+
+EnvStep VectorEnv::Reset()
+{
+    vector_env_run(this, vector_env_reset_chunk);
+    return Results();
+}
+
+
+EnvStep VectorEnv::Step(const int* actions)
+{
+    step_actions = actions;
+    vector_env_run(this, vector_env_step_chunk);
+    step_actions = nullptr;
+
+    return Results();
+}
+
+
+void VectorEnv::ResetEnv(int index)
+{
+    Emulator* emu = emulators[index];
+
+    emu->Reset();
+    emu->SetSeed(config.seed + (uint64_t)index + ((uint64_t)episodes[index] * env_count));
+    emu->LateUpdate();
+
+    held_keys[index] = ENV_NO_KEY;
+    episode_frames[index] = 0;
+    episodes[index]++;
+    last_scores[index] = config.score.Read(emu);
+}
+
+
+void VectorEnv::StepEnv(int index, int action)
+{
+    if (dones[index])
+    {
+        ResetEnv(index);
+    }
+
+    Emulator* emu = emulators[index];
+
+    //Only changes are passed on, so holding an action doesn't look like the key being pressed again every step
+    int key = ((action >= 0) && (action < ActionCount())) ? config.action_keys[action] : ENV_NO_KEY;
+    if (key != held_keys[index])
+    {
+        if (held_keys[index] != ENV_NO_KEY)
+        {
+            emu->SetKeypadKey(held_keys[index], 0);
+        }
+        if (key != ENV_NO_KEY)
+        {
+            emu->SetKeypadKey(key, 1);
+        }
+        held_keys[index] = key;
+    }
+
+    bool done = false;
+    for (int frame = 0; frame < config.frame_skip; frame++)
+    {
+        emu->Update();
+        emu->LateUpdate();
+        episode_frames[index]++;
+
+        if ((config.done_value.address >= 0) && (config.done_value.Read(emu) == config.done_equals))
+        {
+            done = true;
+        }
+        if ((config.max_episode_frames > 0) && (episode_frames[index] >= config.max_episode_frames))
+        {
+            done = true;
+        }
+        if (done) break;
+    }
+
+    int score = config.score.Read(emu);
+    rewards[index] = (float)(score - last_scores[index]);
+    last_scores[index] = score;
+    dones[index] = done ? 1 : 0;
+
+    Observe(index);
+}
+
+
+void VectorEnv::Observe(int index)
+{
+    const Emulator* emu = emulators[index];
+
+    if (config.observations & ENV_OBSERVE_DISPLAY)
+    {
+        memcpy(displays.data() + ((size_t)index * DISPLAY_HEIGHT), emu->display.data(),
+        DISPLAY_HEIGHT * sizeof(DisplayRow));
+    }
+
+    if (config.observations & ENV_OBSERVE_RAM)
+    {
+        emu->ReadMemoryBlock(config.ram_start, config.ram_size, ram.data() + ((size_t)index * config.ram_size));
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "emulator.hpp"
+#include "thread_pool.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+//A batch of emulators driven like a reinforcement learning environment. Step takes one action per environment,
+//holds the action's key for frame_skip frames and hands back observations, rewards and whether the episode ended.
+//Nothing is drawn and nothing is allocated while stepping, the environments are spread over a ThreadPool
+const int ENV_NO_KEY = -1; //an action that holds no key
+const int ENV_CHUNK_SIZE = 16; //environments per thread pool task
+
+enum
+{
+    ENV_OBSERVE_DISPLAY = 1 << 0, //the packed display, DISPLAY_HEIGHT rows per environment
+    ENV_OBSERVE_RAM = 1 << 1 //ram_size bytes of memory from ram_start
+};
+
+enum
+{
+    ENV_VALUE_BINARY, //size bytes, most significant first
+    ENV_VALUE_DIGITS //size bytes holding one decimal digit each, most significant first. What FX33 writes
+};
+
+
+//A number a game keeps in memory, like its score or lives
+struct EnvRamValue
+{
+    int address = -1; //-1 doesn't read anything, the value is always 0
+    int size = 1;
+    int format = ENV_VALUE_BINARY;
+
+    int Read(const Emulator* emu) const;
+};
+
+
+//Everything that's specific to one ROM
+struct EnvConfig
+{
+    std::vector<uint8_t> rom;
+    int compatibility_mode = COMP_MODE_COSMAC;
+    int instructions_per_frame = EMULATOR_DEFAULT_INSTRUCTIONS_PER_FRAME;
+
+    //Action i holds keypad key action_keys[i], or ENV_NO_KEY
+    std::vector<int> action_keys;
+    int frame_skip = 4; //frames each action is held for
+
+    int observations = ENV_OBSERVE_DISPLAY;
+    int ram_start = 0;
+    int ram_size = 0;
+
+    //The reward is how much score went up over the step
+    EnvRamValue score;
+
+    //The episode ends once done_value reads done_equals, or after max_episode_frames (0 is no limit)
+    EnvRamValue done_value;
+    int done_equals = 0;
+    int max_episode_frames = 0;
+
+    //Environment i's episode n is seeded with seed + i + (n * environment count)
+    uint64_t seed = 0;
+};
+
+
+//Where Step's results are. Valid until the next Step or Reset
+struct EnvStep
+{
+    const DisplayRow* displays; //DISPLAY_HEIGHT rows per environment
+    const uint8_t* ram; //EnvConfig::ram_size bytes per environment
+    const float* rewards;
+    const uint8_t* dones;
+};
+
+
+struct VectorEnv
+{
+    EnvConfig config;
+    int env_count = 0;
+
+    std::vector<Emulator*> emulators;
+    std::shared_ptr<const RomImage> rom; //every episode starts from it, see Emulator::Reset
+
+    //Per environment
+    std::vector<int> held_keys;
+    std::vector<int> episode_frames;
+    std::vector<uint32_t> episodes;
+    std::vector<int> last_scores;
+
+    //Results, allocated once by Init
+    std::vector<DisplayRow> displays;
+    std::vector<uint8_t> ram;
+    std::vector<float> rewards;
+    std::vector<uint8_t> dones;
+
+    ThreadPool* pool = nullptr; //nullptr steps everything on the calling thread
+    const int* step_actions = nullptr; //the actions of the Step in progress, for the pool tasks
+
+    VectorEnv() = default;
+    ~VectorEnv();
+
+    VectorEnv(const VectorEnv&) = delete;
+    VectorEnv& operator=(const VectorEnv&) = delete;
+
+    //Returns false if the ROM can't be loaded
+    bool Init(const EnvConfig& new_config, int new_env_count, ThreadPool* new_pool);
+    void Destroy();
+
+    //Starts a new episode in every environment
+    EnvStep Reset();
+
+    //actions has one entry per environment, an index into action_keys. Environments that were done last step
+    //start a new episode first, so the final observation of an episode is always seen
+    EnvStep Step(const int* actions);
+
+    int ActionCount() const { return (int)config.action_keys.size(); }
+
+    //Internal
+    void ResetEnv(int index);
+    void StepEnv(int index, int action);
+    void Observe(int index);
+    EnvStep Results() const;
+};